@@ -40,6 +40,44 @@ static inline uint64_t ce_handler_create(ce_handler_t0 *handler,
     return hid;
 }
 
+// Create n handlers, free indexes are reused in one move.
+static inline void ce_handler_create_n(ce_handler_t0 *handler,
+                                       uint64_t *out,
+                                       uint32_t n,
+                                       const ce_alloc_t0 *allocator) {
+    uint32_t free_n = ce_array_size(handler->free_idx);
+    uint32_t reuse_n = 0;
+
+    if (free_n > _MINFREEINDEXS) {
+        reuse_n = free_n - _MINFREEINDEXS;
+        if (reuse_n > n) {
+            reuse_n = n;
+        }
+
+        for (uint32_t i = 0; i < reuse_n; ++i) {
+            uint64_t idx = handler->free_idx[i];
+            out[i] = (idx << _GENBITCOUNT) | (handler->generation[idx]);
+        }
+
+        memmove(handler->free_idx, handler->free_idx + reuse_n,
+                sizeof(uint64_t) * (free_n - reuse_n));
+        ce_array_header(handler->free_idx)->size -= reuse_n;
+    }
+
+    uint32_t new_n = n - reuse_n;
+    if (!new_n) {
+        return;
+    }
+
+    uint32_t first = ce_array_size(handler->generation);
+    ce_array_resize(handler->generation, first + new_n, allocator);
+    memset(handler->generation + first, 0, new_n);
+
+    for (uint32_t i = 0; i < new_n; ++i) {
+        out[reuse_n + i] = ((uint64_t) (first + i)) << _GENBITCOUNT;
+    }
+}
+
 static inline void ce_handler_destroy(ce_handler_t0 *handler,
                                       uint64_t handlerid,
                                       const ce_alloc_t0 *allocator) {
@@ -49,6 +87,26 @@ static inline void ce_handler_destroy(ce_handler_t0 *handler,
     ce_array_push(handler->free_idx, id, allocator);
 }
 
+// Destroy n handlers, free indexes are pushed at once.
+static inline void ce_handler_destroy_n(ce_handler_t0 *handler,
+                                        const uint64_t *handlerid,
+                                        uint32_t n,
+                                        const ce_alloc_t0 *allocator) {
+    if (!n) {
+        return;
+    }
+
+    uint32_t free_n = ce_array_size(handler->free_idx);
+    ce_array_resize(handler->free_idx, free_n + n, allocator);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t id = handler_idx(handlerid[i]);
+
+        handler->generation[id] += 1;
+        handler->free_idx[free_n + i] = id;
+    }
+}
+
 static inline bool ce_handler_alive(ce_handler_t0 *handler,
                                     uint64_t handlerid) {
     return handler->generation[handler_idx(handlerid)] == handler_gen(handlerid);
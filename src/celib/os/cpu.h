@@ -13,9 +13,29 @@ extern "C" {
 #define CE_OS_CPU_API \
     CE_ID64_0("ce_os_cpu_a0", 0x41ff4437e99cbff7ULL)
 
+typedef struct ce_cpu_info_t0 {
+    // Logical cpu id (used for affinity)
+    uint32_t id;
+
+    // Physical core id inside package
+    uint32_t core;
+    uint32_t package;
+
+    // NUMA node
+    uint32_t node;
+
+    // Index between hyperthread siblings of one core, 0 = first sibling
+    uint32_t smt;
+} ce_cpu_info_t0;
+
 struct ce_os_cpu_a0 {
     // Get cpu core count
     int (*count)(void);
+
+    // Get usable logical cpus (process affinity) with topology.
+    // Fill max cpus, return filled count.
+    uint32_t (*topology)(ce_cpu_info_t0 *cpus,
+                         uint32_t max);
 };
 
 
@@ -1,13 +1,120 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <include/SDL2/SDL_cpuinfo.h>
 
+#include <celib/platform.h>
 #include <celib/os/cpu.h>
 
+#if CE_PLATFORM_LINUX
+
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define SYS_CPU "/sys/devices/system/cpu/cpu%u"
+#define MAX_NODES 64
+
+static bool _read_sys_uint(const char *fmt,
+                           uint32_t cpu,
+                           uint32_t *value) {
+    char path[128];
+    snprintf(path, sizeof(path), fmt, cpu);
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+
+    bool ok = 1 == fscanf(f, "%u", value);
+    fclose(f);
+
+    return ok;
+}
+
+static uint32_t _cpu_node(uint32_t cpu) {
+    char path[128];
+
+    for (uint32_t node = 0; node < MAX_NODES; ++node) {
+        snprintf(path, sizeof(path), SYS_CPU"/node%u", cpu, node);
+
+        if (0 == access(path, F_OK)) {
+            return node;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t _linux_topology(ce_cpu_info_t0 *cpus,
+                                uint32_t max) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (0 != sched_getaffinity(0, sizeof(set), &set)) {
+        return 0;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; (i < CPU_SETSIZE) && (n < max); ++i) {
+        if (!CPU_ISSET(i, &set)) {
+            continue;
+        }
+
+        ce_cpu_info_t0 *cpu = &cpus[n];
+        *cpu = (ce_cpu_info_t0) {
+                .id = i,
+                .core = i,
+                .node = _cpu_node(i),
+        };
+
+        _read_sys_uint(SYS_CPU"/topology/core_id", i, &cpu->core);
+        _read_sys_uint(SYS_CPU"/topology/physical_package_id", i,
+                       &cpu->package);
+
+        for (uint32_t j = 0; j < n; ++j) {
+            if ((cpus[j].package == cpu->package) &&
+                (cpus[j].core == cpu->core)) {
+                ++cpu->smt;
+            }
+        }
+
+        ++n;
+    }
+
+    return n;
+}
+
+#endif
+
 int cpu_count() {
     return SDL_GetCPUCount();
 }
 
+uint32_t cpu_topology(ce_cpu_info_t0 *cpus,
+                      uint32_t max) {
+    uint32_t n = 0;
+
+#if CE_PLATFORM_LINUX
+    n = _linux_topology(cpus, max);
+#endif
+
+    // No topology info, every cpu is one core.
+    if (!n) {
+        uint32_t count = SDL_GetCPUCount();
+
+        for (; (n < count) && (n < max); ++n) {
+            cpus[n] = (ce_cpu_info_t0) {.id = n, .core = n};
+        }
+    }
+
+    return n;
+}
+
 struct ce_os_cpu_a0 cpu_api = {
-        .count = cpu_count
+        .count = cpu_count,
+        .topology = cpu_topology,
 };
 
 struct ce_os_cpu_a0 *ce_os_cpu_a0 = &cpu_api;
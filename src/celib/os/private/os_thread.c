@@ -1,3 +1,7 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include "include/SDL2/SDL.h"
 #include <celib/platform.h>
 
@@ -71,6 +75,36 @@ void thread_spin_unlock(ce_spinlock_t0 *lock) {
     SDL_AtomicUnlock((SDL_SpinLock *) lock);
 }
 
+ce_sem_t0 thread_sem_create(uint32_t value) {
+    return (ce_sem_t0) {.o=(uint64_t) SDL_CreateSemaphore(value)};
+}
+
+void thread_sem_destroy(ce_sem_t0 sem) {
+    SDL_DestroySemaphore((SDL_sem *) sem.o);
+}
+
+void thread_sem_post(ce_sem_t0 sem) {
+    SDL_SemPost((SDL_sem *) sem.o);
+}
+
+bool thread_sem_wait(ce_sem_t0 sem,
+                     uint32_t timeout_ms) {
+    return 0 == SDL_SemWaitTimeout((SDL_sem *) sem.o, timeout_ms);
+}
+
+bool thread_set_affinity(uint32_t core) {
+#if CE_PLATFORM_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+
+    return 0 == sched_setaffinity(0, sizeof(set), &set);
+#else
+    (void) core;
+    return false;
+#endif
+}
+
 struct ce_os_thread_a0 thread_api = {
         .create = thread_create,
         .kill = thread_kill,
@@ -79,7 +113,12 @@ struct ce_os_thread_a0 thread_api = {
         .actual_id = thread_actual_id,
         .yield = thread_yield,
         .spin_lock = thread_spin_lock,
-        .spin_unlock = thread_spin_unlock
+        .spin_unlock = thread_spin_unlock,
+        .sem_create = thread_sem_create,
+        .sem_destroy = thread_sem_destroy,
+        .sem_post = thread_sem_post,
+        .sem_wait = thread_sem_wait,
+        .set_affinity = thread_set_affinity,
 };
 
 struct ce_os_thread_a0 *ce_os_thread_a0 = &thread_api;
@@ -23,6 +23,10 @@ typedef struct ce_spinlock_t0 {
     uint64_t o;
 } ce_spinlock_t0;
 
+typedef struct ce_sem_t0 {
+    uint64_t o;
+} ce_sem_t0;
+
 struct ce_os_thread_a0 {
     // Create new thread
     // - fce Thread fce
@@ -54,6 +58,26 @@ struct ce_os_thread_a0 {
     void (*spin_lock)(ce_spinlock_t0 *lock);
 
     void (*spin_unlock)(ce_spinlock_t0 *lock);
+
+    // Create semaphore
+    // - value Initial value
+    ce_sem_t0 (*sem_create)(uint32_t value);
+
+    // Destroy semaphore
+    void (*sem_destroy)(ce_sem_t0 sem);
+
+    // Increment semaphore and wake one waiting thread
+    void (*sem_post)(ce_sem_t0 sem);
+
+    // Wait for semaphore
+    // - timeout_ms Timeout in ms
+    // Return false on timeout
+    bool (*sem_wait)(ce_sem_t0 sem,
+                     uint32_t timeout_ms);
+
+    // Pin current thread to core
+    // Return false if pinning is not supported
+    bool (*set_affinity)(uint32_t core);
 };
 
 
@@ -0,0 +1,49 @@
+#ifndef CE_FIBER_H
+#define CE_FIBER_H
+
+//==============================================================================
+// Includes
+//==============================================================================
+
+#include <celib/platform.h>
+
+#if CE_PLATFORM_OSX
+// Deprecated ucontext routines require _XOPEN_SOURCE.
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <ucontext.h>
+
+//==============================================================================
+// Implementation
+//==============================================================================
+
+typedef struct fiber_t {
+    ucontext_t ctx;
+} fiber_t;
+
+void fiber_init(struct fiber_t *fiber,
+                uint8_t *stack,
+                uint32_t stack_size,
+                void (*fce)()) {
+    getcontext(&fiber->ctx);
+
+    fiber->ctx.uc_stack.ss_sp = stack;
+    fiber->ctx.uc_stack.ss_size = stack_size;
+    fiber->ctx.uc_link = NULL;
+
+    makecontext(&fiber->ctx, fce, 0);
+}
+
+// Save current context to from and jump to to.
+void fiber_switch(struct fiber_t *from,
+                  struct fiber_t *to) {
+    swapcontext(&from->ctx, &to->ctx);
+}
+
+// Jump to to, current context is lost.
+void fiber_jump(struct fiber_t *to) {
+    setcontext(&to->ctx);
+}
+
+#endif //CE_FIBER_H
@@ -65,10 +65,11 @@ void queue_task_destroy(struct queue_mpmc *q) {
 }
 
 uint32_t queue_task_size(struct queue_mpmc *q) {
-    uint32_t e = atomic_load(&q->_enqueuePos) & q->_capacityMask;
-    uint32_t d = atomic_load(&q->_dequeuePos) & q->_capacityMask;
+    // Full queue has e & mask == d & mask, so use unmasked positions.
+    uint32_t e = (uint32_t) atomic_load(&q->_enqueuePos);
+    uint32_t d = (uint32_t) atomic_load(&q->_dequeuePos);
 
-    return e > d ? e - d : d - e;
+    return e - d;
 }
 
 int queue_task_push(struct queue_mpmc *q,
@@ -0,0 +1,142 @@
+#ifndef CE_QUEUE_WS_H
+#define CE_QUEUE_WS_H
+
+//==============================================================================
+// Includes
+//==============================================================================
+
+#include <stdatomic.h>
+
+#include <celib/macros.h>
+#include "celib/memory/allocator.h"
+
+//==============================================================================
+// Implementation
+//==============================================================================
+
+// Chase-Lev work-stealing deque.
+// Owner push/pop on bottom (LIFO), other workers steal from top (FIFO).
+// based on: "Correct and Efficient Work-Stealing for Weak Memory Models"
+//           (Le, Pop, Cohen, Zappa Nardelli - PPoPP 2013)
+
+typedef struct queue_ws {
+    atomic_llong _top;
+    cache_line_pad_t _pad1;
+    atomic_llong _bottom;
+    cache_line_pad_t _pad2;
+    _Atomic uint32_t *_data;
+    int64_t _capacityMask;
+    ce_alloc_t0 *allocator;
+} queue_ws;
+
+void queue_ws_init(struct queue_ws *q,
+                   uint32_t capacity,
+                   struct ce_alloc_t0 *allocator) {
+    *q = (struct queue_ws) {};
+
+    q->_capacityMask = capacity - 1;
+    q->allocator = allocator;
+
+    // capacity must be power of two
+    CE_ASSERT("QUEUEWS", 0 == (capacity & q->_capacityMask));
+
+    q->_data = CE_ALLOC(allocator, _Atomic uint32_t,
+                        sizeof(_Atomic uint32_t) * capacity);
+
+    for (uint32_t i = 0; i < capacity; ++i) {
+        atomic_init(q->_data + i, 0);
+    }
+
+    atomic_init(&q->_top, 0);
+    atomic_init(&q->_bottom, 0);
+}
+
+void queue_ws_destroy(struct queue_ws *q) {
+    CE_FREE(q->allocator, q->_data);
+}
+
+uint32_t queue_ws_size(struct queue_ws *q) {
+    int64_t b = atomic_load_explicit(&q->_bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&q->_top, memory_order_relaxed);
+
+    return b > t ? (uint32_t) (b - t) : 0;
+}
+
+// Owner only.
+int queue_ws_push(struct queue_ws *q,
+                  uint32_t value) {
+    int64_t b = atomic_load_explicit(&q->_bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&q->_top, memory_order_acquire);
+
+    if ((b - t) > q->_capacityMask) {
+        return 0;
+    }
+
+    atomic_store_explicit(&q->_data[b & q->_capacityMask], value,
+                          memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->_bottom, b + 1, memory_order_relaxed);
+
+    return 1;
+}
+
+// Owner only.
+int queue_ws_pop(struct queue_ws *q,
+                 uint32_t *value) {
+    int64_t b = atomic_load_explicit(&q->_bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&q->_bottom, b, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int64_t t = atomic_load_explicit(&q->_top, memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        atomic_store_explicit(&q->_bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+
+    *value = atomic_load_explicit(&q->_data[b & q->_capacityMask],
+                                  memory_order_relaxed);
+
+    if (t != b) {
+        return 1;
+    }
+
+    // Last item, race with thieves.
+    int ok = atomic_compare_exchange_strong_explicit(&q->_top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed);
+
+    atomic_store_explicit(&q->_bottom, b + 1, memory_order_relaxed);
+    return ok;
+}
+
+// Any thread.
+int queue_ws_steal(struct queue_ws *q,
+                   uint32_t *value) {
+    int64_t t = atomic_load_explicit(&q->_top, memory_order_acquire);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    int64_t b = atomic_load_explicit(&q->_bottom, memory_order_acquire);
+
+    if (t >= b) {
+        return 0;
+    }
+
+    uint32_t v = atomic_load_explicit(&q->_data[t & q->_capacityMask],
+                                      memory_order_relaxed);
+
+    if (!atomic_compare_exchange_strong_explicit(&q->_top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return 0;
+    }
+
+    *value = v;
+    return 1;
+}
+
+#endif //CE_QUEUE_WS_H
@@ -5,14 +5,22 @@
 
 #include <celib/api.h>
 #include <celib/memory/memory.h>
+#include <celib/memory/allocator.h>
 
 #include <celib/log.h>
+#include <celib/config.h>
 #include <celib/task.h>
 #include <celib/module.h>
 #include <celib/os/thread.h>
 #include <celib/os/cpu.h>
+#include <celib/os/time.h>
+#include <celib/os/vio.h>
+#include <celib/containers/buffer.h>
+#include <celib/containers/array.h>
 
 #include "queue_mpmc.inl"
+#include "queue_ws.inl"
+#include "fiber.inl"
 
 
 //==============================================================================
@@ -21,8 +29,39 @@
 
 #define make_task(i) (task_id_t){.id = i}
 
-#define MAX_TASK 4096
-#define MAX_COUNTERS 4096
+#define TASK_QUEUE_SIZE 4096
+
+// Task and counter pools grow by pages, max 16M live items.
+#define POOL_PAGE_SIZE 4096
+#define POOL_MAX_PAGES 4096
+
+// Idle worker spin (adaptive between min/max) and yield before park.
+#define TASK_SPIN_MIN 32
+#define TASK_SPIN_MAX 4096
+#define TASK_YIELD_COUNT 16
+
+// Batch submit wake parked workers every N pushed tasks, not only at end.
+#define TASK_WAKE_BATCH 64
+
+// Parked workers wake up periodically as safety net for lost wakeups.
+#define TASK_PARK_TIMEOUT_MS 100
+#define TASK_WAIT_FOREVER UINT32_MAX
+
+// Fiber pool defaults for task.fiber_count and task.fiber_stack_size
+#define TASK_FIBER_COUNT 128
+#define TASK_FIBER_STACK_SIZE (256 * 1024)
+
+// Lanes are popped by priority but every 8th pop try normal first and every
+// 32th background first, so lower lanes never starve.
+#define TASK_NORMAL_TURN 8
+#define TASK_BACKGROUND_TURN 32
+
+// Max logical cpus for worker placement
+#define TASK_MAX_CPUS 256
+
+// Trace ring per thread, must be power of two.
+#define TASK_TRACE_EVENTS 16384
+
 #define LOG_WHERE "taskmanager"
 #define _G TaskManagerGlobal
 
@@ -31,14 +70,112 @@
 //==============================================================================
 
 typedef struct task_t {
+    _Atomic uint32_t next_free;
+    uint32_t counter;
+
+    // Next task in pending chain (add_after)
+    uint32_t next;
+    uint8_t priority;
+
     void *data;
 
     void (*task_work)(void *data);
 
     const char *name;
-    uint32_t counter;
+
+    // parallel_for range, task_work is NULL
+    ce_task_range_fce_t0 *range_work;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t grain;
 } task_t;
 
+// Counter is alive until owner wait/release it and it is completed.
+// On completion continuation list is closed and continuations released.
+typedef struct counter_t {
+    _Atomic uint32_t next_free;
+    uint32_t idx;
+    atomic_int value;
+    atomic_int refs;
+    _Atomic uint32_t cont_head;
+
+    // Semaphore of thread sleeping in wait_for_counter_no_work.
+    _Atomic uint64_t waiter;
+} counter_t;
+
+// Tasks waiting for predecessor counters.
+typedef struct pending_t {
+    _Atomic uint32_t next_free;
+    atomic_int deps;
+    uint32_t first_task;
+    uint32_t task_n;
+    uint32_t counter;
+} pending_t;
+
+// Continuation list node, release pending tasks or resume waiting fiber.
+typedef struct cont_t {
+    _Atomic uint32_t next_free;
+    uint32_t next;
+    uint32_t pending;
+    uint32_t fiber;
+} cont_t;
+
+// Executed by next fiber after switch, when previous fiber is off the stack.
+typedef struct fiber_op_t {
+    uint32_t free_fiber;
+    uint32_t wait_fiber;
+    counter_t *wait_counter;
+} fiber_op_t;
+
+#define CONT_CLOSED UINT32_MAX
+
+typedef struct worker_t {
+    fiber_t thread_fiber;
+    ce_sem_t0 park_sem;
+    ce_sem_t0 wait_sem;
+    atomic_bool parked;
+    uint32_t spin_count;
+
+    // Pinned cpu, -1 = not pinned
+    int32_t core;
+
+    // Stats in perf counter ticks, written only by owner.
+    _Atomic uint64_t idle_ticks;
+    _Atomic uint64_t parked_ticks;
+    _Atomic uint64_t park_count;
+    _Atomic uint64_t wakeup_count;
+} worker_t;
+
+// Lock-free paged pool. Idx 0 is reserved as null.
+// Free slots form a tagged stack (tag << 32 | idx) threaded through next_free.
+typedef struct pool_t {
+    _Atomic(uint8_t *) pages[POOL_MAX_PAGES];
+    atomic_uint next_idx;
+    _Atomic uint64_t free_head;
+    uint32_t item_size;
+} pool_t;
+
+typedef struct trace_event_t {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+    uint32_t worker_id;
+} trace_event_t;
+
+// Written only by owner thread, dump read last TASK_TRACE_EVENTS events.
+typedef struct trace_ring_t {
+    trace_event_t *events;
+    _Atomic uint64_t head;
+} trace_ring_t;
+
+// Service thread outside worker pool, has own worker_id.
+typedef struct service_t {
+    ce_thread_t0 thread;
+    ce_task_item_t0 item;
+    uint32_t worker_id;
+    int32_t core;
+} service_t;
+
 typedef struct {
     uint32_t id;
 } task_id_t;
@@ -46,285 +183,1623 @@ typedef struct {
 static const task_id_t task_null = (task_id_t) {.id = 0};
 
 static struct _G {
-    ce_thread_t0 workers[TASK_MAX_WORKERS - 1];
+    ce_thread_t0 workers[TASK_MAX_WORKERS];
 
-    // TASK
-    task_t task_pool[MAX_TASK];
-    atomic_int task_pool_idx;
-    queue_mpmc free_task;
+    pool_t task_pool;
+    pool_t counter_pool;
+    pool_t pending_pool;
+    pool_t cont_pool;
 
-    // COUNTERS
-    atomic_int counter_pool_idx;
-    atomic_int counter_pool[MAX_COUNTERS];
-    queue_mpmc free_counter;
+    // Active workers are [0, workers_count), service threads
+    // [workers_count, threads_count). Read by workers without lock.
+    atomic_uint workers_count;
+    atomic_uint threads_count;
 
-    uint32_t workers_count;
+    service_t service[TASK_MAX_WORKERS];
+    uint32_t service_count;
+    ce_spinlock_t0 service_lock;
 
-    queue_mpmc job_queue;
+    // Wait semaphores of threads outside workers and services
+    ce_sem_t0 *thread_sems;
+    ce_spinlock_t0 thread_sem_lock;
+
+    // Global queue for tasks from non worker threads and overflow.
+    queue_mpmc job_queue[TASK_PRIORITY_COUNT];
+    queue_ws worker_queue[TASK_MAX_WORKERS][TASK_PRIORITY_COUNT];
     queue_mpmc specific_job_queue[TASK_MAX_WORKERS];
 
+    worker_t worker[TASK_MAX_WORKERS];
+    atomic_uint parked_count;
+
+    // Fibers, idx 0 is null
+    bool fibers;
+    uint32_t fiber_count;
+    uint32_t fiber_stack_size;
+    fiber_t *fiber_pool;
+    uint8_t *fiber_stack;
+    queue_mpmc fiber_free;
+    queue_mpmc fiber_ready;
+
+    // Trace
+    atomic_bool tracing;
+    uint64_t trace_start;
+    char *trace_file;
+    trace_ring_t trace_ring[TASK_MAX_WORKERS];
+
     atomic_bool is_running;
     ce_alloc_t0 *allocator;
 } _G;
 
 // Private
 static __thread uint8_t _worker_id = 0;
-
-
-char worker_id() {
+static __thread bool _is_worker = false;
+static __thread uint32_t _steal_seed = 0;
+static __thread uint32_t _pop_n = 0;
+// Lane of running task, caller outside task wait for parallel_for => critical.
+static __thread uint8_t _cur_priority = TASK_PRIORITY_CRITICAL;
+static __thread uint32_t _fiber_cur = 0;
+static __thread fiber_op_t _fiber_op = {};
+
+// Workers and services sleep on wait_sem of their worker_t, other threads
+// (worker_id 0 like main thread) get own semaphore on first wait.
+static __thread uint64_t _wait_sem = 0;
+
+// No inline: fiber can resume on other thread, TLS address must be reloaded.
+CE_NO_INLINE char worker_id() {
     return _worker_id;
 }
 
 //==============================================================================
 //==============================================================================
 
-static task_id_t _new_task() {
-    uint32_t idx;
-    queue_task_pop(&_G.free_task, &idx, UINT32_MAX);
+int do_work();
 
-    if (idx == UINT32_MAX) {
-        idx = atomic_fetch_add(&_G.task_pool_idx, 1);
+static void _wake_workers(uint32_t count);
+
+static void _pool_init(pool_t *pool,
+                       uint32_t item_size) {
+    for (uint32_t i = 0; i < POOL_MAX_PAGES; ++i) {
+        atomic_init(&pool->pages[i], NULL);
     }
 
-    return make_task(idx);
+    atomic_init(&pool->next_idx, 1);
+    atomic_init(&pool->free_head, 0);
+    pool->item_size = item_size;
 }
 
-static uint32_t _new_counter_task(uint32_t value) {
-    uint32_t idx;
-    queue_task_pop(&_G.free_counter, &idx, UINT32_MAX);
+static void _pool_destroy(pool_t *pool) {
+    for (uint32_t i = 0; i < POOL_MAX_PAGES; ++i) {
+        uint8_t *page = atomic_load(&pool->pages[i]);
+        if (page) {
+            CE_FREE(_G.allocator, page);
+        }
+    }
+}
 
-    if (idx == UINT32_MAX) {
-        idx = atomic_fetch_add(&_G.counter_pool_idx, 1);
+static inline void *_pool_item(pool_t *pool,
+                               uint32_t idx) {
+    uint8_t *page = atomic_load_explicit(&pool->pages[idx / POOL_PAGE_SIZE],
+                                         memory_order_acquire);
+
+    return page + ((idx % POOL_PAGE_SIZE) * pool->item_size);
+}
+
+static void _pool_alloc_page(pool_t *pool,
+                             uint32_t page_idx) {
+    if (atomic_load_explicit(&pool->pages[page_idx], memory_order_acquire)) {
+        return;
     }
 
-    atomic_int *counter = &_G.counter_pool[idx];
-    atomic_init(counter, value);
+    uint8_t *new_page = CE_ALLOC(_G.allocator, uint8_t,
+                                 pool->item_size * POOL_PAGE_SIZE);
 
-    return idx;
+    uint8_t *expected = NULL;
+    if (!atomic_compare_exchange_strong(&pool->pages[page_idx],
+                                        &expected, new_page)) {
+        CE_FREE(_G.allocator, new_page);
+    }
 }
 
-static void _push_task(queue_mpmc *q, task_id_t t) {
-    queue_task_push(q, t.id);
+// Return 0 if pool is exhausted.
+static uint32_t _pool_alloc(pool_t *pool) {
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_acquire);
+
+    while ((uint32_t) head) {
+        _Atomic uint32_t *next_free = _pool_item(pool, (uint32_t) head);
+        uint32_t next = atomic_load_explicit(next_free, memory_order_relaxed);
+
+        uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+
+        if (atomic_compare_exchange_weak_explicit(&pool->free_head,
+                                                  &head, new_head,
+                                                  memory_order_acquire,
+                                                  memory_order_acquire)) {
+            return (uint32_t) head;
+        }
+    }
+
+    uint32_t idx = atomic_load_explicit(&pool->next_idx, memory_order_relaxed);
+    do {
+        if (idx >= (POOL_MAX_PAGES * POOL_PAGE_SIZE)) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&pool->next_idx,
+                                                    &idx, idx + 1,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    _pool_alloc_page(pool, idx / POOL_PAGE_SIZE);
+
+    return idx;
 }
 
+static void _pool_free(pool_t *pool,
+                       uint32_t idx) {
+    _Atomic uint32_t *next_free = _pool_item(pool, idx);
 
-static task_id_t _try_pop(struct queue_mpmc *q) {
-    uint32_t poped_task;
+    uint64_t head = atomic_load_explicit(&pool->free_head, memory_order_relaxed);
+    uint64_t new_head;
 
-    if (!queue_task_size(q)) {
-        return task_null;
+    do {
+        atomic_store_explicit(next_free, (uint32_t) head, memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | idx;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->free_head,
+                                                    &head, new_head,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+// Pool exhausted => backpressure, help with work until some slot is free.
+static uint32_t _pool_alloc_wait(pool_t *pool) {
+    uint32_t idx = _pool_alloc(pool);
+
+    if (idx) {
+        return idx;
     }
 
-    if (queue_task_pop(q, &poped_task, 0)) {
-        if (poped_task != 0) {
-            return make_task(poped_task);
+    ce_log_a0->warning(LOG_WHERE, "Pool exhausted, waiting for free slot.");
+
+    while (!(idx = _pool_alloc(pool))) {
+        if (!do_work()) {
+            ce_os_thread_a0->yield();
         }
     }
 
-    return task_null;
+    return idx;
 }
 
-static task_id_t _task_pop_new_work() {
-    task_id_t pop_task;
-    queue_mpmc *qg = &_G.job_queue;
+static inline task_t *_get_task(task_id_t t) {
+    return _pool_item(&_G.task_pool, t.id);
+}
 
-    int wid = worker_id();
-    pop_task = _try_pop(&_G.specific_job_queue[wid]);
-    if (pop_task.id != 0) {
-        return pop_task;
+static inline counter_t *_get_counter(uint32_t idx) {
+    return _pool_item(&_G.counter_pool, idx);
+}
+
+static task_id_t _new_task() {
+    return make_task(_pool_alloc_wait(&_G.task_pool));
+}
+
+static uint32_t _new_counter_task(uint32_t value) {
+    uint32_t idx = _pool_alloc_wait(&_G.counter_pool);
+
+    counter_t *counter = _get_counter(idx);
+    counter->idx = idx;
+    atomic_store_explicit(&counter->refs, 2, memory_order_relaxed);
+    atomic_store_explicit(&counter->cont_head, 0, memory_order_relaxed);
+    atomic_store_explicit(&counter->waiter, 0, memory_order_relaxed);
+    atomic_store_explicit(&counter->value, value, memory_order_release);
+
+    return idx;
+}
+
+static void _push_task(queue_mpmc *q, task_id_t t) {
+    while (!queue_task_push(q, t.id)) {
+        // Queue is full, parked workers must drain it too.
+        _wake_workers(UINT32_MAX);
+        do_work();
     }
+}
 
-    pop_task = _try_pop(qg);
-    if (pop_task.id != 0) {
-        return pop_task;
+static void _push_new_task(task_id_t t) {
+    uint8_t priority = _get_task(t)->priority;
+
+    if (_is_worker &&
+        queue_ws_push(&_G.worker_queue[_worker_id][priority], t.id)) {
+        return;
     }
 
-    return task_null;
+    _push_task(&_G.job_queue[priority], t);
 }
 
+static CE_NO_INLINE uint8_t _current_priority() {
+    return _cur_priority;
+}
 
-int do_work() {
-    task_id_t t = _task_pop_new_work();
+static CE_NO_INLINE void _set_current_priority(uint8_t priority) {
+    _cur_priority = priority;
+}
 
-    if (t.id == 0) {
-        return 0;
+static inline void _cpu_relax() {
+#if CE_CPU_X86
+    __builtin_ia32_pause();
+#endif
+}
+
+static bool _has_work(uint32_t wid) {
+    if (queue_task_size(&_G.specific_job_queue[wid])) {
+        return true;
     }
 
-    task_t *task = &_G.task_pool[t.id];
+    for (uint32_t i = _G.workers_count; i < _G.threads_count; ++i) {
+        if (queue_task_size(&_G.specific_job_queue[i])) {
+            return true;
+        }
+    }
 
-    task->task_work(task->data);
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        if (queue_task_size(&_G.job_queue[i])) {
+            return true;
+        }
+    }
 
-    atomic_fetch_sub(&_G.counter_pool[task->counter], 1);
-    queue_task_push(&_G.free_task, t.id);
+    if (_G.fibers && queue_task_size(&_G.fiber_ready)) {
+        return true;
+    }
 
-    return 1;
+    for (uint32_t i = 0; i < _G.threads_count; ++i) {
+        for (uint32_t j = 0; j < TASK_PRIORITY_COUNT; ++j) {
+            if (queue_ws_size(&_G.worker_queue[i][j])) {
+                return true;
+            }
+        }
+    }
+
+    return false;
 }
 
-static int _task_worker(void *o) {
-    // Wait for run signal 0 -> 1
-    while (!_G.is_running) {
+// Claim parked worker (parked 1 -> 0) and post its semaphore.
+static bool _wake_worker(uint32_t wid) {
+    worker_t *w = &_G.worker[wid];
+
+    if (!atomic_load_explicit(&w->parked, memory_order_relaxed)) {
+        return false;
     }
 
-    _worker_id = (char) (uint64_t) o;
+    if (!atomic_exchange(&w->parked, false)) {
+        return false;
+    }
 
-    ce_log_a0->debug("task_worker", "Worker %d init", _worker_id);
+    atomic_fetch_sub(&_G.parked_count, 1);
+    ce_os_thread_a0->sem_post(w->park_sem);
+    return true;
+}
 
-    while (_G.is_running) {
-        if (!do_work()) {
-            ce_os_thread_a0->yield();
-        }
+// Pairs with parked store + _has_work recheck in _park_worker.
+static void _wake_workers(uint32_t count) {
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (!atomic_load_explicit(&_G.parked_count, memory_order_relaxed)) {
+        return;
     }
 
-    ce_log_a0->debug("task_worker", "Worker %d shutdown", _worker_id);
-    return 1;
+    for (uint32_t i = 1; (i < _G.workers_count) && count; ++i) {
+        if (_wake_worker(i)) {
+            --count;
+        }
+    }
 }
 
+static void _park_worker(uint32_t wid) {
+    worker_t *w = &_G.worker[wid];
+    uint64_t start = ce_os_time_a0->perf_counter();
 
-//==============================================================================
-// Api
-//==============================================================================
+    atomic_store(&w->parked, true);
+    atomic_fetch_add(&_G.parked_count, 1);
 
-void add(ce_task_item_t0 *items,
-         uint32_t count,
-         struct ce_task_counter_t0 **counter) {
-    uint32_t new_counter = _new_counter_task(count);
+    bool woken = false;
+    if (_G.is_running && !_has_work(wid)) {
+        woken = ce_os_thread_a0->sem_wait(w->park_sem, TASK_PARK_TIMEOUT_MS);
+    }
 
-    if (counter) {
-        *counter = (ce_task_counter_t0 *) &_G.counter_pool[new_counter];
+    if (!woken) {
+        if (atomic_exchange(&w->parked, false)) {
+            atomic_fetch_sub(&_G.parked_count, 1);
+        } else {
+            // Waker already claimed us, consume its post.
+            woken = ce_os_thread_a0->sem_wait(w->park_sem, TASK_WAIT_FOREVER);
+        }
     }
 
-    for (uint32_t i = 0; i < count; ++i) {
-        task_id_t task = _new_task();
-        _G.task_pool[task.id] = (task_t) {
-                .name = items[i].name,
-                .task_work = items[i].work,
-                .counter = new_counter
-        };
+    uint64_t ticks = ce_os_time_a0->perf_counter() - start;
+    atomic_fetch_add_explicit(&w->parked_ticks, ticks, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->park_count, 1, memory_order_relaxed);
+
+    if (woken) {
+        atomic_fetch_add_explicit(&w->wakeup_count, 1, memory_order_relaxed);
+    }
+}
 
-        _G.task_pool[task.id].data = items[i].data;
+static void _wake_counter_waiter(counter_t *counter) {
+    if (!atomic_load(&counter->waiter)) {
+        return;
+    }
 
-        _push_task(&_G.job_queue, task);
+    uint64_t sem = atomic_exchange(&counter->waiter, 0);
+    if (sem) {
+        ce_os_thread_a0->sem_post((ce_sem_t0) {.o=sem});
     }
 }
 
-void add_specific(uint32_t worker_id,
-                  ce_task_item_t0 *items,
-                  uint32_t count,
-                  ce_task_counter_t0 **counter) {
-    uint32_t new_counter = _new_counter_task(count);
+static void _counter_release(counter_t *counter) {
+    if (atomic_fetch_sub(&counter->refs, 1) == 1) {
+        _pool_free(&_G.counter_pool, counter->idx);
+    }
+}
 
-    if (counter) {
-        *counter = (ce_task_counter_t0 *) &_G.counter_pool[new_counter];
+static void _counter_dec(counter_t *counter);
+static void _fiber_ready(uint32_t fiber);
+
+// Last dependency done => push pending tasks.
+static void _pending_dep_done(uint32_t pending_idx) {
+    pending_t *pending = _pool_item(&_G.pending_pool, pending_idx);
+
+    if (atomic_fetch_sub(&pending->deps, 1) != 1) {
+        return;
     }
 
-    for (uint32_t i = 0; i < count; ++i) {
-        task_id_t task = _new_task();
-        _G.task_pool[task.id] = (task_t) {
-                .name = items[i].name,
-                .task_work = items[i].work,
-                .counter = new_counter
-        };
+    uint32_t task_idx = pending->first_task;
+    while (task_idx) {
+        uint32_t next = _get_task(make_task(task_idx))->next;
+        _push_new_task(make_task(task_idx));
+        task_idx = next;
+    }
 
-        _G.task_pool[task.id].data = items[i].data;
+    _wake_workers(pending->task_n);
 
-        _push_task(&_G.specific_job_queue[worker_id], task);
+    uint32_t counter_idx = pending->counter;
+    _pool_free(&_G.pending_pool, pending_idx);
+
+    if (counter_idx) {
+        _counter_dec(_get_counter(counter_idx));
     }
 }
 
+static void _counter_dec(counter_t *counter) {
+    if (atomic_fetch_sub(&counter->value, 1) == 1) {
+        uint32_t cont_idx = atomic_exchange(&counter->cont_head, CONT_CLOSED);
 
-void wait_atomic(ce_task_counter_t0 *signal,
-                 int32_t value) {
-    while (atomic_load_explicit((atomic_int *) signal, memory_order_acquire) !=
-           value) {
-        do_work();
+        while (cont_idx) {
+            cont_t *cont = _pool_item(&_G.cont_pool, cont_idx);
+            uint32_t next = cont->next;
+            uint32_t pending_idx = cont->pending;
+            uint32_t fiber = cont->fiber;
+
+            _pool_free(&_G.cont_pool, cont_idx);
+
+            if (fiber) {
+                _fiber_ready(fiber);
+            } else {
+                _pending_dep_done(pending_idx);
+            }
+
+            cont_idx = next;
+        }
+
+        _wake_counter_waiter(counter);
+        _counter_release(counter);
+        return;
     }
 
-    uint32_t counter_idx = ((atomic_int *) signal) - _G.counter_pool;
-    queue_task_push(&_G.free_counter, counter_idx);
+    _wake_counter_waiter(counter);
 }
 
-void wait_for_counter_no_work(ce_task_counter_t0 *signal,
-                              int32_t value) {
-    while (atomic_load_explicit((atomic_int *) signal, memory_order_acquire) !=
-           value) {
-        ce_os_thread_a0->yield();
+// Return false if counter is already completed.
+static bool _counter_add_cont(counter_t *counter,
+                              uint32_t pending_idx,
+                              uint32_t fiber) {
+    uint32_t cont_idx = _pool_alloc_wait(&_G.cont_pool);
+    cont_t *cont = _pool_item(&_G.cont_pool, cont_idx);
+    cont->pending = pending_idx;
+    cont->fiber = fiber;
+
+    uint32_t head = atomic_load(&counter->cont_head);
+    do {
+        if (head == CONT_CLOSED) {
+            _pool_free(&_G.cont_pool, cont_idx);
+            return false;
+        }
+
+        cont->next = head;
+    } while (!atomic_compare_exchange_weak(&counter->cont_head,
+                                           &head, cont_idx));
+
+    return true;
+}
+
+static uint32_t _steal_rand() {
+    // xorshift32
+    uint32_t x = _steal_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    _steal_seed = x;
+    return x;
+}
+
+
+static task_id_t _try_pop(struct queue_mpmc *q) {
+    uint32_t poped_task;
+
+    if (!queue_task_size(q)) {
+        return task_null;
+    }
+
+    if (queue_task_pop(q, &poped_task, 0)) {
+        if (poped_task != 0) {
+            return make_task(poped_task);
+        }
     }
 
-    uint32_t counter_idx = ((atomic_int *) signal) - _G.counter_pool;
-    queue_task_push(&_G.free_counter, counter_idx);
+    return task_null;
 }
 
+static task_id_t _try_steal(uint32_t wid,
+                            uint32_t priority) {
+    // Retired workers can have some tasks left => steal from all.
+    const uint32_t threads_count = _G.threads_count;
+    const uint32_t start = _steal_rand() % threads_count;
 
-int worker_count() {
-    return _G.workers_count;
+    for (uint32_t i = 0; i < threads_count; ++i) {
+        uint32_t victim = (start + i) % threads_count;
+
+        if (victim == wid) {
+            continue;
+        }
+
+        uint32_t poped_task;
+        if (queue_ws_steal(&_G.worker_queue[victim][priority], &poped_task)) {
+            return make_task(poped_task);
+        }
+    }
+
+    return task_null;
 }
 
-static struct ce_task_a0 _task_api = {
-        .worker_id = worker_id,
-        .worker_count = worker_count,
-        .add = add,
-        .add_specific = add_specific,
-        .wait_for_counter = wait_atomic,
-        .wait_for_counter_no_work = wait_for_counter_no_work,
+static const uint8_t _lane_order[3][TASK_PRIORITY_COUNT] = {
+        {TASK_PRIORITY_CRITICAL, TASK_PRIORITY_NORMAL, TASK_PRIORITY_BACKGROUND},
+        {TASK_PRIORITY_NORMAL, TASK_PRIORITY_CRITICAL, TASK_PRIORITY_BACKGROUND},
+        {TASK_PRIORITY_BACKGROUND, TASK_PRIORITY_CRITICAL, TASK_PRIORITY_NORMAL},
 };
 
-struct ce_task_a0 *ce_task_a0 = &_task_api;
+static task_id_t _task_pop_new_work() {
+    task_id_t pop_task;
 
-void CE_MODULE_LOAD(task)(struct ce_api_a0 *api,
-                          int reload) {
-    CE_UNUSED(reload);
+    int wid = worker_id();
+    pop_task = _try_pop(&_G.specific_job_queue[wid]);
+    if (pop_task.id != 0) {
+        return pop_task;
+    }
 
-    _G = (struct _G) {.allocator = ce_memory_a0->system};
+    // Added to worker that was retired meanwhile, service does not run them.
+    for (uint32_t i = _G.workers_count; i < _G.threads_count; ++i) {
+        pop_task = _try_pop(&_G.specific_job_queue[i]);
+        if (pop_task.id != 0) {
+            return pop_task;
+        }
+    }
 
-    api->add_api(CE_TASK_API, &_task_api, sizeof(_task_api));
+    uint32_t pop_n = ++_pop_n;
+    const uint8_t *order = _lane_order[0];
+
+    if (0 == (pop_n % TASK_BACKGROUND_TURN)) {
+        order = _lane_order[2];
+    } else if (0 == (pop_n % TASK_NORMAL_TURN)) {
+        order = _lane_order[1];
+    }
+
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        uint8_t lane = order[i];
+
+        if (_is_worker) {
+            uint32_t poped_task;
+            if (queue_ws_pop(&_G.worker_queue[wid][lane], &poped_task)) {
+                return make_task(poped_task);
+            }
+        }
 
-    int core_count = ce_os_cpu_a0->count();
-//    core_count = 4;
+        pop_task = _try_pop(&_G.job_queue[lane]);
+        if (pop_task.id != 0) {
+            return pop_task;
+        }
 
-    static const uint32_t main_threads_count = 1;
-    const uint32_t worker_count = core_count - main_threads_count;
+        pop_task = _try_steal(wid, lane);
+        if (pop_task.id != 0) {
+            return pop_task;
+        }
+    }
 
-    ce_log_a0->info("task", "Core/Main/Worker: %d, %d, %d",
-                    core_count, main_threads_count, worker_count);
+    return task_null;
+}
 
-    _G.workers_count = worker_count + 1;
 
-    queue_task_init(&_G.job_queue, MAX_TASK, _G.allocator);
-    queue_task_init(&_G.free_task, MAX_TASK, _G.allocator);
-    queue_task_init(&_G.free_counter, MAX_TASK, _G.allocator);
+// Split range in half until grain, second halves are pushed as new tasks.
+static void _range_work(ce_task_range_fce_t0 *fce,
+                        uint32_t begin,
+                        uint32_t end,
+                        uint32_t grain,
+                        void *data,
+                        uint32_t counter_idx,
+                        uint8_t priority) {
+    counter_t *counter = _get_counter(counter_idx);
 
-    atomic_init(&_G.counter_pool_idx, 1);
-    atomic_init(&_G.task_pool_idx, 1);
+    while ((end - begin) > grain) {
+        uint32_t mid = begin + ((end - begin) / 2);
 
-    for (uint32_t j = 1; j < worker_count + 1; ++j) {
-        _G.workers[j] = ce_os_thread_a0->create(_task_worker,
-                                                "cetech_worker",
-                                                (void *) ((intptr_t) (j)));
+        task_id_t task = _new_task();
+        task_t *t = _get_task(task);
+
+        t->name = "parallel_for";
+        t->task_work = NULL;
+        t->range_work = fce;
+        t->begin = mid;
+        t->end = end;
+        t->grain = grain;
+        t->data = data;
+        t->counter = counter_idx;
+        t->priority = priority;
+
+        atomic_fetch_add(&counter->value, 1);
+        _push_new_task(task);
+        _wake_workers(1);
+
+        end = mid;
+    }
+
+    fce(begin, end, data);
+}
+
+static void _fiber_ready(uint32_t fiber) {
+    _push_task(&_G.fiber_ready, make_task(fiber));
+    _wake_workers(1);
+}
+
+static CE_NO_INLINE uint32_t _fiber_current() {
+    return _fiber_cur;
+}
+
+static CE_NO_INLINE void _fiber_after_switch() {
+    fiber_op_t op = _fiber_op;
+    _fiber_op = (fiber_op_t) {};
+
+    if (op.free_fiber) {
+        queue_task_push(&_G.fiber_free, op.free_fiber);
     }
 
-    for (uint32_t j = 0; j < _G.workers_count; ++j) {
-        queue_task_init(&_G.specific_job_queue[j], MAX_TASK, _G.allocator);
+    if (op.wait_fiber) {
+        if (!_counter_add_cont(op.wait_counter, 0, op.wait_fiber)) {
+            _fiber_ready(op.wait_fiber);
+        }
     }
+}
 
+static CE_NO_INLINE void _fiber_switch(uint32_t to,
+                                       fiber_op_t op) {
+    uint32_t from = _fiber_cur;
 
-    _G.is_running = 1;
+    _fiber_op = op;
+    _fiber_cur = to;
+
+    fiber_switch(&_G.fiber_pool[from], &_G.fiber_pool[to]);
+
+    // Resumed, maybe on other worker.
+    _fiber_after_switch();
 }
 
-void CE_MODULE_UNLOAD(task)(struct ce_api_a0 *api,
-                            int reload) {
-    CE_UNUSED(reload);
-    CE_UNUSED(api);
+// Suspend current fiber until counter reach zero.
+// Return false if not on fiber or no fiber is available.
+static bool _fiber_wait(counter_t *counter) {
+    uint32_t cur = _fiber_current();
 
-    _G.is_running = 0;
-    int status = 0;
+    if (!cur) {
+        return false;
+    }
 
-    for (uint32_t i = 1; i < _G.workers_count; ++i) {
-        ce_os_thread_a0->wait(_G.workers[i], &status);
+    uint32_t next = 0;
+    if (!queue_task_pop(&_G.fiber_ready, &next, 0) &&
+        !queue_task_pop(&_G.fiber_free, &next, 0)) {
+        return false;
+    }
+
+    _fiber_switch(next, (fiber_op_t) {
+            .wait_fiber = cur,
+            .wait_counter = counter,
+    });
+
+    return true;
+}
+
+// Idle fiber in worker loop give way to ready fiber.
+static bool _fiber_resume_ready() {
+    uint32_t ready = 0;
+
+    if (!_fiber_current()) {
+        return false;
+    }
+
+    if (!queue_task_size(&_G.fiber_ready) ||
+        !queue_task_pop(&_G.fiber_ready, &ready, 0)) {
+        return false;
     }
 
-    queue_task_destroy(&_G.job_queue);
-    queue_task_destroy(&_G.free_task);
-    queue_task_destroy(&_G.free_counter);
+    _fiber_switch(ready, (fiber_op_t) {.free_fiber = _fiber_current()});
+    return true;
+}
+
+static void _trace_event(uint32_t begin_worker,
+                         const char *name,
+                         uint64_t begin,
+                         uint64_t end) {
+    uint32_t wid = worker_id();
+    trace_ring_t *ring = &_G.trace_ring[wid];
+
+    if (!ring->events) {
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    ring->events[head & (TASK_TRACE_EVENTS - 1)] = (trace_event_t) {
+            .name = name ? name : "task",
+            .begin = begin,
+            .end = end,
+            .worker_id = begin_worker,
+    };
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int do_work() {
+    task_id_t t = _task_pop_new_work();
+
+    if (t.id == 0) {
+        return 0;
+    }
+
+    task_t *task = _get_task(t);
+
+    bool trace = atomic_load_explicit(&_G.tracing, memory_order_relaxed);
+    uint32_t trace_worker = 0;
+    uint64_t trace_begin = 0;
+
+    if (trace) {
+        trace_worker = worker_id();
+        trace_begin = ce_os_time_a0->perf_counter();
+    }
+
+    // Fiber can resume on other worker => restore using no inline accessor.
+    uint8_t prev_priority = _current_priority();
+    _set_current_priority(task->priority);
+
+    if (task->range_work) {
+        _range_work(task->range_work, task->begin, task->end, task->grain,
+                    task->data, task->counter, task->priority);
+    } else {
+        task->task_work(task->data);
+    }
+
+    _set_current_priority(prev_priority);
+
+    if (trace) {
+        _trace_event(trace_worker, task->name, trace_begin,
+                     ce_os_time_a0->perf_counter());
+    }
+
+    if (task->counter) {
+        _counter_dec(_get_counter(task->counter));
+    }
+
+    _pool_free(&_G.task_pool, t.id);
+
+    return 1;
+}
+
+static bool _worker_idle_loop(uint32_t wid);
+
+static void _worker_loop() {
+    while (_G.is_running) {
+        // Fiber can continue on other worker after switch.
+        uint32_t wid = worker_id();
+
+        // Retired for service thread.
+        if (wid >= _G.workers_count) {
+            break;
+        }
+
+        if (!_worker_idle_loop(wid)) {
+            break;
+        }
+    }
+}
+
+// Return false on shutdown or retire, true if fiber was switched.
+static bool _worker_idle_loop(uint32_t wid) {
+    worker_t *w = &_G.worker[wid];
+    uint32_t idle_n = 0;
+    uint64_t idle_start = 0;
+    bool was_parked = false;
+    bool switched = false;
+
+    while (_G.is_running && (wid < _G.workers_count)) {
+        if (_G.fibers && _fiber_resume_ready()) {
+            switched = true;
+            break;
+        }
+
+        if (do_work()) {
+            // Task waited on fiber and fiber was resumed on other worker.
+            if (_G.fibers && (worker_id() != wid)) {
+                switched = true;
+                break;
+            }
+
+            if (idle_n) {
+                uint64_t ticks = ce_os_time_a0->perf_counter() - idle_start;
+                atomic_fetch_add_explicit(&w->idle_ticks, ticks,
+                                          memory_order_relaxed);
+
+                // Work came while spinning => spin longer next time.
+                if (!was_parked && (w->spin_count < TASK_SPIN_MAX)) {
+                    w->spin_count *= 2;
+                }
+
+                idle_n = 0;
+                was_parked = false;
+            }
+            continue;
+        }
+
+        if (!idle_n) {
+            idle_start = ce_os_time_a0->perf_counter();
+        }
+
+        ++idle_n;
+
+        if (idle_n < w->spin_count) {
+            _cpu_relax();
+        } else if (idle_n < (w->spin_count + TASK_YIELD_COUNT)) {
+            ce_os_thread_a0->yield();
+        } else {
+            // Spinning did not pay off => spin less next time.
+            if (w->spin_count > TASK_SPIN_MIN) {
+                w->spin_count /= 2;
+            }
+
+            _park_worker(wid);
+            was_parked = true;
+            idle_n = 1;
+        }
+    }
+
+    if (idle_n) {
+        uint64_t ticks = ce_os_time_a0->perf_counter() - idle_start;
+        atomic_fetch_add_explicit(&w->idle_ticks, ticks, memory_order_relaxed);
+    }
+
+    return switched;
+}
+
+static void _fiber_main() {
+    _fiber_after_switch();
+
+    _worker_loop();
+
+    // Shutdown or retire => back to worker thread.
+    uint32_t wid = worker_id();
+    fiber_jump(&_G.worker[wid].thread_fiber);
+}
+
+static int _task_worker(void *o) {
+    _worker_id = (char) (uint64_t) o;
+    _is_worker = true;
+    _wait_sem = _G.worker[_worker_id].wait_sem.o;
+    _steal_seed = 0x9E3779B9u * (_worker_id + 1);
+
+    uint32_t wid = _worker_id;
+    int32_t core = _G.worker[wid].core;
+    if ((core >= 0) && !ce_os_thread_a0->set_affinity(core)) {
+        ce_log_a0->warning(LOG_WHERE, "Could not pin worker %u to core %d",
+                           wid, core);
+    }
+
+    ce_log_a0->debug("task_worker", "Worker %d init", _worker_id);
+
+    uint32_t fiber = 0;
+    if (_G.fibers && queue_task_pop(&_G.fiber_free, &fiber, 0)) {
+        _fiber_cur = fiber;
+        fiber_switch(&_G.worker[_worker_id].thread_fiber,
+                     &_G.fiber_pool[fiber]);
+
+        // Last fiber is off the stack, reset it and give it back.
+        fiber = _fiber_current();
+        _fiber_cur = 0;
+
+        fiber_init(&_G.fiber_pool[fiber],
+                   _G.fiber_stack + ((uint64_t) _G.fiber_stack_size * (fiber - 1)),
+                   _G.fiber_stack_size, _fiber_main);
+
+        queue_task_push(&_G.fiber_free, fiber);
+    } else {
+        _worker_loop();
+    }
+
+    ce_log_a0->debug("task_worker", "Worker %d shutdown", worker_id());
+    return 1;
+}
+
+
+//==============================================================================
+// Api
+//==============================================================================
+
+static void _add_tasks(queue_mpmc *q,
+                       ce_task_item_t0 *items,
+                       uint32_t count,
+                       ce_task_counter_t0 **counter) {
+    // Nobody wait for tasks => no counter.
+    // +1 is held until all tasks are pushed, so count 0 complete too.
+    uint32_t new_counter = 0;
+
+    if (counter) {
+        new_counter = _new_counter_task(count + 1);
+        *counter = (ce_task_counter_t0 *) _get_counter(new_counter);
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        task_id_t task = _new_task();
+        task_t *t = _get_task(task);
+
+        t->name = items[i].name;
+        t->task_work = items[i].work;
+        t->range_work = NULL;
+        t->data = items[i].data;
+        t->counter = new_counter;
+        t->priority = items[i].priority;
+
+        if (q) {
+            _push_task(q, task);
+            continue;
+        }
+
+        _push_new_task(task);
+
+        if (0 == ((i + 1) % TASK_WAKE_BATCH)) {
+            _wake_workers(TASK_WAKE_BATCH);
+        }
+    }
+
+    if (!q) {
+        _wake_workers(count % TASK_WAKE_BATCH);
+    }
+
+    if (new_counter) {
+        _counter_dec(_get_counter(new_counter));
+    }
+}
+
+void add(ce_task_item_t0 *items,
+         uint32_t count,
+         struct ce_task_counter_t0 **counter) {
+    _add_tasks(NULL, items, count, counter);
+}
+
+void add_specific(uint32_t worker_id,
+                  ce_task_item_t0 *items,
+                  uint32_t count,
+                  ce_task_counter_t0 **counter) {
+    // Service threads do not run tasks.
+    if (worker_id >= _G.workers_count) {
+        ce_log_a0->warning(LOG_WHERE, "Worker %u is not active, tasks go to all workers",
+                           worker_id);
+        _add_tasks(NULL, items, count, counter);
+        return;
+    }
+
+    _add_tasks(&_G.specific_job_queue[worker_id], items, count, counter);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    _wake_worker(worker_id);
+}
+
+void add_after(ce_task_counter_t0 **after,
+               uint32_t after_count,
+               ce_task_item_t0 *items,
+               uint32_t count,
+               ce_task_counter_t0 **counter) {
+    uint32_t new_counter = 0;
+
+    if (counter) {
+        new_counter = _new_counter_task(count + 1);
+        *counter = (ce_task_counter_t0 *) _get_counter(new_counter);
+    }
+
+    uint32_t pending_idx = _pool_alloc_wait(&_G.pending_pool);
+    pending_t *pending = _pool_item(&_G.pending_pool, pending_idx);
+
+    // +1 guard until all continuations are registered.
+    atomic_store(&pending->deps, after_count + 1);
+    pending->counter = new_counter;
+    pending->task_n = count;
+    pending->first_task = 0;
+
+    for (uint32_t i = count; i > 0; --i) {
+        task_id_t task = _new_task();
+        task_t *t = _get_task(task);
+
+        t->name = items[i - 1].name;
+        t->task_work = items[i - 1].work;
+        t->range_work = NULL;
+        t->data = items[i - 1].data;
+        t->counter = new_counter;
+        t->priority = items[i - 1].priority;
+        t->next = pending->first_task;
+
+        pending->first_task = task.id;
+    }
+
+    for (uint32_t i = 0; i < after_count; ++i) {
+        if (!_counter_add_cont((counter_t *) after[i], pending_idx, 0)) {
+            _pending_dep_done(pending_idx);
+        }
+    }
+
+    _pending_dep_done(pending_idx);
+}
+
+void release_counter(ce_task_counter_t0 *signal) {
+    _counter_release((counter_t *) signal);
+}
+
+
+void wait_atomic(ce_task_counter_t0 *signal,
+                 int32_t value) {
+    counter_t *counter = (counter_t *) signal;
+
+    while (atomic_load_explicit(&counter->value, memory_order_acquire) !=
+           value) {
+        // Resumed fiber => counter is completed.
+        if ((0 == value) && _G.fibers && _fiber_wait(counter)) {
+            continue;
+        }
+
+        do_work();
+    }
+
+    _counter_release(counter);
+}
+
+static ce_sem_t0 _thread_wait_sem() {
+    if (!_wait_sem) {
+        ce_sem_t0 sem = ce_os_thread_a0->sem_create(0);
+
+        ce_os_thread_a0->spin_lock(&_G.thread_sem_lock);
+        ce_array_push(_G.thread_sems, sem, _G.allocator);
+        ce_os_thread_a0->spin_unlock(&_G.thread_sem_lock);
+
+        _wait_sem = sem.o;
+    }
+
+    return (ce_sem_t0) {.o = _wait_sem};
+}
+
+void wait_for_counter_no_work(ce_task_counter_t0 *signal,
+                              int32_t value) {
+    counter_t *counter = (counter_t *) signal;
+
+    for (uint32_t i = 0; i < TASK_SPIN_MAX; ++i) {
+        if (atomic_load_explicit(&counter->value, memory_order_acquire) ==
+            value) {
+            _counter_release(counter);
+            return;
+        }
+
+        _cpu_relax();
+    }
+
+    // Sleep until last task post our semaphore.
+    ce_sem_t0 sem = _thread_wait_sem();
+    while (atomic_load(&counter->value) != value) {
+        atomic_store(&counter->waiter, sem.o);
+
+        bool posted = false;
+        if (atomic_load(&counter->value) != value) {
+            posted = ce_os_thread_a0->sem_wait(sem, TASK_PARK_TIMEOUT_MS);
+        }
+
+        if (!posted && !atomic_exchange(&counter->waiter, 0)) {
+            // Task already claimed waiter, consume its post.
+            ce_os_thread_a0->sem_wait(sem, TASK_WAIT_FOREVER);
+        }
+    }
+
+    _counter_release(counter);
+}
+
+
+void parallel_for(uint32_t begin,
+                  uint32_t end,
+                  uint32_t grain,
+                  ce_task_range_fce_t0 *fce,
+                  void *data) {
+    if (begin >= end) {
+        return;
+    }
+
+    uint32_t count = end - begin;
+
+    // Adaptive grain => ~4 ranges per worker for stealing.
+    if (!grain) {
+        grain = count / (_G.workers_count * 4);
+    }
+
+    if (!grain) {
+        grain = 1;
+    }
+
+    if (count <= grain) {
+        fce(begin, end, data);
+        return;
+    }
+
+    // Caller run first range and hold +1 until it is done.
+    uint32_t counter_idx = _new_counter_task(1);
+    _range_work(fce, begin, end, grain, data, counter_idx,
+                _current_priority());
+    _counter_dec(_get_counter(counter_idx));
+
+    wait_atomic((ce_task_counter_t0 *) _get_counter(counter_idx), 0);
+}
+
+int worker_count() {
+    return _G.workers_count;
+}
+
+int thread_count() {
+    return _G.threads_count;
+}
+
+uint32_t queue_depth(uint32_t priority) {
+    uint32_t depth = queue_task_size(&_G.job_queue[priority]);
+
+    for (uint32_t i = 0; i < _G.threads_count; ++i) {
+        depth += queue_ws_size(&_G.worker_queue[i][priority]);
+    }
+
+    return depth;
+}
+
+static void _trace_alloc_ring(uint32_t id) {
+    if (_G.trace_ring[id].events) {
+        return;
+    }
+
+    _G.trace_ring[id].events = CE_ALLOC(_G.allocator, trace_event_t,
+                                        sizeof(trace_event_t) *
+                                        TASK_TRACE_EVENTS);
+}
+
+void trace_start(const char *filename) {
+    if (filename) {
+        if (_G.trace_file) {
+            CE_FREE(_G.allocator, _G.trace_file);
+        }
+
+        _G.trace_file = ce_memory_a0->str_dup(filename, _G.allocator);
+    }
+
+    for (uint32_t i = 0; i < _G.threads_count; ++i) {
+        _trace_alloc_ring(i);
+    }
+
+    if (!_G.trace_start) {
+        _G.trace_start = ce_os_time_a0->perf_counter();
+    }
+
+    atomic_store(&_G.tracing, true);
+}
+
+void trace_stop() {
+    atomic_store(&_G.tracing, false);
+}
+
+static void _trace_write_name(char **buffer,
+                              const char *name) {
+    for (const char *c = name; *c; ++c) {
+        if ((*c == '"') || (*c == '\\')) {
+            ce_buffer_push_ch(*buffer, '\\', _G.allocator);
+        }
+
+        ce_buffer_push_ch(*buffer, *c, _G.allocator);
+    }
+}
+
+bool trace_dump(const char *filename) {
+    if (!filename) {
+        filename = _G.trace_file;
+    }
+
+    if (!filename) {
+        return false;
+    }
+
+    const double us = 1000000.0 / ce_os_time_a0->perf_freq();
+    char *buffer = NULL;
+
+    ce_buffer_printf(&buffer, _G.allocator, "{\"traceEvents\":[\n");
+
+    bool first = true;
+    for (uint32_t i = 0; i < _G.threads_count; ++i) {
+        trace_ring_t *ring = &_G.trace_ring[i];
+
+        if (!ring->events) {
+            continue;
+        }
+
+        ce_buffer_printf(&buffer, _G.allocator,
+                         "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+                         "\"pid\":0,\"tid\":%u,"
+                         "\"args\":{\"name\":\"%s %u\"}}",
+                         first ? "" : ",\n", i,
+                         i < _G.workers_count ? "worker" : "service", i);
+        first = false;
+
+        uint64_t head = atomic_load_explicit(&ring->head,
+                                             memory_order_acquire);
+        uint64_t n = head < TASK_TRACE_EVENTS ? head : TASK_TRACE_EVENTS;
+
+        for (uint64_t j = head - n; j < head; ++j) {
+            trace_event_t *ev = &ring->events[j & (TASK_TRACE_EVENTS - 1)];
+
+            if (ev->begin < _G.trace_start) {
+                continue;
+            }
+
+            ce_buffer_printf(&buffer, _G.allocator, ",\n{\"name\":\"");
+            _trace_write_name(&buffer, ev->name);
+            ce_buffer_printf(&buffer, _G.allocator,
+                             "\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+                             "\"ts\":%.3f,\"dur\":%.3f}",
+                             ev->worker_id,
+                             (ev->begin - _G.trace_start) * us,
+                             (ev->end - ev->begin) * us);
+        }
+    }
+
+    ce_buffer_printf(&buffer, _G.allocator,
+                     "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    ce_vio_t0 *out = ce_os_vio_a0->from_file(filename, VIO_OPEN_WRITE);
+    if (!out) {
+        ce_log_a0->error(LOG_WHERE, "Could not write trace %s", filename);
+        ce_buffer_free(buffer, _G.allocator);
+        return false;
+    }
+
+    out->vt->write(out->inst, buffer, 1, ce_buffer_size(buffer));
+    ce_os_vio_a0->close(out);
+
+    ce_log_a0->info(LOG_WHERE, "Trace writed to %s", filename);
+
+    ce_buffer_free(buffer, _G.allocator);
+    return true;
+}
+
+static void _thread_init(uint32_t id) {
+    worker_t *w = &_G.worker[id];
+    w->park_sem = ce_os_thread_a0->sem_create(0);
+    w->wait_sem = ce_os_thread_a0->sem_create(0);
+    w->spin_count = TASK_SPIN_MIN;
+    w->core = -1;
+
+    queue_task_init(&_G.specific_job_queue[id], TASK_QUEUE_SIZE, _G.allocator);
+
+    if (atomic_load(&_G.tracing)) {
+        _trace_alloc_ring(id);
+    }
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        queue_ws_init(&_G.worker_queue[id][i], TASK_QUEUE_SIZE, _G.allocator);
+    }
+}
+
+static void _thread_shutdown(uint32_t id) {
+    ce_os_thread_a0->sem_destroy(_G.worker[id].park_sem);
+    ce_os_thread_a0->sem_destroy(_G.worker[id].wait_sem);
+
+    queue_task_destroy(&_G.specific_job_queue[id]);
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        queue_ws_destroy(&_G.worker_queue[id][i]);
+    }
+}
+
+static int _service_thread(void *o) {
+    service_t *service = o;
+
+    _worker_id = service->worker_id;
+    _is_worker = false;
+    _wait_sem = _G.worker[_worker_id].wait_sem.o;
+    _steal_seed = 0x9E3779B9u * (_worker_id + 1);
+
+    if ((service->core >= 0) &&
+        !ce_os_thread_a0->set_affinity(service->core)) {
+        ce_log_a0->warning(LOG_WHERE, "Could not pin service %s to core %d",
+                           service->item.name, service->core);
+    }
+
+    ce_log_a0->debug(LOG_WHERE, "Service %s init", service->item.name);
+
+    service->item.work(service->item.data);
+
+    ce_log_a0->debug(LOG_WHERE, "Service %s shutdown", service->item.name);
+    return 1;
+}
+
+uint32_t service_thread(ce_task_item_t0 *item,
+                        int32_t core) {
+    // Retired worker is joined, caller must not be the worker.
+    CE_ASSERT(LOG_WHERE, worker_id() == 0);
+
+    ce_os_thread_a0->spin_lock(&_G.service_lock);
+
+    uint32_t id;
+
+    const bool retire = _G.workers_count > 1;
+    if (retire) {
+        id = atomic_fetch_sub(&_G.workers_count, 1) - 1;
+    } else {
+        CE_ASSERT(LOG_WHERE, _G.threads_count < TASK_MAX_WORKERS);
+        id = _G.threads_count;
+        _thread_init(id);
+
+        // Publish after init, threads_count bound stealing.
+        atomic_fetch_add(&_G.threads_count, 1);
+    }
+
+    service_t *service = &_G.service[_G.service_count++];
+    *service = (service_t) {
+            .item = *item,
+            .worker_id = id,
+            .core = core,
+    };
+
+    ce_os_thread_a0->spin_unlock(&_G.service_lock);
+
+    // Retire last worker, service take its id after worker thread ends.
+    // Worker can be in the middle of task that still use its id (queues,
+    // semaphores and per worker data of other modules).
+    if (retire) {
+        _wake_worker(id);
+
+        int status = 0;
+        ce_os_thread_a0->wait(_G.workers[id], &status);
+        _G.workers[id] = (ce_thread_t0) {};
+    }
+
+    service->thread = ce_os_thread_a0->create(_service_thread, item->name,
+                                              service);
+
+    ce_log_a0->info(LOG_WHERE, "Service %s: worker id %u, workers %u",
+                    item->name, id, _G.workers_count);
+
+    return id;
+}
+
+void worker_stats(uint32_t worker_id,
+                  ce_task_worker_stats_t0 *stats) {
+    worker_t *w = &_G.worker[worker_id];
+    uint64_t freq = ce_os_time_a0->perf_freq();
+
+    uint64_t idle = atomic_load_explicit(&w->idle_ticks, memory_order_relaxed);
+    uint64_t parked = atomic_load_explicit(&w->parked_ticks,
+                                           memory_order_relaxed);
+
+    *stats = (ce_task_worker_stats_t0) {
+            .idle_us = (idle * 1000000) / freq,
+            .parked_us = (parked * 1000000) / freq,
+            .park_count = atomic_load_explicit(&w->park_count,
+                                               memory_order_relaxed),
+            .wakeup_count = atomic_load_explicit(&w->wakeup_count,
+                                                 memory_order_relaxed),
+    };
+}
+
+// Usable cpus for workers, first siblings of all cores go first.
+static uint32_t _worker_cpus(uint32_t *cpus,
+                             bool smt,
+                             uint64_t mask) {
+    ce_cpu_info_t0 info[TASK_MAX_CPUS];
+    uint32_t info_n = ce_os_cpu_a0->topology(info, TASK_MAX_CPUS);
+
+    uint32_t smt_max = 0;
+    uint32_t node_max = 0;
+    for (uint32_t i = 0; i < info_n; ++i) {
+        if (info[i].smt > smt_max) {
+            smt_max = info[i].smt;
+        }
+
+        if (info[i].node > node_max) {
+            node_max = info[i].node;
+        }
+    }
+
+    if (!smt) {
+        smt_max = 0;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t level = 0; level <= smt_max; ++level) {
+        for (uint32_t node = 0; node <= node_max; ++node) {
+            for (uint32_t i = 0; i < info_n; ++i) {
+                ce_cpu_info_t0 *cpu = &info[i];
+
+                if ((cpu->smt != level) || (cpu->node != node)) {
+                    continue;
+                }
+
+                if (mask && ((cpu->id >= 64) || !(mask & (1ULL << cpu->id)))) {
+                    continue;
+                }
+
+                cpus[n++] = cpu->id;
+            }
+        }
+    }
+
+    return n;
+}
+
+static void _fibers_init(uint32_t fiber_count,
+                         uint32_t stack_size);
+
+static void _fibers_shutdown();
+
+static void _start_workers() {
+    uint64_t worker_n = ce_config_a0->read_uint(CONFIG_TASK_WORKERS, 0);
+    uint64_t mask = ce_config_a0->read_uint(CONFIG_TASK_AFFINITY, 0);
+    bool smt = ce_config_a0->read_uint(CONFIG_TASK_SMT, 1) != 0;
+
+    uint32_t cpus[TASK_MAX_CPUS];
+    uint32_t cpu_n = _worker_cpus(cpus, smt, mask);
+    bool pin = (cpu_n > 0) && (mask || !smt);
+
+    if (!worker_n) {
+        worker_n = cpu_n > 1 ? cpu_n - 1 : 0;
+    }
+
+    if (worker_n > TASK_MAX_WORKERS - 1) {
+        worker_n = TASK_MAX_WORKERS - 1;
+    }
+
+    ce_log_a0->info(LOG_WHERE, "Cpu/Main/Worker: %u, %u, %u%s",
+                    cpu_n, 1, (uint32_t) worker_n, pin ? " pinned" : "");
+
+    _G.workers_count = worker_n + 1;
+    _G.threads_count = _G.workers_count;
+
+    bool fibers = ce_config_a0->read_uint(CONFIG_TASK_FIBERS, 0) != 0;
+    uint32_t fiber_n = ce_config_a0->read_uint(CONFIG_TASK_FIBER_COUNT, 0);
+    uint32_t stack_size = ce_config_a0->read_uint(CONFIG_TASK_FIBER_STACK_SIZE, 0);
+
+    if (!fiber_n) {
+        fiber_n = TASK_FIBER_COUNT;
+    }
+
+    if (!stack_size) {
+        stack_size = TASK_FIBER_STACK_SIZE;
+    }
+
+    // Each worker need one fiber for its loop.
+    if (fiber_n < (_G.workers_count * 2)) {
+        fiber_n = _G.workers_count * 2;
+    }
+
+    // Workers are stopped so all fibers are free.
+    if (!fibers) {
+        _fibers_shutdown();
+    } else if (!_G.fibers
+               || (_G.fiber_count != fiber_n)
+               || (_G.fiber_stack_size != stack_size)) {
+        _fibers_shutdown();
+        _fibers_init(fiber_n, stack_size);
+    }
+
+    for (uint32_t j = 1; j < _G.threads_count; ++j) {
+        _thread_init(j);
+
+        // Main thread take first cpu.
+        if (pin) {
+            _G.worker[j].core = cpus[j % cpu_n];
+        }
+    }
+
+    // Set before spawn, stop can come before worker is scheduled.
+    _G.is_running = 1;
+
+    for (uint32_t j = 1; j < _G.threads_count; ++j) {
+        _G.workers[j] = ce_os_thread_a0->create(_task_worker,
+                                                "cetech_worker",
+                                                (void *) ((intptr_t) (j)));
+    }
+}
+
+static void _stop_workers() {
+    _G.is_running = 0;
+
+    for (uint32_t i = 1; i < _G.workers_count; ++i) {
+        _wake_worker(i);
+    }
+
+    // Retired workers are already done.
+    int status = 0;
+    for (uint32_t i = 1; i < _G.threads_count; ++i) {
+        if (_G.workers[i].o) {
+            ce_os_thread_a0->wait(_G.workers[i], &status);
+            _G.workers[i] = (ce_thread_t0) {};
+        }
+    }
+}
+
+void configure() {
+    CE_ASSERT(LOG_WHERE, _G.service_count == 0);
+    CE_ASSERT(LOG_WHERE, worker_id() == 0);
+
+    _stop_workers();
+
+    for (uint32_t j = 1; j < _G.threads_count; ++j) {
+        _thread_shutdown(j);
+    }
+
+    _start_workers();
+}
+
+static struct ce_task_a0 _task_api = {
+        .worker_id = worker_id,
+        .worker_count = worker_count,
+        .add = add,
+        .add_specific = add_specific,
+        .wait_for_counter = wait_atomic,
+        .wait_for_counter_no_work = wait_for_counter_no_work,
+        .worker_stats = worker_stats,
+        .parallel_for = parallel_for,
+        .add_after = add_after,
+        .release_counter = release_counter,
+        .service_thread = service_thread,
+        .thread_count = thread_count,
+        .queue_depth = queue_depth,
+        .trace_start = trace_start,
+        .trace_stop = trace_stop,
+        .trace_dump = trace_dump,
+        .configure = configure,
+};
+
+struct ce_task_a0 *ce_task_a0 = &_task_api;
+
+static void _fibers_init(uint32_t fiber_count,
+                         uint32_t stack_size) {
+    uint32_t capacity = 2;
+    while (capacity <= fiber_count) {
+        capacity *= 2;
+    }
+
+    _G.fibers = true;
+    _G.fiber_count = fiber_count;
+    _G.fiber_stack_size = stack_size;
+
+    _G.fiber_pool = CE_ALLOC(_G.allocator, fiber_t,
+                             sizeof(fiber_t) * (fiber_count + 1));
+
+    _G.fiber_stack = CE_ALLOC(_G.allocator, uint8_t,
+                              (uint64_t) stack_size * fiber_count);
+
+    queue_task_init(&_G.fiber_free, capacity, _G.allocator);
+    queue_task_init(&_G.fiber_ready, capacity, _G.allocator);
+
+    for (uint32_t i = 1; i <= fiber_count; ++i) {
+        fiber_init(&_G.fiber_pool[i],
+                   _G.fiber_stack + ((uint64_t) stack_size * (i - 1)),
+                   stack_size, _fiber_main);
+
+        queue_task_push(&_G.fiber_free, i);
+    }
+
+    ce_log_a0->info(LOG_WHERE, "Fibers: %u, stack size %u",
+                    fiber_count, stack_size);
+}
+
+static void _fibers_shutdown() {
+    if (!_G.fibers) {
+        return;
+    }
+
+    queue_task_destroy(&_G.fiber_free);
+    queue_task_destroy(&_G.fiber_ready);
+
+    CE_FREE(_G.allocator, _G.fiber_pool);
+    CE_FREE(_G.allocator, _G.fiber_stack);
+
+    _G.fibers = false;
+    _G.fiber_count = 0;
+}
+
+void CE_MODULE_LOAD(task)(struct ce_api_a0 *api,
+                          int reload) {
+    CE_UNUSED(reload);
+
+    _G = (struct _G) {.allocator = ce_memory_a0->system};
+
+    api->add_api(CE_TASK_API, &_task_api, sizeof(_task_api));
+
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        queue_task_init(&_G.job_queue[i], TASK_QUEUE_SIZE, _G.allocator);
+    }
+
+    _pool_init(&_G.task_pool, sizeof(task_t));
+    _pool_init(&_G.counter_pool, sizeof(counter_t));
+    _pool_init(&_G.pending_pool, sizeof(pending_t));
+    _pool_init(&_G.cont_pool, sizeof(cont_t));
+
+    // Main thread is worker 0
+    _thread_init(0);
+    _worker_id = 0;
+    _is_worker = true;
+    _wait_sem = _G.worker[0].wait_sem.o;
+    _steal_seed = 0x9E3779B9u;
+
+    // Config is not loaded yet, kernel call configure() after it.
+    _start_workers();
+}
+
+void CE_MODULE_UNLOAD(task)(struct ce_api_a0 *api,
+                            int reload) {
+    CE_UNUSED(reload);
+    CE_UNUSED(api);
+
+    _stop_workers();
+
+    // Service work must return on shutdown.
+    int status = 0;
+    for (uint32_t i = 0; i < _G.service_count; ++i) {
+        ce_os_thread_a0->wait(_G.service[i].thread, &status);
+    }
+
+    if (_G.trace_file) {
+        trace_dump(NULL);
+        CE_FREE(_G.allocator, _G.trace_file);
+    }
+
+    for (uint32_t i = 0; i < TASK_MAX_WORKERS; ++i) {
+        CE_FREE(_G.allocator, _G.trace_ring[i].events);
+    }
+
+    _fibers_shutdown();
+
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        queue_task_destroy(&_G.job_queue[i]);
+    }
+
+    _pool_destroy(&_G.task_pool);
+    _pool_destroy(&_G.counter_pool);
+    _pool_destroy(&_G.pending_pool);
+    _pool_destroy(&_G.cont_pool);
+
+    for (uint32_t j = 0; j < _G.threads_count; ++j) {
+        _thread_shutdown(j);
+    }
+
+    const uint32_t sem_n = ce_array_size(_G.thread_sems);
+    for (uint32_t i = 0; i < sem_n; ++i) {
+        ce_os_thread_a0->sem_destroy(_G.thread_sems[i]);
+    }
+    ce_array_free(_G.thread_sems, _G.allocator);
 
     _G = (struct _G) {
             .allocator = ce_memory_a0->system
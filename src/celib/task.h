@@ -8,24 +8,74 @@ extern "C" {
 #define CE_TASK_API \
     CE_ID64_0("ce_task_a0", 0x4dbd12f32a50782eULL)
 
+#define CONFIG_TASK_TRACE \
+    CE_ID64_0("task.trace", 0x8e372aa18abe65b4ULL)
+
+// Worker threads without main thread, 0 = usable cpus - 1
+#define CONFIG_TASK_WORKERS \
+    CE_ID64_0("task.workers", 0xdabc72eb372d3e16ULL)
+
+// Mask of logical cpus for workers, workers are pinned if set. 0 = all
+#define CONFIG_TASK_AFFINITY \
+    CE_ID64_0("task.affinity", 0x3a5b811e6b7aa1beULL)
+
+// 0 = skip hyperthread siblings and pin workers to physical cores
+#define CONFIG_TASK_SMT \
+    CE_ID64_0("task.smt", 0x3a3fe7cd3572f637ULL)
+
+// 1 = waiting task suspend its fiber and worker continue on other fiber
+#define CONFIG_TASK_FIBERS \
+    CE_ID64_0("task.fibers", 0xefeb31faa06ec96fULL)
+
+// Fiber pool size, at least 2 per worker. 0 = 128
+#define CONFIG_TASK_FIBER_COUNT \
+    CE_ID64_0("task.fiber_count", 0xc2c4d1cb5429e4dbULL)
+
+// Fiber stack size in bytes. 0 = 256 KiB
+#define CONFIG_TASK_FIBER_STACK_SIZE \
+    CE_ID64_0("task.fiber_stack_size", 0x45e7a4c386cdaf64ULL)
+
 //! Worker enum
 typedef enum ce_workers_e0 {
     TASK_WORKER_MAIN = 0,  //!< Main worker
     TASK_MAX_WORKERS = 32, //!< Max workers
 } ce_workers_e0;
 
+//! Task priority lanes
+//! Lanes are scheduled by priority, lower lanes get regular turns.
+typedef enum ce_task_priority_e0 {
+    TASK_PRIORITY_NORMAL = 0,       //!< Default
+    TASK_PRIORITY_CRITICAL,         //!< Frame critical work
+    TASK_PRIORITY_BACKGROUND,       //!< Background work (compile, io...)
+    TASK_PRIORITY_COUNT,
+} ce_task_priority_e0;
+
 //! Task item struct
 typedef struct ce_task_item_t0 {
     const char *name;               //!< Task name
     void (*work)(void *data);       //!< Task work
     void *data;                     //!< Worker data
+    uint8_t priority;               //!< Task lane (ce_task_priority_e0)
 } ce_task_item_t0;
 
 typedef struct ce_task_counter_t0 ce_task_counter_t0;
 
+//! Parallel for range work, process [begin, end)
+typedef void (ce_task_range_fce_t0)(uint32_t begin,
+                                    uint32_t end,
+                                    void *data);
+
+//! Worker idle stats
+typedef struct ce_task_worker_stats_t0 {
+    uint64_t idle_us;       //!< Time without work (spin + parked)
+    uint64_t parked_us;     //!< Time parked
+    uint64_t park_count;    //!< Park count
+    uint64_t wakeup_count;  //!< Wakeups by new work
+} ce_task_worker_stats_t0;
+
 //! Task API V0
 struct ce_task_a0 {
-    //! Workers count
+    //! Active workers count, use it for work sizing.
     //! \return Workers count
     int (*worker_count)();
 
@@ -40,16 +90,83 @@ struct ce_task_a0 {
                 uint32_t count,
                 ce_task_counter_t0 **counter);
 
+    //! Add tasks for one worker, tasks for service thread go to all workers.
     void (*add_specific)(uint32_t worker_id,
                          ce_task_item_t0 *items,
                          uint32_t count,
                          ce_task_counter_t0 **counter);
 
+    //! Wait for counter and release it, help with work while waiting.
     void (*wait_for_counter)(ce_task_counter_t0 *signal,
                              int32_t value);
 
     void (*wait_for_counter_no_work)(ce_task_counter_t0 *signal,
                                      int32_t value);
+
+    //! Worker idle stats
+    //! \param worker_id Worker id
+    //! \param stats Stats out
+    void (*worker_stats)(uint32_t worker_id,
+                         ce_task_worker_stats_t0 *stats);
+
+    //! Process [begin, end) in parallel and wait until done.
+    //! Range is split recursively in half until grain size.
+    //! Ranges run in lane of calling task, critical lane outside of task.
+    //! \param grain Max items per range, 0 = adaptive by worker count
+    //! \param fce Range work
+    //! \param data Range work data
+    void (*parallel_for)(uint32_t begin,
+                         uint32_t end,
+                         uint32_t grain,
+                         ce_task_range_fce_t0 *fce,
+                         void *data);
+
+    //! Add tasks that are pushed when all after counters reach zero.
+    //! Counters in after must stay valid (not waited/released) during call.
+    //! With count = 0 counter is a join of after counters.
+    //! \param after Predecessor counters
+    //! \param after_count Predecessor counters count
+    void (*add_after)(ce_task_counter_t0 **after,
+                      uint32_t after_count,
+                      ce_task_item_t0 *items,
+                      uint32_t count,
+                      ce_task_counter_t0 **counter);
+
+    //! Release counter that nobody wait for (e.g. used only in add_after).
+    //! Every counter must be released by wait_for_counter* or this.
+    void (*release_counter)(ce_task_counter_t0 *counter);
+
+    //! Start service thread (renderer, io, log writer...) outside worker
+    //! pool. One worker is retired for each service thread and service
+    //! take its worker_id when the worker finishes its current task.
+    //! Call from main thread. Service work must return on shutdown.
+    //! \param item Service name and work
+    //! \param core Pin service to core, -1 = no pin
+    //! \return Service worker id
+    uint32_t (*service_thread)(ce_task_item_t0 *item,
+                               int32_t core);
+
+    //! Workers + service threads, size for per thread data by worker_id.
+    int (*thread_count)();
+
+    //! Queued tasks in lane
+    //! \param priority Lane (ce_task_priority_e0)
+    uint32_t (*queue_depth)(uint32_t priority);
+
+    //! Start recording tasks (name, worker, begin/end) into per worker rings
+    //! \param filename Trace file for trace_dump(NULL) and shutdown, can be NULL
+    void (*trace_start)(const char *filename);
+
+    //! Stop recording tasks
+    void (*trace_stop)();
+
+    //! Write recorded tasks as Chrome trace JSON (chrome://tracing, Perfetto)
+    //! \param filename Trace file, NULL = file from trace_start
+    bool (*trace_dump)(const char *filename);
+
+    //! Restart workers with task.* config.
+    //! Call from main thread before any task or service thread.
+    void (*configure)();
 };
 
 CE_MODULE(ce_task_a0);
@@ -39,6 +39,9 @@ extern "C" {
 #define ENTITY_CHILDREN \
     CE_ID64_0("children", 0x6fbb13de0e1dce0dULL)
 
+#define ENTITY_PREFAB \
+    CE_ID64_0("prefab", 0xab2f78e885f513c6ULL)
+
 #define ENTITY_RESOURCE_ID \
     CE_ID64_0("entity", 0x9831ca893b0d087dULL)
 
@@ -60,11 +63,13 @@ extern "C" {
 #define _ECS_LIST(...) (uint64_t[]){__VA_ARGS__}
 #define _ECS_LIST_SIZE(list) (sizeof(list) / sizeof(list[0]))
 
-#define CT_ECS_BEFORE(...) \
+#define _ECS_PAIR(...) \
     ((ce_ptr_pair_t0){.ptr=&_ECS_LIST(__VA_ARGS__),.len=_ECS_LIST_SIZE(_ECS_LIST(__VA_ARGS__))})
 
-#define CT_ECS_AFTER(...) \
-    ((ce_ptr_pair_t0){.ptr=&_ECS_LIST(__VA_ARGS__),.len=_ECS_LIST_SIZE(_ECS_LIST(__VA_ARGS__))})
+#define CT_ECS_BEFORE(...) _ECS_PAIR(__VA_ARGS__)
+#define CT_ECS_AFTER(...) _ECS_PAIR(__VA_ARGS__)
+#define CT_ECS_READ(...) _ECS_PAIR(__VA_ARGS__)
+#define CT_ECS_WRITE(...) _ECS_PAIR(__VA_ARGS__)
 
 #define CT_ECS_ARCHETYPE(...) \
     ct_ecs_c_a0->combine_component(_ECS_LIST(__VA_ARGS__), _ECS_LIST_SIZE(_ECS_LIST(__VA_ARGS__)))
@@ -84,15 +89,29 @@ typedef struct ct_entity_t0 {
     uint64_t h;
 } ct_entity_t0;
 
+// Max registered component types, bit per type in archetype mask.
+#define CT_ECS_MAX_COMPONENTS 256
+#define CT_ECS_MASK_WORDS (CT_ECS_MAX_COMPONENTS / 64)
+
 typedef struct ct_archetype_mask_t0 {
-    uint64_t mask;
+    uint64_t mask[CT_ECS_MASK_WORDS];
 } ct_archemask_t0;
 
 typedef struct ct_ecs_component_i0 {
     bool is_system_state;
+
+    // One value per chunk, entities with same value share chunks.
+    bool is_shared;
+
+    // from_cdb_obj create runtime data, entity with component is not compiled to prefab.
+    bool no_prefab;
+
     uint64_t cdb_type;
     uint64_t size;
 
+    // Min chunk size for archetypes with component, 0 = world chunk size.
+    uint32_t chunk_size;
+
     const char *(*display_name)();
 
     void (*from_cdb_obj)(ct_world_t0 world,
@@ -100,6 +119,31 @@ typedef struct ct_ecs_component_i0 {
                          uint64_t obj,
                          void *data);
 
+    // World snapshot copy component data as is, component with pointers append
+    // what it need to stream and rebuild pointers from it in restore.
+    // Restore must read exactly what snapshot wrote, shared components are not called.
+    void (*snapshot)(ct_world_t0 world,
+                     const ct_entity_t0 *ent,
+                     const void *data,
+                     uint32_t n,
+                     uint8_t **stream,
+                     ce_alloc_t0 *alloc);
+
+    // stream_size is what is left in stream. Return false if it is too short,
+    // data must not point to image memory even then.
+    bool (*restore)(ct_world_t0 world,
+                    const ct_entity_t0 *ent,
+                    void *data,
+                    uint32_t n,
+                    const uint8_t **stream,
+                    uint64_t stream_size);
+
+    // Restore drop current world data, free what data own.
+    void (*release)(ct_world_t0 world,
+                    const ct_entity_t0 *ent,
+                    void *data,
+                    uint32_t n);
+
     void *(*get_interface)(uint64_t name_hash);
 } ct_ecs_component_i0;
 
@@ -108,12 +152,29 @@ typedef struct ct_component_pair_t0 {
     void *data;
 } ct_component_pair_t0;
 
+typedef struct ct_ecs_world_stats_t0 {
+    uint32_t entity_n;          // Entities in chunks
+    uint32_t archetype_n;
+    uint32_t chunk_n;
+    uint32_t chunk_capacity;    // Max entities in all chunks, occupancy = entity_n / chunk_capacity
+    uint32_t compact_moved_n;   // Entities moved by compaction in last step
+} ct_ecs_world_stats_t0;
+
 typedef struct ct_ecs_query_t0 {
     ct_archemask_t0 all;
     ct_archemask_t0 any;
     ct_archemask_t0 none;
     ct_archemask_t0 write;
-    bool only_changed;
+
+    // Event filters, foreach get only entities with event since this query last run.
+    // Events are kept per system and query (same masks = same query) and cleared when it read them.
+    // Archetype match is still all/any/none, only_changed is ignored.
+    ct_archemask_t0 added;      // Got component (new entity too)
+    ct_archemask_t0 removed;    // Lost component and still live
+    ct_archemask_t0 changed;    // Component written
+
+    uint64_t group_by;          // Shared component, foreach get same values in sequence
+    bool only_changed;          // Only changed 64 entity blocks, foreach get ranges
 } ct_ecs_query_t0;
 
 typedef void (*ct_ecs_foreach_fce_t)(ct_world_t0 world,
@@ -146,6 +207,12 @@ typedef struct ct_system_i0 {
     uint64_t group;
     ce_ptr_pair_t0 before;
     ce_ptr_pair_t0 after;
+
+    // Components accessed by system (include cmd buffer changes in write).
+    // Systems without overlapping sets run concurrently,
+    // system without read and write runs alone.
+    ce_ptr_pair_t0 read;
+    ce_ptr_pair_t0 write;
 } ct_system_i0;
 
 typedef struct ct_system_group_i0 {
@@ -163,6 +230,13 @@ struct ct_ecs_a0 {
     void (*step)(ct_world_t0 world,
                  float dt);
 
+    // Step worlds, simulation group concurrently (one task per world),
+    // presentation group serially on calling thread.
+    // Simulation systems must touch only world they run in, worlds are not created/destroyed meanwhile.
+    void (*step_worlds)(const ct_world_t0 *worlds,
+                        uint32_t n,
+                        float dt);
+
     void (*buff_add_component)(ct_ecs_cmd_buffer_t *buffer,
                                ct_world_t0 world,
                                ct_entity_t0 ent,
@@ -174,6 +248,35 @@ struct ct_ecs_a0 {
                                   ct_entity_t0 ent,
                                   const uint64_t *component_name,
                                   uint32_t name_count);
+
+    // Chunk size for archetypes created in world after call (default 16 KB).
+    // Rounded up to page size.
+    void (*set_chunk_size)(ct_world_t0 world,
+                           uint32_t chunk_size);
+
+    // Merge sparse chunks, max_moves bound visited chunks + moved entities.
+    // Step compacts with small budget, use UINT32_MAX for full compaction.
+    // Return moved entities count.
+    uint32_t (*compact)(ct_world_t0 world,
+                        uint32_t max_moves);
+
+    void (*world_stats)(ct_world_t0 world,
+                        ct_ecs_world_stats_t0 *stats);
+
+    // Flat image of world entities: handles, archetype tables and raw chunks
+    // at page aligned offsets. Image is ce_array, it is cleaned before write.
+    void (*snapshot)(ct_world_t0 world,
+                     uint8_t **image,
+                     ce_alloc_t0 *alloc);
+
+    // Replace world entities with image, handles are same as in snapshot and
+    // handles created after snapshot are not valid.
+    // Component layouts must match (same build), on false world is not changed.
+    // Short component stream also return false, entities are restored and
+    // components after it only reset their data.
+    bool (*restore)(ct_world_t0 world,
+                    const uint8_t *image,
+                    uint64_t size);
 };
 
 CE_MODULE(ct_ecs_a0);
@@ -190,8 +293,26 @@ struct ct_ecs_e_a0 {
     bool (*entity_alive)(ct_world_t0 world,
                          ct_entity_t0 entity);
 
+    // Spawn from compiled prefab, from cdb if entity has not prefab.
     ct_entity_t0 (*spawn_entity)(ct_world_t0 world,
                                  uint64_t name);
+
+    // Spawn from cdb, entities follow cdb changes (editor).
+    ct_entity_t0 (*spawn_entity_live)(ct_world_t0 world,
+                                      uint64_t name);
+
+    // Create count entities with archetype + init_data types.
+    // Components without init data are zeroed.
+    void (*create_batch)(ct_world_t0 world,
+                         ct_archemask_t0 archetype,
+                         uint32_t count,
+                         ct_entity_t0 *out,
+                         const ct_component_pair_t0 *init_data,
+                         uint32_t init_data_n);
+
+    void (*destroy_batch)(ct_world_t0 world,
+                          ct_entity_t0 *entity,
+                          uint32_t count);
 };
 
 CE_MODULE(ct_ecs_e_a0);
@@ -208,15 +329,28 @@ struct ct_ecs_c_a0 {
     ct_archemask_t0 (*combine_component)(const uint64_t *component_name,
                                          uint32_t n);
 
+    // Component array for foreach range, index as ent.
     void *(*get_all)(ct_world_t0 world,
                      uint64_t component_name,
                      ct_ecs_ent_chunk_o0 *chunk);
 
+    // Shared component return value for read only, write return NULL.
     void *(*get_one)(ct_world_t0 world,
                      uint64_t component_name,
                      ct_entity_t0 entity,
                      bool write);
 
+    // Shared value of foreach range.
+    const void *(*get_shared)(ct_world_t0 world,
+                              uint64_t component_name,
+                              ct_ecs_ent_chunk_o0 *chunk);
+
+    // Move entity to chunk with value.
+    void (*set_shared)(ct_world_t0 world,
+                       ct_entity_t0 ent,
+                       uint64_t component_name,
+                       const void *value);
+
     void (*add)(ct_world_t0 world,
                 ct_entity_t0 ent,
                 const ct_component_pair_t0 *components,
@@ -3,8 +3,14 @@
 //==============================================================================
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
 #include <stdatomic.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <celib/api.h>
 #include <celib/memory/memory.h>
 #include <celib/memory/allocator.h>
@@ -16,8 +22,10 @@
 #include <celib/log.h>
 #include <celib/id.h>
 #include <celib/module.h>
+#include <celib/murmur.h>
 #include <celib/handler.h>
 #include <celib/task.h>
+#include <celib/os/thread.h>
 #include <celib/containers/mpmc.h>
 
 #include <cetech/ecs/ecs.h>
@@ -39,6 +47,20 @@
 
 #define MAX_ENTITIES 1000000000
 #define CHUNK_SIZE 16384
+#define CHUNK_SIZE_ALIGN 4096
+
+// SIMD friendly column align
+#define COLUMN_ALIGN 64
+
+// Entities per change tracking block
+#define CHUNK_BLOCK_SIZE 64
+#define _align_up(v, a) (((v) + ((a) - 1)) & ~((a) - 1))
+
+// Compaction budget per step, chunks visited + entities moved
+#define COMPACT_MOVES_PER_STEP 1024
+
+// Queries with event filter per world, one bit in event masks
+#define MAX_EVENT_QUERIES 64
 
 #define _G ecs_g
 
@@ -57,7 +79,6 @@
 typedef struct spawn_info_t {
     uint64_t ent_obj;
     ct_entity_t0 *ents;
-    ct_cdb_ev_queue_o0 *ev_queue;
 } spawn_info_t;
 
 typedef struct spawn_infos_t {
@@ -69,28 +90,171 @@ typedef struct spawn_infos_t {
 } spawn_infos_t;
 ///
 
+// Event bits of one query in chunk, one bit per entity slot.
+typedef _Atomic uint64_t *event_bits_t;
+
+// Chunk: header | version[component_n] | block version[component_n][block_n]
+//        | shared values | entities | columns, 64B aligned.
 typedef struct ent_chunk_t {
     ct_archemask_t0 archetype_mask;
     uint32_t ent_n;
     uint32_t archetype_idx;
-    uint32_t *version;
+    uint32_t size;
+    uint32_t ent_offset;
+    // Hash of shared values, chunk hold only entities with same shared values.
+    uint64_t shared_hash;
+    // Event queries with pending events, bits per query allocated on first event.
+    // Table and bits are published under event_lock and read without it.
+    _Atomic uint64_t event_mask;
+    _Atomic(event_bits_t) *_Atomic event_bits;
     struct ent_chunk_t *next;
     struct ent_chunk_t *prev;
+    uint32_t version[];
 } ent_chunk_t;
 
+// Add/remove one component transition.
+typedef struct archetype_edge_t {
+    uint32_t archetype_idx;
+    uint32_t generation;
+    // Source column -> destination column, UINT32_MAX = dropped
+    uint32_t *remap;
+} archetype_edge_t;
+
 typedef struct ent_archetype_t {
     ct_archemask_t0 archetype_mask;
+    // Next archetype with same mask hash in archetype_map
+    uint64_t hash_next;
     ent_chunk_t *first;
     ce_hash_t comp_idx;
     uint64_t *name;
     uint32_t *offset;
     uint32_t *size;
+    // Shared value offset in chunk, 0 = not shared
+    uint32_t *shared_offset;
     uint32_t idx;
     uint32_t max_ent;
     uint32_t component_n;
+    uint32_t chunk_size;
+    uint32_t ent_offset;
+    uint32_t block_n;
+    // Shared values block in chunk
+    uint32_t shared_begin;
+    uint32_t shared_size;
     bool has_system_state; // TODO FLAG?
+
+    // Some chunk lost entity, candidate for compaction.
+    bool fragmented;
+
+    // Component name -> idx in edges
+    ce_hash_t add_edges;
+    ce_hash_t remove_edges;
+    archetype_edge_t *edges;
+
+    // Changed on free, edges to freed archetype are rebuilt on use.
+    uint32_t generation;
+
+    // Event queries that match archetype, per component queries notified by
+    // add (added | changed), write (changed) and remove (checked on destination).
+    uint64_t event_match;
+    uint64_t event_arrive;
+    uint64_t *event_add;
+    uint64_t *event_change;
+    uint64_t *event_remove;
 } archetype_t;
 
+typedef struct query_match_t {
+    uint32_t archetype_idx;
+    // Column idx of read (all | any without write) and write components
+    uint32_t *read;
+    uint32_t *write;
+} query_match_t;
+
+// Query with archetypes that match it, updated when archetype is created/freed.
+typedef struct query_cache_t {
+    ct_ecs_query_t0 query;
+    query_match_t *matches;
+    struct query_cache_t *next;
+    // System that own event state, 0 = outside of system or no event filter
+    uint64_t system;
+    // Event query idx + 1, 0 = no event filter
+    uint32_t event_idx;
+    // Event filter could not be registered, query match nothing.
+    bool event_overflow;
+    // Chunks with pending events, can repeat
+    ent_chunk_t **event_chunks;
+} query_cache_t;
+
+// Command is cmd_t + payload in 8 byte words.
+// add: cmd_component_t[n] + data, remove: uint64_t name[n]
+typedef struct cmd_t {
+    uint64_t type;
+    ct_world_t0 world;
+    ct_entity_t0 ent;
+    // Issue order in buffer, playback follow it across arenas.
+    uint64_t seq;
+    uint32_t n;
+    uint32_t word_n;
+} cmd_t;
+
+typedef struct cmd_component_t {
+    uint64_t type;
+    // Data offset in words from cmd begin, 0 = no data
+    uint32_t data;
+    uint32_t size;
+} cmd_component_t;
+
+// Linear arena per worker, memory is kept between frames.
+// Worker id is unique for each thread of task system (service threads have
+// own id) and command is written without wait, so fiber that resume on other
+// worker only continue in other arena.
+typedef struct cmd_buffer_t {
+    uint64_t *arena[TASK_MAX_WORKERS];
+    atomic_uint_fast64_t seq;
+} cmd_buffer_t;
+
+// Commands for one entity merged in playback.
+typedef struct cmd_merge_t {
+    ct_world_t0 world;
+    ct_entity_t0 ent;
+    ct_archemask_t0 add;
+    ct_archemask_t0 remove;
+    // Removed at least once, readded components are zeroed.
+    ct_archemask_t0 removed;
+    // Last cmd_merge_data_t, newest first
+    uint32_t data;
+} cmd_merge_t;
+
+typedef struct cmd_merge_data_t {
+    uint64_t type;
+    // NULL = removed
+    const void *data;
+    uint32_t next;
+} cmd_merge_data_t;
+
+// Declared component access of system.
+typedef struct system_access_t {
+    ct_archemask_t0 read;
+    ct_archemask_t0 write;
+    bool exclusive;
+} system_access_t;
+
+// System in wave, systems in wave run concurrently.
+typedef struct system_run_t {
+    ct_world_t0 world;
+    ct_system_i0 *system;
+    const system_access_t *access;
+    float dt;
+    uint32_t rq_version;
+    cmd_buffer_t *cmd_buf;
+} system_run_t;
+
+// Not full chunk, candidate for compaction.
+typedef struct compact_item_t {
+    ent_chunk_t *chunk;
+    uint64_t shared_hash;
+    uint32_t ent_n;
+} compact_item_t;
+
 typedef struct world_instance_t {
     ct_world_t0 world;
     ce_cdb_t0 db;
@@ -110,6 +274,7 @@ typedef struct world_instance_t {
     spawn_infos_t comp_spawninfo;
 
     // Cunk
+    uint32_t chunk_size;
     ent_chunk_t **chunk_pool;
     ent_chunk_t **chunk_pool_free;
 
@@ -119,14 +284,65 @@ typedef struct world_instance_t {
     uint32_t *archetype_free;
     ce_hash_t archetype_map;
 
+    // Compaction
+    uint32_t compact_cursor;
+    uint32_t compact_moved_n;
+    compact_item_t *compact_items;
+
+    // Query cache
+    ce_hash_t query_map;
+    query_cache_t **query_caches;
+    ce_spinlock_t0 query_lock;
+
+    // Event queries
+    query_cache_t *event_queries[MAX_EVENT_QUERIES];
+    uint32_t event_query_n;
+    ce_spinlock_t0 event_lock;
+
     // Version
     uint32_t global_system_version;
     ce_hash_t last_system_version;
 
-    uint32_t global_world_version;
-    uint32_t last_world_version;
+    // Step scratch, worlds are stepped concurrently.
+    cmd_buffer_t **cmd_buf_pool;
+    cmd_buffer_t **cmd_buf_free;
+
+    // Group plan, systems of waves in order and wave sizes.
+    system_run_t *plan_runs;
+    uint32_t *plan_waves;
+
+    // Playback scratch
+    const cmd_t **cmd_order;
+    ce_hash_t cmd_merge_map;
+    cmd_merge_t *cmd_merge;
+    cmd_merge_data_t *cmd_merge_data;
+
+    // Shared values for chunk lookup
+    uint8_t *shared_scratch;
 } world_instance_t;
 
+// Entity range in chunk passed to foreach as ct_ecs_ent_chunk_o0.
+typedef struct query_item_t {
+    ent_chunk_t *chunk;
+    uint32_t first;
+    uint32_t n;
+    // Hash of group_by shared value
+    uint64_t group;
+} query_item_t;
+
+// Per worker free item buffers, reused between calls.
+// Query own its buffer until end, fiber can wait in query and resume on other
+// worker, so buffer is given back to free list of worker that end query.
+typedef struct query_scratch_t {
+    query_item_t **free_buffers;
+    ent_chunk_t **event_chunks;
+} query_scratch_t;
+
+typedef struct world_step_t {
+    world_instance_t *w;
+    float dt;
+} world_step_t;
+
 static struct _G {
     ce_cdb_t0 db;
 
@@ -138,16 +354,22 @@ static struct _G {
     uint32_t component_count;
     ce_hash_t component_types;
     uint64_t *components_name;
-    uint64_t system_state_components_mask;
+    ct_archemask_t0 system_state_components_mask;
     ce_hash_t component_interface_map;
 
     // SIM
     ce_hash_t system_map;
+    ce_hash_t system_access_map;
+    system_access_t *system_access;
 
     ce_ba_graph_t system_group_graph;
     ce_hash_t system_group_map;
     ce_hash_t system_group_g_map;
 
+    // Systems/components changed, graphs are rebuilt before next step.
+    uint32_t graph_version;
+    uint32_t built_graph_version;
+
     uint32_t *graph_pool_free;
     ce_ba_graph_t *graph_pool;
 
@@ -158,8 +380,7 @@ static struct _G {
 
     ct_cdb_ev_queue_o0 *changed_obj_queue;
 
-    ce_mpmc_queue_t0 *cmd_buf_pool;
-    uint32_t *free_cmd_buff_queue;
+    query_scratch_t query_scratch[TASK_MAX_WORKERS];
 } _G;
 
 uint32_t _new_graph() {
@@ -181,15 +402,37 @@ void _free_graph(uint32_t idx) {
     ce_array_push(_G.graph_pool_free, idx, _G.allocator);
 }
 
-//
+// MASK
+static void _mask_set(ct_archemask_t0 *mask,
+                      uint64_t component_name) {
+    uint64_t idx = ce_hash_lookup(&_G.component_types, component_name, UINT64_MAX);
+
+    if (idx == UINT64_MAX) {
+        return;
+    }
+
+    mask->mask[idx / 64] |= (1ULL << (idx % 64));
+}
+
+static bool _mask_has(ct_archemask_t0 mask,
+                      uint64_t component_name) {
+    uint64_t idx = ce_hash_lookup(&_G.component_types, component_name, UINT64_MAX);
+
+    if (idx == UINT64_MAX) {
+        return false;
+    }
+
+    return (mask.mask[idx / 64] & (1ULL << (idx % 64))) != 0;
+}
+
 static ct_archemask_t0 combine_component(const uint64_t *component_name,
                                          uint32_t name_count) {
-    uint64_t new_type = 0;
+    ct_archemask_t0 new_type = {};
     for (int i = 0; i < name_count; ++i) {
-        new_type |= (1 << ce_hash_lookup(&_G.component_types, component_name[i], 0));
+        _mask_set(&new_type, component_name[i]);
     }
 
-    return (ct_archemask_t0) {new_type};
+    return new_type;
 }
 
 static struct world_instance_t *get_world_instance(ct_world_t0 world) {
@@ -206,1323 +449,4488 @@ static struct ct_ecs_component_i0 *get_interface(uint64_t name) {
     return (ct_ecs_component_i0 *) ce_hash_lookup(&_G.component_interface_map, name, 0);
 }
 
-static ct_archemask_t0 component_mask(uint64_t name) {
-    return (ct_archemask_t0) {(1llu << ce_hash_lookup(&_G.component_types, name, 0))};
-}
-
 static uint64_t component_idx(archetype_t *archetype,
                               uint64_t component_name) {
     return ce_hash_lookup(&archetype->comp_idx, component_name, UINT64_MAX);
 }
 
+// EVENTS
+
+// Bits of event query in chunk, NULL if query had no event in chunk yet.
+static event_bits_t _event_query_bits(ent_chunk_t *chunk,
+                                      uint32_t query_idx) {
+    _Atomic(event_bits_t) *table = atomic_load_explicit(&chunk->event_bits,
+                                                        memory_order_acquire);
+    if (!table) {
+        return NULL;
+    }
+
+    return atomic_load_explicit(&table[query_idx], memory_order_acquire);
+}
+
+// Bits of event query in chunk, allocated on first use.
+static event_bits_t _event_bits(world_instance_t *w,
+                                archetype_t *storage,
+                                ent_chunk_t *chunk,
+                                uint32_t query_idx) {
+    event_bits_t bits = _event_query_bits(chunk, query_idx);
+    if (bits) {
+        return bits;
+    }
+
+    ce_os_thread_a0->spin_lock(&w->event_lock);
+
+    _Atomic(event_bits_t) *table = atomic_load_explicit(&chunk->event_bits,
+                                                        memory_order_relaxed);
+    if (!table) {
+        table = CE_ALLOC(_G.allocator, _Atomic(event_bits_t),
+                         sizeof(_Atomic(event_bits_t)) * MAX_EVENT_QUERIES);
+
+        for (uint32_t i = 0; i < MAX_EVENT_QUERIES; ++i) {
+            atomic_init(&table[i], NULL);
+        }
+
+        atomic_store_explicit(&chunk->event_bits, table, memory_order_release);
+    }
+
+    bits = atomic_load_explicit(&table[query_idx], memory_order_relaxed);
+    if (!bits) {
+        uint32_t size = sizeof(_Atomic uint64_t) * storage->block_n;
+        bits = CE_ALLOC(_G.allocator, _Atomic uint64_t, size);
+        memset(bits, 0, size);
+
+        atomic_store_explicit(&table[query_idx], bits, memory_order_release);
+    }
+
+    ce_os_thread_a0->spin_unlock(&w->event_lock);
+
+    return bits;
+}
+
+// Mark entities [first, first + n) for event queries.
+static void _event_set(world_instance_t *w,
+                       archetype_t *storage,
+                       ent_chunk_t *chunk,
+                       uint32_t first,
+                       uint32_t n,
+                       uint64_t queries) {
+    while (queries) {
+        uint32_t q = __builtin_ctzll(queries);
+        queries &= queries - 1;
+
+        event_bits_t bits = _event_bits(w, storage, chunk, q);
+
+        const uint32_t end = first + n;
+        for (uint32_t i = first; i < end;) {
+            uint32_t bit = i % 64;
+            uint32_t count = 64 - bit;
+            if (count > (end - i)) {
+                count = end - i;
+            }
+
+            uint64_t mask = (count == 64) ? UINT64_MAX : (((1ULL << count) - 1) << bit);
+            atomic_fetch_or(&bits[i / 64], mask);
+            i += count;
+        }
+
+        uint64_t query_bit = 1ULL << q;
+        if (atomic_fetch_or(&chunk->event_mask, query_bit) & query_bit) {
+            continue;
+        }
+
+        ce_os_thread_a0->spin_lock(&w->event_lock);
+        ce_array_push(w->event_queries[q]->event_chunks, chunk, _G.allocator);
+        ce_os_thread_a0->spin_unlock(&w->event_lock);
+    }
+}
+
+// Take pending events of entity slot, return queries that had event.
+static uint64_t _event_take(ent_chunk_t *chunk,
+                            uint32_t idx) {
+    uint64_t queries = chunk->event_mask;
+    uint64_t taken = 0;
+
+    if (!queries) {
+        return 0;
+    }
+
+    const uint64_t bit = 1ULL << (idx % 64);
+
+    while (queries) {
+        uint32_t q = __builtin_ctzll(queries);
+        queries &= queries - 1;
+
+        event_bits_t bits = _event_query_bits(chunk, q);
+        if (bits && (atomic_fetch_and(&bits[idx / 64], ~bit) & bit)) {
+            taken |= 1ULL << q;
+        }
+    }
+
+    return taken;
+}
+
+// Slot dst get events of src, src is cleared.
+static void _event_move(world_instance_t *w,
+                        archetype_t *storage,
+                        ent_chunk_t *src,
+                        uint32_t src_idx,
+                        ent_chunk_t *dst,
+                        uint32_t dst_idx) {
+    uint64_t queries = _event_take(src, src_idx);
+    _event_take(dst, dst_idx);
+
+    if (queries) {
+        _event_set(w, storage, dst, dst_idx, 1, queries);
+    }
+}
+
+// Entity is in chunk slot idx, came from old chunk (NULL = new entity).
+// Pending events go with entity if query still match.
+static void _event_arrive(world_instance_t *w,
+                          ent_chunk_t *old_chunk,
+                          uint32_t old_idx,
+                          archetype_t *storage,
+                          ent_chunk_t *chunk,
+                          uint32_t idx) {
+    uint64_t queries = 0;
+
+    if (!old_chunk) {
+        queries = storage->event_arrive;
+    } else {
+        archetype_t *old_storage = &w->archetype_pool[old_chunk->archetype_idx];
+
+        queries = _event_take(old_chunk, old_idx) & storage->event_match;
+
+        if (old_storage != storage) {
+            for (uint32_t i = 0; i < storage->component_n; ++i) {
+                if (!_mask_has(old_storage->archetype_mask, storage->name[i])) {
+                    queries |= storage->event_add[i];
+                }
+            }
+
+            for (uint32_t i = 0; i < old_storage->component_n; ++i) {
+                if (!_mask_has(storage->archetype_mask, old_storage->name[i])) {
+                    queries |= old_storage->event_remove[i] & storage->event_match;
+                }
+            }
+        }
+    }
+
+    if (queries) {
+        _event_set(w, storage, chunk, idx, 1, queries);
+    }
+}
+
+static void _event_free_chunk(ent_chunk_t *chunk) {
+    _Atomic(event_bits_t) *table = atomic_load(&chunk->event_bits);
+    if (!table) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < MAX_EVENT_QUERIES; ++i) {
+        event_bits_t bits = atomic_load(&table[i]);
+        if (bits) {
+            CE_FREE(_G.allocator, bits);
+        }
+    }
+
+    CE_FREE(_G.allocator, table);
+    atomic_store(&chunk->event_bits, NULL);
+    atomic_store(&chunk->event_mask, 0);
+}
+
 // CHUNK
-ent_chunk_t *_get_new_chunk(world_instance_t *world) {
+ent_chunk_t *_get_new_chunk(world_instance_t *world,
+                            uint32_t size) {
     uint32_t poolfree_n = ce_array_size(world->chunk_pool_free);
 
-    if (!poolfree_n) {
-        ce_log_a0->debug(LOG_WHERE, "Allocate new chunk");
-        ent_chunk_t *chunk = CE_ALLOC(_G.allocator, ent_chunk_t, CHUNK_SIZE);
+    for (uint32_t i = poolfree_n; i > 0; --i) {
+        ent_chunk_t *chunk = world->chunk_pool_free[i - 1];
+        if (chunk->size != size) {
+            continue;
+        }
+
+        ce_log_a0->debug(LOG_WHERE, "Allocate new chunk from pool");
 
-        memset(chunk, 0, CHUNK_SIZE);
+        world->chunk_pool_free[i - 1] = ce_array_back(world->chunk_pool_free);
+        ce_array_pop_back(world->chunk_pool_free);
 
-        ce_array_push(world->chunk_pool, chunk, _G.allocator);
+        // Data is written on add, reset only header
+        memset(chunk, 0, sizeof(ent_chunk_t));
+        chunk->size = size;
         return chunk;
     }
 
-    ce_log_a0->debug(LOG_WHERE, "Allocate new chunk from pool");
+    ce_log_a0->debug(LOG_WHERE, "Allocate new chunk");
 
-    ent_chunk_t *chunk = ce_array_back(world->chunk_pool_free);
-    ce_array_pop_back(world->chunk_pool_free);
+    // Page aligned, so are columns.
+    ent_chunk_t *chunk = CE_ALLOCATE_ALIGN(ce_memory_a0->virt_system, ent_chunk_t,
+                                          size, CHUNK_SIZE_ALIGN);
 
-    memset(chunk, 0, CHUNK_SIZE);
+    memset(chunk, 0, sizeof(ent_chunk_t));
+    chunk->size = size;
 
+    ce_array_push(world->chunk_pool, chunk, _G.allocator);
     return chunk;
 }
 
 void _free_chunk(world_instance_t *world,
                  ent_chunk_t *chunk) {
-    ce_array_clean(chunk->version);
+    _event_free_chunk(chunk);
     ce_array_push(world->chunk_pool_free, chunk, _G.allocator);
 }
 
 // ARCHETYPE
 
+#if defined(__SSE2__)
+#define MASK_LANES (CT_ECS_MASK_WORDS / 2)
+
+#define _mask_lane(m, i) \
+    _mm_loadu_si128((const __m128i *) &(m).mask[(i) * 2])
+
+static inline bool _lane_zero(__m128i v) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(v, _mm_setzero_si128())) == 0xFFFF;
+}
+#endif
+
+// t1 has all of t2
 static bool _archetype_all(ct_archemask_t0 t1,
                            ct_archemask_t0 t2) {
-    return (t1.mask & t2.mask) == t2.mask;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < MASK_LANES; ++i) {
+        acc = _mm_or_si128(acc, _mm_andnot_si128(_mask_lane(t1, i),
+                                                 _mask_lane(t2, i)));
+    }
+    return _lane_zero(acc);
+#else
+    uint64_t acc = 0;
+    for (int i = 0; i < CT_ECS_MASK_WORDS; ++i) {
+        acc |= t2.mask[i] & ~t1.mask[i];
+    }
+    return !acc;
+#endif
 }
 
 static bool _archetype_none(ct_archemask_t0 t1,
                             ct_archemask_t0 t2) {
-    return (t1.mask & t2.mask) == 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < MASK_LANES; ++i) {
+        acc = _mm_or_si128(acc, _mm_and_si128(_mask_lane(t1, i),
+                                              _mask_lane(t2, i)));
+    }
+    return _lane_zero(acc);
+#else
+    uint64_t acc = 0;
+    for (int i = 0; i < CT_ECS_MASK_WORDS; ++i) {
+        acc |= t1.mask[i] & t2.mask[i];
+    }
+    return !acc;
+#endif
 }
 
 static bool _archetype_any(ct_archemask_t0 t1,
                            ct_archemask_t0 t2) {
-    return (t1.mask & t2.mask);
-}
-
-static ct_archemask_t0 _archetype_add(ct_archemask_t0 t1,
-                                      ct_archemask_t0 t2) {
-    return (ct_archemask_t0) {.mask=t1.mask | t2.mask};
+    return !_archetype_none(t1, t2);
 }
 
 static bool _archetype_eq(ct_archemask_t0 t1,
                           ct_archemask_t0 t2) {
-    return t1.mask == t2.mask;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < MASK_LANES; ++i) {
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mask_lane(t1, i),
+                                              _mask_lane(t2, i)));
+    }
+    return _lane_zero(acc);
+#else
+    uint64_t acc = 0;
+    for (int i = 0; i < CT_ECS_MASK_WORDS; ++i) {
+        acc |= t1.mask[i] ^ t2.mask[i];
+    }
+    return !acc;
+#endif
 }
 
-archetype_t *_get_new_archetype(world_instance_t *world) {
-    uint32_t poolfree_n = ce_array_size(world->archetype_free);
+static bool _archetype_empty(ct_archemask_t0 t) {
+    return _archetype_none(t, t);
+}
 
-    if (!poolfree_n) {
-        ce_log_a0->debug(LOG_WHERE, "Allocate new archetype from memory");
+static ct_archemask_t0 _archetype_add(ct_archemask_t0 t1,
+                                      ct_archemask_t0 t2) {
+    ct_archemask_t0 r;
+    for (int i = 0; i < CT_ECS_MASK_WORDS; ++i) {
+        r.mask[i] = t1.mask[i] | t2.mask[i];
+    }
+    return r;
+}
 
-        uint32_t idx = ce_array_size(world->archetype_pool);
-        ce_array_push(world->archetype_pool,
-                      (archetype_t) {.idx = idx}, _G.allocator);
-        return &world->archetype_pool[idx];
+static ct_archemask_t0 _archetype_remove(ct_archemask_t0 t1,
+                                         ct_archemask_t0 t2) {
+    ct_archemask_t0 r;
+    for (int i = 0; i < CT_ECS_MASK_WORDS; ++i) {
+        r.mask[i] = t1.mask[i] & ~t2.mask[i];
     }
+    return r;
+}
 
-    ce_log_a0->debug(LOG_WHERE, "Allocate new archetype from pool");
+static ct_archemask_t0 _archetype_and(ct_archemask_t0 t1,
+                                      ct_archemask_t0 t2) {
+    ct_archemask_t0 r;
+    for (int i = 0; i < CT_ECS_MASK_WORDS; ++i) {
+        r.mask[i] = t1.mask[i] & t2.mask[i];
+    }
+    return r;
+}
 
-    uint32_t idx = ce_array_back(world->archetype_free);
-    ce_array_pop_back(world->archetype_free);
-    return &world->archetype_pool[idx];
+// Key in archetype_map, archetypes with same key are chained by hash_next.
+static uint64_t _archetype_hash(ct_archemask_t0 mask) {
+    return ce_hash_murmur2_64(&mask, sizeof(mask), 0);
 }
 
-void _free_archetype(world_instance_t *world,
-                     archetype_t *archetype) {
+static void _archetype_map_add(world_instance_t *w,
+                               archetype_t *archetype) {
+    uint64_t key = _archetype_hash(archetype->archetype_mask);
 
-    ce_array_clean(archetype->size);
-    ce_array_clean(archetype->name);
-    ce_array_clean(archetype->offset);
-    ce_hash_clean(&archetype->comp_idx);
+    archetype->hash_next = ce_hash_lookup(&w->archetype_map, key, UINT64_MAX);
+    ce_hash_add(&w->archetype_map, key, archetype->idx, _G.allocator);
+}
 
-    archetype->archetype_mask.mask = 0;
+static void _archetype_map_remove(world_instance_t *w,
+                                  archetype_t *archetype) {
+    uint64_t key = _archetype_hash(archetype->archetype_mask);
+    uint64_t idx = ce_hash_lookup(&w->archetype_map, key, UINT64_MAX);
 
-    const uint32_t n = ce_array_size(world->archetype_array);
-    for (int i = 0; i < n; ++i) {
-        if (world->archetype_array[i] != archetype->idx) {
-            continue;
+    if (idx == archetype->idx) {
+        if (archetype->hash_next == UINT64_MAX) {
+            ce_hash_remove(&w->archetype_map, key);
+        } else {
+            ce_hash_add(&w->archetype_map, key, archetype->hash_next, _G.allocator);
         }
-
-        const uint32_t last_idx = n - 1;
-        world->archetype_array[i] = world->archetype_array[last_idx];
-        ce_array_pop_back(world->archetype_array);
-        break;
+        return;
     }
 
-    ent_chunk_t *chunk = archetype->first;
-
-    while (chunk) {
-        _free_chunk(world, chunk);
-        chunk = chunk->next;
-    }
+    while (idx != UINT64_MAX) {
+        archetype_t *prev = &w->archetype_pool[idx];
 
-    ce_array_push(world->archetype_free, archetype->idx, _G.allocator);
-}
+        if (prev->hash_next == archetype->idx) {
+            prev->hash_next = archetype->hash_next;
+            return;
+        }
 
-ct_entity_t0 *_get_entity_array(ent_chunk_t *chunk) {
-    return (ct_entity_t0 *) (chunk + 1);
+        idx = prev->hash_next;
+    }
 }
 
-void *_get_component_array(archetype_t *storage,
-                           ent_chunk_t *chunk,
-                           uint64_t comp_idx) {
-    if (comp_idx == UINT64_MAX) {
-        return NULL;
+static bool _can_run_query_on_archetype(ct_archemask_t0 mask,
+                                        const ct_ecs_query_t0 *query) {
+    if (!_archetype_all(mask, query->all)) {
+        return false;
     }
 
-    void *data = (chunk + 1);
-
-    uint32_t offset = storage->offset[comp_idx];
+    if (!_archetype_none(mask, query->none)) {
+        return false;
+    }
 
-    if (!offset) {
-        return NULL;
+    // Empty any match all.
+    if (!_archetype_empty(query->any) && !_archetype_any(mask, query->any)) {
+        return false;
     }
 
-    return data + storage->offset[comp_idx];
+    return true;
 }
 
-archetype_t *_get_archetype(world_instance_t *w,
-                            ct_archemask_t0 archetype) {
-    uint64_t archetype_idx = ce_hash_lookup(&w->archetype_map, archetype.mask, UINT64_MAX);
+// QUERY CACHE
 
-    if (UINT64_MAX == archetype_idx) {
-        return NULL;
+static void _query_match_archetype(query_cache_t *cache,
+                                   archetype_t *archetype) {
+    if (!_can_run_query_on_archetype(archetype->archetype_mask, &cache->query)) {
+        return;
     }
 
-    archetype_t *storage = &w->archetype_pool[archetype_idx];
-    return storage;
-}
+    ct_archemask_t0 used = _archetype_add(cache->query.all, cache->query.any);
 
-static void *get_one(ct_world_t0 world,
-                     uint64_t component_name,
-                     ct_entity_t0 entity,
-                     bool write) {
+    query_match_t match = {.archetype_idx = archetype->idx};
 
-    if (!entity.h) {
-        return NULL;
+    for (uint32_t j = 0; j < archetype->component_n; ++j) {
+        uint64_t comp_name = archetype->name[j];
+
+        if (_mask_has(cache->query.write, comp_name)) {
+            ce_array_push(match.write, j, _G.allocator);
+        } else if (_mask_has(used, comp_name)) {
+            ce_array_push(match.read, j, _G.allocator);
+        }
     }
 
-    world_instance_t *w = get_world_instance(world);
+    ce_array_push(cache->matches, match, _G.allocator);
+}
 
-    ent_chunk_t *chunk = _entity_chunk(w, entity);
-    if (!chunk) {
-        return NULL;
+// Event query notification masks in archetype.
+static void _event_query_archetype(query_cache_t *cache,
+                                   archetype_t *archetype) {
+    if (!cache->event_idx) {
+        return;
     }
 
-    archetype_t *storage = _get_archetype(w, chunk->archetype_mask);
+    const ct_ecs_query_t0 *query = &cache->query;
+    const uint64_t query_bit = 1ULL << (cache->event_idx - 1);
+    const bool match = _can_run_query_on_archetype(archetype->archetype_mask, query);
 
-    if (!storage) {
-        return NULL;
+    if (match) {
+        archetype->event_match |= query_bit;
     }
 
+    for (uint32_t j = 0; j < archetype->component_n; ++j) {
+        uint64_t comp_name = archetype->name[j];
 
-    uint64_t com_idx = component_idx(storage, component_name);
+        // Entity lost component here, destination archetype must match.
+        if (_mask_has(query->removed, comp_name)) {
+            archetype->event_remove[j] |= query_bit;
+        }
 
-    if (com_idx == UINT64_MAX) {
-        return NULL;
-    }
+        if (!match) {
+            continue;
+        }
 
-    if (write) {
-        chunk->version[com_idx] = w->global_system_version;
+        if (_mask_has(query->changed, comp_name)) {
+            archetype->event_change[j] |= query_bit;
+        }
+
+        if (_mask_has(query->added, comp_name) || _mask_has(query->changed, comp_name)) {
+            archetype->event_add[j] |= query_bit;
+            archetype->event_arrive |= query_bit;
+        }
     }
+}
 
-    uint32_t data_idx = _entity_data_idx(w, entity);
+static void _query_unmatch_archetype(query_cache_t *cache,
+                                     uint32_t archetype_idx) {
+    const uint32_t n = ce_array_size(cache->matches);
+    for (uint32_t i = 0; i < n; ++i) {
+        query_match_t *match = &cache->matches[i];
 
+        if (match->archetype_idx != archetype_idx) {
+            continue;
+        }
 
-    void *data = _get_component_array(storage, chunk, com_idx);
-    if (!data) {
-        return NULL;
-    }
+        ce_array_free(match->read, _G.allocator);
+        ce_array_free(match->write, _G.allocator);
 
-    return data + (storage->size[com_idx] * data_idx);
+        *match = cache->matches[n - 1];
+        ce_array_pop_back(cache->matches);
+        return;
+    }
 }
 
-void _add_to_archetype(world_instance_t *w,
-                       ct_entity_t0 ent,
-                       ct_archemask_t0 archetype_mask) {
-    ent_chunk_t *ch = _entity_chunk(w, ent);
+static void _query_cache_add_archetype(world_instance_t *w,
+                                       archetype_t *archetype) {
+    ce_os_thread_a0->spin_lock(&w->query_lock);
 
-    if (ch && (ch->archetype_mask.mask == archetype_mask.mask)) {
-        return;
+    const uint32_t n = ce_array_size(w->query_caches);
+    for (uint32_t i = 0; i < n; ++i) {
+        _query_match_archetype(w->query_caches[i], archetype);
+        _event_query_archetype(w->query_caches[i], archetype);
     }
 
-    uint64_t archetype_idx = ce_hash_lookup(&w->archetype_map, archetype_mask.mask, UINT64_MAX);
+    ce_os_thread_a0->spin_unlock(&w->query_lock);
+}
 
-    if (UINT64_MAX == archetype_idx) {
-        archetype_t *storage = _get_new_archetype(w);
-        archetype_idx = storage->idx;
-        ce_hash_add(&w->archetype_map, archetype_mask.mask, archetype_idx, _G.allocator);
+static void _query_cache_remove_archetype(world_instance_t *w,
+                                          archetype_t *archetype) {
+    ce_os_thread_a0->spin_lock(&w->query_lock);
 
-        ce_array_push(w->archetype_array, archetype_idx, _G.allocator);
+    const uint32_t n = ce_array_size(w->query_caches);
+    for (uint32_t i = 0; i < n; ++i) {
+        _query_unmatch_archetype(w->query_caches[i], archetype->idx);
+    }
 
-        bool has_system_state = false;
-        uint32_t all_component_size = sizeof(ct_entity_t0);
-        const uint32_t component_n = ce_array_size(_G.components_name);
-
-        uint32_t comp_idx = 0;
-        for (int i = 0; i < component_n; ++i) {
-            uint64_t component_name = _G.components_name[i];
-
-            ct_ecs_component_i0 *ci = get_interface(component_name);
+    ce_os_thread_a0->spin_unlock(&w->query_lock);
+}
 
-            ct_archemask_t0 mask = component_mask(component_name);
-            if (!(_archetype_any(archetype_mask, mask))) {
-                continue;
-            }
+// Masks only, only_changed is checked per call.
+static uint64_t _query_hash(const ct_ecs_query_t0 *query) {
+    ct_archemask_t0 masks[] = {query->all, query->any, query->none, query->write,
+                               query->added, query->removed, query->changed};
+    return ce_hash_murmur2_64(masks, sizeof(masks), 0);
+}
 
-            ce_hash_add(&storage->comp_idx, component_name, comp_idx, _G.allocator);
-            comp_idx += 1;
+static bool _query_eq(const ct_ecs_query_t0 *q1,
+                      const ct_ecs_query_t0 *q2) {
+    return _archetype_eq(q1->all, q2->all)
+           && _archetype_eq(q1->any, q2->any)
+           && _archetype_eq(q1->none, q2->none)
+           && _archetype_eq(q1->write, q2->write)
+           && _archetype_eq(q1->added, q2->added)
+           && _archetype_eq(q1->removed, q2->removed)
+           && _archetype_eq(q1->changed, q2->changed);
+}
 
-            if (ci->is_system_state) {
-                has_system_state = true;
-            }
+static bool _query_has_events(const ct_ecs_query_t0 *query) {
+    return !_archetype_empty(query->added)
+           || !_archetype_empty(query->removed)
+           || !_archetype_empty(query->changed);
+}
 
-            if (ci->size) {
-                all_component_size += ci->size;
-            }
+// New event query see all entities it match as added/changed.
+static void _add_event_query(world_instance_t *w,
+                             query_cache_t *cache) {
+    // Unfiltered query would see every entity every frame.
+    if (w->event_query_n == MAX_EVENT_QUERIES) {
+        ce_log_a0->error(LOG_WHERE, "Too many queries with event filter, max %d,"
+                                    " query match nothing", MAX_EVENT_QUERIES);
+        cache->event_overflow = true;
+        return;
+    }
 
-            ce_array_push(storage->size, ci->size, _G.allocator);
-            ce_array_push(storage->name, component_name, _G.allocator);
-            ce_array_push(storage->offset, 0, _G.allocator);
-        }
+    const uint32_t query_idx = w->event_query_n++;
+    w->event_queries[query_idx] = cache;
+    cache->event_idx = query_idx + 1;
 
-        uint32_t free_space = CHUNK_SIZE - sizeof(ent_chunk_t);
-        storage->archetype_mask = archetype_mask;
-        storage->max_ent = free_space / all_component_size;
-        storage->has_system_state = has_system_state;
-        storage->component_n = comp_idx;
+    const uint64_t query_bit = 1ULL << query_idx;
 
-        // offsets
-        uint32_t data_offset = (sizeof(ct_entity_t0) * storage->max_ent);
+    const uint32_t n = ce_array_size(w->archetype_array);
+    for (uint32_t i = 0; i < n; ++i) {
+        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
+        _event_query_archetype(cache, storage);
 
-        for (int i = 0; i < comp_idx; ++i) {
-            if (storage->size[i]) {
-                storage->offset[i] = data_offset;
-                data_offset += storage->size[i] * storage->max_ent;
-            }
+        if (!(storage->event_arrive & query_bit)) {
+            continue;
         }
 
-        ent_chunk_t *chunk = _get_new_chunk(w);
-        chunk->archetype_idx = storage->idx;
-        chunk->archetype_mask = storage->archetype_mask;
-        ce_array_resize(chunk->version, storage->component_n, _G.allocator);
-        for (int j = 0; j < storage->component_n; ++j) {
-            chunk->version[j] = w->global_system_version;
+        ent_chunk_t *chunk = storage->first;
+        while (chunk) {
+            _event_set(w, storage, chunk, 0, chunk->ent_n, query_bit);
+            chunk = chunk->next;
         }
-        storage->first = chunk;
     }
+}
 
-    archetype_t *storage = &w->archetype_pool[archetype_idx];
+// System running on this thread, set for each system run.
+static CE_THREAD_LOCAL uint64_t _cur_system = 0;
 
-    // Find free chunk
-    ent_chunk_t *chunk = storage->first;
-    while (chunk) {
-        if ((chunk->ent_n + 1) > storage->max_ent) {
-            if (chunk->next) {
-                chunk = chunk->next;
-                continue;
-            }
+// Fiber can resume on other worker => no inline accessors.
+static CE_NO_INLINE uint64_t _current_system() {
+    return _cur_system;
+}
 
-            ent_chunk_t *new = _get_new_chunk(w);
-            new->archetype_mask = storage->archetype_mask;
-            new->archetype_idx = storage->idx;
-            ce_array_resize(new->version, storage->component_n, _G.allocator);
-            for (int j = 0; j < storage->component_n; ++j) {
-                chunk->version[j] = w->global_system_version;
-            }
+static CE_NO_INLINE void _set_current_system(uint64_t system) {
+    _cur_system = system;
+}
 
-            new->next = chunk;
-            chunk->next = NULL;
-            chunk->prev = new;
-            storage->first = new;
-            chunk = new;
-            break;
-        } else {
-            break;
-        }
+// Query is cached on first use and live with world.
+// Event query is cached per system, systems do not steal events each other.
+static query_cache_t *_get_query_cache(world_instance_t *w,
+                                       const ct_ecs_query_t0 *query) {
+    uint64_t key = _query_hash(query);
+
+    uint64_t system = 0;
+    if (_query_has_events(query)) {
+        system = _current_system();
+        key = ce_hash_murmur2_64(&system, sizeof(system), key);
     }
 
-    const uint64_t ent_data_idx = chunk->ent_n++;
+    ce_os_thread_a0->spin_lock(&w->query_lock);
 
-    ct_entity_t0 *entity = _get_entity_array(chunk);
+    query_cache_t *head = (query_cache_t *) ce_hash_lookup(&w->query_map, key, 0);
 
-    entity[ent_data_idx] = ent;
+    query_cache_t *cache = head;
+    while (cache && ((cache->system != system) || !_query_eq(&cache->query, query))) {
+        cache = cache->next;
+    }
 
-    for (int i = 0; i < storage->component_n; ++i) {
-        chunk->version[i] = w->global_system_version;
+    if (!cache) {
+        cache = CE_ALLOC(_G.allocator, query_cache_t, sizeof(query_cache_t));
+        *cache = (query_cache_t) {
+                .query = *query,
+                .next = head,
+                .system = system,
+        };
+        cache->query.only_changed = false;
+
+        const uint32_t n = ce_array_size(w->archetype_array);
+        for (uint32_t i = 0; i < n; ++i) {
+            _query_match_archetype(cache, &w->archetype_pool[w->archetype_array[i]]);
+        }
 
-        uint32_t size = storage->size[i];
-        if (!size) {
-            continue;
+        if (_query_has_events(query)) {
+            _add_event_query(w, cache);
         }
 
-        void *data = _get_component_array(storage, chunk, i);
-        memset(data + (ent_data_idx * size), 0, size);
+        ce_array_push(w->query_caches, cache, _G.allocator);
+        ce_hash_add(&w->query_map, key, (uint64_t) cache, _G.allocator);
     }
 
-    _entity_data_idx(w, ent) = ent_data_idx;
-    _entity_chunk(w, ent) = chunk;
+    ce_os_thread_a0->spin_unlock(&w->query_lock);
+
+    return cache;
 }
 
-void _remove_from_archetype(world_instance_t *w,
-                            ct_entity_t0 ent,
-                            uint64_t ent_idx,
-                            ent_chunk_t *chunk,
-                            ct_archemask_t0 archetype) {
-    if (!chunk->ent_n) {
-        return;
-    }
+archetype_t *_get_new_archetype(world_instance_t *world) {
+    uint32_t poolfree_n = ce_array_size(world->archetype_free);
 
-    uint32_t last_idx = --chunk->ent_n;
+    if (!poolfree_n) {
+        ce_log_a0->debug(LOG_WHERE, "Allocate new archetype from memory");
 
-    uint64_t entity_data_idx = ent_idx;
+        uint32_t idx = ce_array_size(world->archetype_pool);
+        ce_array_push(world->archetype_pool,
+                      (archetype_t) {.idx = idx}, _G.allocator);
+        return &world->archetype_pool[idx];
+    }
 
-    archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
+    ce_log_a0->debug(LOG_WHERE, "Allocate new archetype from pool");
 
-    if (!chunk->ent_n) {
-        if (chunk->prev) {
-            chunk->prev->next = chunk->next;
-        }
+    uint32_t idx = ce_array_back(world->archetype_free);
+    ce_array_pop_back(world->archetype_free);
+    return &world->archetype_pool[idx];
+}
 
-        if (chunk->next) {
-            chunk->next->prev = chunk->prev;
-        }
+void _free_archetype(world_instance_t *world,
+                     archetype_t *archetype) {
 
-        if (storage->first != chunk) {
-            _free_chunk(w, chunk);
-        } else {
-            ce_hash_remove(&w->archetype_map, archetype.mask);
-            _free_archetype(w, storage);
-        }
-        return;
-    }
+    _archetype_map_remove(world, archetype);
+    _query_cache_remove_archetype(world, archetype);
 
-    if (last_idx == entity_data_idx) {
-        return;
+    const uint32_t edge_n = ce_array_size(archetype->edges);
+    for (uint32_t i = 0; i < edge_n; ++i) {
+        ce_array_free(archetype->edges[i].remap, _G.allocator);
     }
+    ce_array_clean(archetype->edges);
+    ce_hash_clean(&archetype->add_edges);
+    ce_hash_clean(&archetype->remove_edges);
+    ++archetype->generation;
 
-    ct_entity_t0 *entity = _get_entity_array(chunk);
-
-    ct_entity_t0 last_ent = entity[last_idx];
-    _entity_data_idx(w, last_ent) = entity_data_idx;
-
-    entity[entity_data_idx] = last_ent;
-
-    for (int i = 0; i < storage->component_n; ++i) {
-        chunk->version[i] = w->global_system_version;
+    ce_array_clean(archetype->size);
+    ce_array_clean(archetype->name);
+    ce_array_clean(archetype->offset);
+    ce_array_clean(archetype->shared_offset);
+    ce_array_clean(archetype->event_add);
+    ce_array_clean(archetype->event_change);
+    ce_array_clean(archetype->event_remove);
+    archetype->event_match = 0;
+    archetype->event_arrive = 0;
+    ce_hash_clean(&archetype->comp_idx);
 
-        void *data = _get_component_array(storage, chunk, i);
+    archetype->archetype_mask = (ct_archemask_t0) {};
 
-        if (!data) {
+    const uint32_t n = ce_array_size(world->archetype_array);
+    for (int i = 0; i < n; ++i) {
+        if (world->archetype_array[i] != archetype->idx) {
             continue;
         }
 
-        uint64_t size = storage->size[i];
+        const uint32_t last_idx = n - 1;
+        world->archetype_array[i] = world->archetype_array[last_idx];
+        ce_array_pop_back(world->archetype_array);
+        break;
+    }
 
-        memcpy(data + (entity_data_idx * size),
-               data + (last_idx * size), size);
+    ent_chunk_t *chunk = archetype->first;
+
+    while (chunk) {
+        _free_chunk(world, chunk);
+        chunk = chunk->next;
     }
+    archetype->first = NULL;
+
+    ce_array_push(world->archetype_free, archetype->idx, _G.allocator);
 }
 
-static void _move_data_from_archetype(world_instance_t *w,
-                                      struct ct_entity_t0 ent,
-                                      ent_chunk_t *old_chunk,
-                                      uint32_t old_idx,
-                                      ct_archemask_t0 ent_type,
-                                      ct_archemask_t0 new_type) {
+ct_entity_t0 *_get_entity_array(ent_chunk_t *chunk) {
+    return (ct_entity_t0 *) (((uint8_t *) chunk) + chunk->ent_offset);
+}
 
-    archetype_t *old_storage = _get_archetype(w, ent_type);
-    archetype_t *new_storage = _get_archetype(w, new_type);
+void *_get_component_array(archetype_t *storage,
+                           ent_chunk_t *chunk,
+                           uint64_t comp_idx) {
+    if (comp_idx == UINT64_MAX) {
+        return NULL;
+    }
 
-    if (old_storage == new_storage) {
-        return;
+    uint32_t offset = storage->offset[comp_idx];
+
+    if (!offset) {
+        return NULL;
     }
 
-    uint32_t idx = _entity_data_idx(w, ent);
-    ent_chunk_t *chunk = _entity_chunk(w, ent);
+    return ((uint8_t *) chunk) + offset;
+}
 
-    for (int i = 0; i < old_storage->component_n; ++i) {
-        uint64_t component_name = old_storage->name[i];
+archetype_t *_get_archetype(world_instance_t *w,
+                            ct_archemask_t0 archetype) {
+    uint64_t archetype_idx = ce_hash_lookup(&w->archetype_map,
+                                            _archetype_hash(archetype), UINT64_MAX);
 
-        ct_archemask_t0 mask = component_mask(component_name);
-        if (_archetype_none(ent_type, mask)) {
-            continue;
-        }
+    while (UINT64_MAX != archetype_idx) {
+        archetype_t *storage = &w->archetype_pool[archetype_idx];
 
-        if (_archetype_none(new_type, mask)) {
-            continue;
+        if (_archetype_eq(storage->archetype_mask, archetype)) {
+            return storage;
         }
 
-        uint32_t size = old_storage->size[i];
-        if (!size) {
-            continue;
-        }
+        archetype_idx = storage->hash_next;
+    }
 
-        void *old_data = _get_component_array(old_storage, old_chunk, i);
+    return NULL;
+}
 
-        uint64_t comp_idx = component_idx(new_storage, component_name);
-        void *new_data = _get_component_array(new_storage, chunk, comp_idx);
+static uint32_t *_block_version(archetype_t *storage,
+                                ent_chunk_t *chunk,
+                                uint32_t comp_idx) {
+    return chunk->version + storage->component_n + (comp_idx * storage->block_n);
+}
 
-        CE_ASSERT(LOG_WHERE, old_data != new_data);
+// Set component version for entities [first, first + n).
+static void _stamp_version(archetype_t *storage,
+                           ent_chunk_t *chunk,
+                           uint32_t comp_idx,
+                           uint32_t first,
+                           uint32_t n,
+                           uint32_t version) {
+    chunk->version[comp_idx] = version;
 
-        memcpy(new_data + (idx * size),
-               old_data + (old_idx * size),
-               size);
+    if (!n) {
+        return;
+    }
+
+    uint32_t *block = _block_version(storage, chunk, comp_idx);
+    const uint32_t last = (first + n - 1) / CHUNK_BLOCK_SIZE;
+    for (uint32_t b = first / CHUNK_BLOCK_SIZE; b <= last; ++b) {
+        block[b] = version;
     }
 }
 
-void _add_components_to_archetype(ct_world_t0 world,
-                                  struct ct_entity_t0 ent,
-                                  ct_archemask_t0 new_type) {
-    world_instance_t *w = get_world_instance(world);
+static void *get_one(ct_world_t0 world,
+                     uint64_t component_name,
+                     ct_entity_t0 entity,
+                     bool write) {
 
-    uint32_t idx = _entity_data_idx(w, ent);
-    ent_chunk_t *chunk = _entity_chunk(w, ent);
+    if (!entity.h) {
+        return NULL;
+    }
 
-    if (chunk) {
-        if (_archetype_eq(chunk->archetype_mask, new_type)) {
-            return;
-        }
-        new_type = _archetype_add(new_type, chunk->archetype_mask);
+    world_instance_t *w = get_world_instance(world);
+
+    ent_chunk_t *chunk = _entity_chunk(w, entity);
+    if (!chunk) {
+        return NULL;
     }
 
+    archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
 
-    _add_to_archetype(w, ent, new_type);
+    uint64_t com_idx = component_idx(storage, component_name);
 
-    if (chunk && chunk->archetype_mask.mask) {
-        _move_data_from_archetype(w, ent, chunk, idx, chunk->archetype_mask, new_type);
-        _remove_from_archetype(w, ent, idx, chunk, chunk->archetype_mask);
+    if (com_idx == UINT64_MAX) {
+        return NULL;
     }
-}
 
-///
+    // Shared value is changed only by set_shared.
+    uint32_t shared_offset = storage->shared_offset[com_idx];
+    if (shared_offset) {
+        return write ? NULL : ((uint8_t *) chunk) + shared_offset;
+    }
 
-#define ADD_COMPONENT_CMD \
-    CE_ID64_0("add_component", 0xd0363f18e7a5b7e2ULL)
+    uint32_t data_idx = _entity_data_idx(w, entity);
 
-#define REMOVE_COMPONENT_CMD \
-    CE_ID64_0("remove_component", 0x1845aca1baf10397ULL)
+    if (write) {
+        _stamp_version(storage, chunk, com_idx, data_idx, 1, w->global_system_version);
 
-typedef struct add_component_t {
-    uint64_t type;
-    ct_world_t0 world;
-    ct_entity_t0 ent;
-    uint64_t component_type;
-    void *data;
-    uint32_t component_size;
-} add_component_t;
+        if (storage->event_change[com_idx]) {
+            _event_set(w, storage, chunk, data_idx, 1, storage->event_change[com_idx]);
+        }
+    }
 
-typedef struct remove_components_t {
-    ct_world_t0 world;
-    ct_entity_t0 ent;
-    uint64_t *components;
-    uint32_t n;
-} remove_components_t;
 
-typedef struct cmd_t {
-    uint64_t type;
-    union {
-        add_component_t add;
-        remove_components_t remove;
-    };
-} cmd_t;
+    void *data = _get_component_array(storage, chunk, com_idx);
+    if (!data) {
+        return NULL;
+    }
 
-uint32_t _new_cmd_buff() {
-    if (ce_array_empty(_G.free_cmd_buff_queue)) {
-        uint32_t idx = ce_array_size(_G.cmd_buf_pool);
-        ce_array_push(_G.cmd_buf_pool, (ce_mpmc_queue_t0) {}, _G.allocator);
+    return data + (storage->size[com_idx] * data_idx);
+}
 
-        ce_mpmc_queue_t0 *q = &_G.cmd_buf_pool[idx];
-        ce_mpmc_init(q, 4096, sizeof(cmd_t), _G.allocator);
+// Chunk bytes for ent_n entities with aligned columns.
+static uint32_t _chunk_layout_size(archetype_t *storage,
+                                   uint32_t ent_n) {
+    uint32_t size = storage->ent_offset;
+    size += _align_up(sizeof(ct_entity_t0) * ent_n, COLUMN_ALIGN);
 
-        return idx;
+    for (uint32_t i = 0; i < storage->component_n; ++i) {
+        size += _align_up(storage->size[i] * ent_n, COLUMN_ALIGN);
     }
 
-    uint32_t idx = ce_array_back(_G.free_cmd_buff_queue);
-    ce_array_pop_back(_G.free_cmd_buff_queue);
-    return idx;
+    return size;
 }
 
-void _free_cmd_buff(uint32_t idx) {
-    ce_mpmc_queue_t0 *q = &_G.cmd_buf_pool[idx];
-    ce_mpmc_clean(q);
-
-    ce_array_push(_G.free_cmd_buff_queue, idx, _G.allocator);
+static uint8_t *_chunk_shared(archetype_t *storage,
+                              ent_chunk_t *chunk) {
+    return ((uint8_t *) chunk) + storage->shared_begin;
 }
 
-static void *virtual_alloc(uint64_t size) {
-    return CE_REALLOC(ce_memory_a0->virt_system, void, NULL, size, 0);
+static uint64_t _shared_hash(archetype_t *storage,
+                             const uint8_t *shared) {
+    if (!storage->shared_size) {
+        return 0;
+    }
+
+    return ce_hash_murmur2_64(shared, storage->shared_size, 0);
 }
 
-//static void virtual_free(void* ptr, uint64_t size) {
+static bool _chunk_has_shared(archetype_t *storage,
+                              ent_chunk_t *chunk,
+                              const uint8_t *shared,
+                              uint64_t shared_hash) {
+    if (!storage->shared_size) {
+        return true;
+    }
+
+    return (chunk->shared_hash == shared_hash)
+           && !memcmp(_chunk_shared(storage, chunk), shared, storage->shared_size);
+}
+
+// Shared values for storage taken from chunk, missing are zero.
+static uint8_t *_build_shared(world_instance_t *w,
+                              archetype_t *storage,
+                              ent_chunk_t *from) {
+    ce_array_resize(w->shared_scratch, storage->shared_size, _G.allocator);
+    memset(w->shared_scratch, 0, storage->shared_size);
+
+    if (!from || !storage->shared_size) {
+        return w->shared_scratch;
+    }
+
+    archetype_t *from_storage = &w->archetype_pool[from->archetype_idx];
+    if (!from_storage->shared_size) {
+        return w->shared_scratch;
+    }
+
+    for (uint32_t i = 0; i < storage->component_n; ++i) {
+        uint32_t offset = storage->shared_offset[i];
+        if (!offset) {
+            continue;
+        }
+
+        uint64_t from_idx = component_idx(from_storage, storage->name[i]);
+        if (from_idx == UINT64_MAX) {
+            continue;
+        }
+
+        memcpy(w->shared_scratch + (offset - storage->shared_begin),
+               ((uint8_t *) from) + from_storage->shared_offset[from_idx],
+               get_interface(storage->name[i])->size);
+    }
+
+    return w->shared_scratch;
+}
+
+// New chunk is linked as storage first.
+static ent_chunk_t *_new_archetype_chunk(world_instance_t *w,
+                                         archetype_t *storage,
+                                         const uint8_t *shared,
+                                         uint64_t shared_hash) {
+    ent_chunk_t *chunk = _get_new_chunk(w, storage->chunk_size);
+    chunk->archetype_mask = storage->archetype_mask;
+    chunk->archetype_idx = storage->idx;
+    chunk->ent_offset = storage->ent_offset;
+
+    chunk->shared_hash = shared_hash;
+    memcpy(_chunk_shared(storage, chunk), shared, storage->shared_size);
+
+    const uint32_t version_n = storage->component_n * (1 + storage->block_n);
+    for (uint32_t j = 0; j < version_n; ++j) {
+        chunk->version[j] = w->global_system_version;
+    }
+
+    chunk->next = storage->first;
+    if (storage->first) {
+        storage->first->prev = chunk;
+    }
+    storage->first = chunk;
+
+    return chunk;
+}
+
+// Can realloc archetype_pool.
+static archetype_t *_get_or_create_archetype(world_instance_t *w,
+                                             ct_archemask_t0 archetype_mask) {
+    archetype_t *storage = _get_archetype(w, archetype_mask);
+
+    if (!storage) {
+        storage = _get_new_archetype(w);
+        uint32_t archetype_idx = storage->idx;
+        storage->archetype_mask = archetype_mask;
+        _archetype_map_add(w, storage);
+
+        ce_array_push(w->archetype_array, archetype_idx, _G.allocator);
+
+        bool has_system_state = false;
+        uint32_t all_component_size = sizeof(ct_entity_t0);
+        uint32_t shared_size = 0;
+        uint32_t chunk_size = w->chunk_size;
+        const uint32_t component_n = ce_array_size(_G.components_name);
+
+        uint32_t comp_idx = 0;
+        for (int i = 0; i < component_n; ++i) {
+            uint64_t component_name = _G.components_name[i];
+
+            ct_ecs_component_i0 *ci = get_interface(component_name);
+
+            if (!_mask_has(archetype_mask, component_name)) {
+                continue;
+            }
+
+            ce_hash_add(&storage->comp_idx, component_name, comp_idx, _G.allocator);
+            comp_idx += 1;
+
+            if (ci->is_system_state) {
+                has_system_state = true;
+            }
+
+            if (ci->chunk_size > chunk_size) {
+                chunk_size = ci->chunk_size;
+            }
+
+            ce_array_push(storage->name, component_name, _G.allocator);
+            ce_array_push(storage->offset, 0, _G.allocator);
+            ce_array_push(storage->event_add, 0, _G.allocator);
+            ce_array_push(storage->event_change, 0, _G.allocator);
+            ce_array_push(storage->event_remove, 0, _G.allocator);
+
+            // Shared value is stored once per chunk, no column.
+            if (ci->is_shared) {
+                ce_array_push(storage->size, 0, _G.allocator);
+                ce_array_push(storage->shared_offset, shared_size, _G.allocator);
+                shared_size += _align_up(ci->size, sizeof(uint64_t));
+                continue;
+            }
+
+            all_component_size += ci->size;
+
+            ce_array_push(storage->size, ci->size, _G.allocator);
+            ce_array_push(storage->shared_offset, 0, _G.allocator);
+        }
+
+        storage->has_system_state = has_system_state;
+        storage->component_n = comp_idx;
+        storage->shared_size = shared_size;
+
+        // Header with inline versions, block count from max possible entities.
+        // Big components get bigger chunk
+        chunk_size = _align_up(chunk_size, CHUNK_SIZE_ALIGN);
+        while (true) {
+            uint32_t max_possible = chunk_size / all_component_size;
+            storage->block_n = (max_possible + CHUNK_BLOCK_SIZE - 1) / CHUNK_BLOCK_SIZE;
+
+            uint32_t version_n = comp_idx * (1 + storage->block_n);
+            storage->shared_begin = _align_up(sizeof(ent_chunk_t) +
+                                              (sizeof(uint32_t) * version_n),
+                                              sizeof(uint64_t));
+            storage->ent_offset = _align_up(storage->shared_begin + shared_size,
+                                            COLUMN_ALIGN);
+
+            if (_chunk_layout_size(storage, 1) <= chunk_size) {
+                break;
+            }
+
+            chunk_size += CHUNK_SIZE_ALIGN;
+        }
+        storage->chunk_size = chunk_size;
+
+        // Estimate with worst padding and fill rest
+        uint32_t padding = COLUMN_ALIGN * (comp_idx + 1);
+        uint32_t max_ent = 1;
+        if (chunk_size > (storage->ent_offset + padding)) {
+            max_ent = (chunk_size - storage->ent_offset - padding) / all_component_size;
+        }
+
+        if (!max_ent) {
+            max_ent = 1;
+        }
+
+        while (_chunk_layout_size(storage, max_ent + 1) <= chunk_size) {
+            max_ent += 1;
+        }
+        storage->max_ent = max_ent;
+
+        // offsets
+        uint32_t data_offset = storage->ent_offset;
+        data_offset += _align_up(sizeof(ct_entity_t0) * max_ent, COLUMN_ALIGN);
+
+        for (int i = 0; i < comp_idx; ++i) {
+            storage->offset[i] = 0;
+
+            if (storage->size[i]) {
+                storage->offset[i] = data_offset;
+                data_offset += _align_up(storage->size[i] * max_ent, COLUMN_ALIGN);
+            }
+
+            if (get_interface(storage->name[i])->is_shared) {
+                storage->shared_offset[i] += storage->shared_begin;
+            }
+        }
+
+        _query_cache_add_archetype(w, storage);
+    }
+
+    return storage;
+}
+
+// Shared values NULL = keep values from current entity chunk.
+static void _add_to_archetype_storage(world_instance_t *w,
+                                      ct_entity_t0 ent,
+                                      archetype_t *storage,
+                                      const uint8_t *shared) {
+    ent_chunk_t *old_chunk = _entity_chunk(w, ent);
+
+    if (!shared) {
+        shared = _build_shared(w, storage, old_chunk);
+    }
+
+    uint64_t shared_hash = _shared_hash(storage, shared);
+
+    // Find free chunk
+    ent_chunk_t *chunk = storage->first;
+    while (chunk) {
+        if (((chunk->ent_n + 1) <= storage->max_ent)
+            && _chunk_has_shared(storage, chunk, shared, shared_hash)) {
+            break;
+        }
+
+        chunk = chunk->next;
+    }
+
+    if (!chunk) {
+        chunk = _new_archetype_chunk(w, storage, shared, shared_hash);
+    }
+
+    const uint64_t ent_data_idx = chunk->ent_n++;
+
+    ct_entity_t0 *entity = _get_entity_array(chunk);
+
+    entity[ent_data_idx] = ent;
+
+    for (int i = 0; i < storage->component_n; ++i) {
+        _stamp_version(storage, chunk, i, ent_data_idx, 1, w->global_system_version);
+
+        uint32_t size = storage->size[i];
+        if (!size) {
+            continue;
+        }
+
+        void *data = _get_component_array(storage, chunk, i);
+        memset(data + (ent_data_idx * size), 0, size);
+    }
+
+    if (w->event_query_n) {
+        uint32_t old_idx = old_chunk ? _entity_data_idx(w, ent) : 0;
+        _event_arrive(w, old_chunk, old_idx, storage, chunk, ent_data_idx);
+    }
+
+    _entity_data_idx(w, ent) = ent_data_idx;
+    _entity_chunk(w, ent) = chunk;
+}
+
+void _add_to_archetype(world_instance_t *w,
+                       ct_entity_t0 ent,
+                       ct_archemask_t0 archetype_mask) {
+    ent_chunk_t *ch = _entity_chunk(w, ent);
+
+    if (ch && _archetype_eq(ch->archetype_mask, archetype_mask)) {
+        return;
+    }
+
+    _add_to_archetype_storage(w, ent, _get_or_create_archetype(w, archetype_mask), NULL);
+}
+
+static void _unlink_chunk(world_instance_t *w,
+                          archetype_t *storage,
+                          ent_chunk_t *chunk) {
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    }
+
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+
+    if (storage->first == chunk) {
+        storage->first = chunk->next;
+    }
+
+    _free_chunk(w, chunk);
+}
+
+void _remove_from_archetype(world_instance_t *w,
+                            ct_entity_t0 ent,
+                            uint64_t ent_idx,
+                            ent_chunk_t *chunk,
+                            ct_archemask_t0 archetype) {
+    if (!chunk->ent_n) {
+        return;
+    }
+
+    uint32_t last_idx = --chunk->ent_n;
+
+    uint64_t entity_data_idx = ent_idx;
+
+    archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
+
+    if (!chunk->ent_n) {
+        _unlink_chunk(w, storage, chunk);
+
+        if (!storage->first) {
+            _free_archetype(w, storage);
+        }
+        return;
+    }
+
+    storage->fragmented = true;
+
+    // Last entity take removed slot with its events.
+    if (chunk->event_mask) {
+        if (last_idx == entity_data_idx) {
+            _event_take(chunk, last_idx);
+        } else {
+            _event_move(w, storage, chunk, last_idx, chunk, entity_data_idx);
+        }
+    }
+
+    if (last_idx == entity_data_idx) {
+        return;
+    }
+
+    ct_entity_t0 *entity = _get_entity_array(chunk);
+
+    ct_entity_t0 last_ent = entity[last_idx];
+    _entity_data_idx(w, last_ent) = entity_data_idx;
+
+    entity[entity_data_idx] = last_ent;
+
+    for (int i = 0; i < storage->component_n; ++i) {
+        _stamp_version(storage, chunk, i, entity_data_idx, 1, w->global_system_version);
+
+        void *data = _get_component_array(storage, chunk, i);
+
+        if (!data) {
+            continue;
+        }
+
+        uint64_t size = storage->size[i];
+
+        memcpy(data + (entity_data_idx * size),
+               data + (last_idx * size), size);
+    }
+}
+
+// Can realloc archetype_pool.
+static archetype_edge_t *_archetype_edge(world_instance_t *w,
+                                         uint32_t archetype_idx,
+                                         uint64_t component_name,
+                                         bool add) {
+    archetype_t *src = &w->archetype_pool[archetype_idx];
+    ce_hash_t *edges = add ? &src->add_edges : &src->remove_edges;
+
+    uint64_t edge_idx = ce_hash_lookup(edges, component_name, UINT64_MAX);
+
+    if (edge_idx != UINT64_MAX) {
+        archetype_edge_t *edge = &src->edges[edge_idx];
+        archetype_t *dst = &w->archetype_pool[edge->archetype_idx];
+
+        if (dst->generation == edge->generation) {
+            return edge;
+        }
+    } else {
+        edge_idx = ce_array_size(src->edges);
+        ce_array_push(src->edges, (archetype_edge_t) {}, _G.allocator);
+        ce_hash_add(edges, component_name, edge_idx, _G.allocator);
+    }
+
+    ct_archemask_t0 delta = combine_component(&component_name, 1);
+    ct_archemask_t0 mask = add ? _archetype_add(src->archetype_mask, delta)
+                               : _archetype_remove(src->archetype_mask, delta);
+
+    archetype_t *dst = _get_or_create_archetype(w, mask);
+    src = &w->archetype_pool[archetype_idx];
+
+    archetype_edge_t *edge = &src->edges[edge_idx];
+    edge->archetype_idx = dst->idx;
+    edge->generation = dst->generation;
+
+    ce_array_resize(edge->remap, src->component_n, _G.allocator);
+    for (uint32_t i = 0; i < src->component_n; ++i) {
+        uint64_t idx = component_idx(dst, src->name[i]);
+        edge->remap[i] = (idx == UINT64_MAX) ? UINT32_MAX : (uint32_t) idx;
+    }
+
+    return edge;
+}
+
+// Move entity to archetype with one component added/removed.
+// Entity must have chunk and result must not be empty.
+static void _move_by_edge(world_instance_t *w,
+                          ct_entity_t0 ent,
+                          uint64_t component_name,
+                          bool add) {
+    uint32_t old_idx = _entity_data_idx(w, ent);
+    ent_chunk_t *old_chunk = _entity_chunk(w, ent);
+
+    archetype_edge_t *edge = _archetype_edge(w, old_chunk->archetype_idx,
+                                             component_name, add);
+
+    archetype_t *src = &w->archetype_pool[old_chunk->archetype_idx];
+    archetype_t *dst = &w->archetype_pool[edge->archetype_idx];
+
+    if (src == dst) {
+        return;
+    }
+
+    _add_to_archetype_storage(w, ent, dst, NULL);
+
+    uint32_t new_idx = _entity_data_idx(w, ent);
+    ent_chunk_t *new_chunk = _entity_chunk(w, ent);
+
+    for (uint32_t i = 0; i < src->component_n; ++i) {
+        uint32_t to = edge->remap[i];
+        uint32_t size = src->size[i];
+
+        if ((to == UINT32_MAX) || !size) {
+            continue;
+        }
+
+        void *old_data = _get_component_array(src, old_chunk, i);
+        void *new_data = _get_component_array(dst, new_chunk, to);
+
+        memcpy(new_data + (new_idx * size),
+               old_data + (old_idx * size),
+               size);
+    }
+
+    _remove_from_archetype(w, ent, old_idx, old_chunk, old_chunk->archetype_mask);
+}
+
+// Move entity to chunk with new shared value, same archetype.
+static void _set_shared(world_instance_t *w,
+                        ct_entity_t0 ent,
+                        uint64_t component_name,
+                        const void *value) {
+    ent_chunk_t *old_chunk = _entity_chunk(w, ent);
+
+    if (!old_chunk) {
+        return;
+    }
+
+    archetype_t *storage = &w->archetype_pool[old_chunk->archetype_idx];
+
+    uint64_t comp_idx = component_idx(storage, component_name);
+    if (comp_idx == UINT64_MAX) {
+        return;
+    }
+
+    uint32_t shared_offset = storage->shared_offset[comp_idx];
+    if (!shared_offset) {
+        return;
+    }
+
+    uint32_t size = get_interface(component_name)->size;
+    if (!memcmp(((uint8_t *) old_chunk) + shared_offset, value, size)) {
+        return;
+    }
+
+    uint8_t *shared = _build_shared(w, storage, old_chunk);
+    memcpy(shared + (shared_offset - storage->shared_begin), value, size);
+
+    uint32_t old_idx = _entity_data_idx(w, ent);
+
+    _add_to_archetype_storage(w, ent, storage, shared);
+
+    uint32_t new_idx = _entity_data_idx(w, ent);
+    ent_chunk_t *new_chunk = _entity_chunk(w, ent);
+
+    for (uint32_t i = 0; i < storage->component_n; ++i) {
+        uint32_t comp_size = storage->size[i];
+
+        if (!comp_size) {
+            continue;
+        }
+
+        uint8_t *old_data = _get_component_array(storage, old_chunk, i);
+        uint8_t *new_data = _get_component_array(storage, new_chunk, i);
+
+        memcpy(new_data + (new_idx * comp_size),
+               old_data + (old_idx * comp_size),
+               comp_size);
+    }
+
+    if (storage->event_change[comp_idx]) {
+        _event_set(w, storage, new_chunk, new_idx, 1, storage->event_change[comp_idx]);
+    }
+
+    _remove_from_archetype(w, ent, old_idx, old_chunk, old_chunk->archetype_mask);
+}
+
+// Write component value, shared components move entity to other chunk.
+static void _write_component(world_instance_t *w,
+                             ct_entity_t0 ent,
+                             uint64_t component_name,
+                             const void *data) {
+    ct_ecs_component_i0 *ci = get_interface(component_name);
+
+    if (!ci || !ci->size) {
+        return;
+    }
+
+    if (ci->is_shared) {
+        _set_shared(w, ent, component_name, data);
+        return;
+    }
+
+    uint8_t *comp_data = get_one(w->world, component_name, ent, true);
+    if (comp_data) {
+        memcpy(comp_data, data, ci->size);
+    }
+}
+
+// Component value from cdb obj.
+static void _component_from_obj(world_instance_t *w,
+                                ce_cdb_t0 db,
+                                ct_entity_t0 ent,
+                                uint64_t component_name,
+                                uint64_t obj) {
+    ct_ecs_component_i0 *ci = get_interface(component_name);
+
+    if (!ci || !ci->from_cdb_obj || !ci->size) {
+        return;
+    }
+
+    if (!ci->is_shared) {
+        uint8_t *comp_data = get_one(w->world, component_name, ent, true);
+        if (comp_data) {
+            ci->from_cdb_obj(w->world, db, obj, comp_data);
+        }
+        return;
+    }
+
+    const uint8_t *shared = get_one(w->world, component_name, ent, false);
+    if (!shared) {
+        return;
+    }
+
+    uint8_t value[ci->size];
+    memcpy(value, shared, ci->size);
+    ci->from_cdb_obj(w->world, db, obj, value);
+
+    _set_shared(w, ent, component_name, value);
+}
+
+static void _move_data_from_archetype(world_instance_t *w,
+                                      struct ct_entity_t0 ent,
+                                      ent_chunk_t *old_chunk,
+                                      uint32_t old_idx,
+                                      ct_archemask_t0 ent_type,
+                                      ct_archemask_t0 new_type) {
+
+    archetype_t *old_storage = _get_archetype(w, ent_type);
+    archetype_t *new_storage = _get_archetype(w, new_type);
+
+    if (old_storage == new_storage) {
+        return;
+    }
+
+    uint32_t idx = _entity_data_idx(w, ent);
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+
+    for (int i = 0; i < old_storage->component_n; ++i) {
+        uint64_t component_name = old_storage->name[i];
+
+        if (!_mask_has(ent_type, component_name)) {
+            continue;
+        }
+
+        if (!_mask_has(new_type, component_name)) {
+            continue;
+        }
+
+        uint32_t size = old_storage->size[i];
+        if (!size) {
+            continue;
+        }
+
+        void *old_data = _get_component_array(old_storage, old_chunk, i);
+
+        uint64_t comp_idx = component_idx(new_storage, component_name);
+        void *new_data = _get_component_array(new_storage, chunk, comp_idx);
+
+        CE_ASSERT(LOG_WHERE, old_data != new_data);
+
+        memcpy(new_data + (idx * size),
+               old_data + (old_idx * size),
+               size);
+    }
+}
+
+void _add_components_to_archetype(ct_world_t0 world,
+                                  struct ct_entity_t0 ent,
+                                  ct_archemask_t0 new_type) {
+    world_instance_t *w = get_world_instance(world);
+
+    uint32_t idx = _entity_data_idx(w, ent);
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+
+    if (chunk) {
+        if (_archetype_eq(chunk->archetype_mask, new_type)) {
+            return;
+        }
+        new_type = _archetype_add(new_type, chunk->archetype_mask);
+    }
+
+
+    _add_to_archetype(w, ent, new_type);
+
+    if (chunk && !_archetype_empty(chunk->archetype_mask)) {
+        _move_data_from_archetype(w, ent, chunk, idx, chunk->archetype_mask, new_type);
+        _remove_from_archetype(w, ent, idx, chunk, chunk->archetype_mask);
+    }
+}
+
+static void _add_one_component(world_instance_t *w,
+                               ct_entity_t0 ent,
+                               uint64_t component_name) {
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+
+    if (!chunk || _archetype_empty(chunk->archetype_mask)) {
+        _add_to_archetype(w, ent, combine_component(&component_name, 1));
+        return;
+    }
+
+    if (_mask_has(chunk->archetype_mask, component_name)) {
+        return;
+    }
+
+    _move_by_edge(w, ent, component_name, true);
+}
+
+///
+
+#define ADD_COMPONENT_CMD \
+    CE_ID64_0("add_component", 0xd0363f18e7a5b7e2ULL)
+
+#define REMOVE_COMPONENT_CMD \
+    CE_ID64_0("remove_component", 0x1845aca1baf10397ULL)
+
+#define CMD_WORDS(size) (((size) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+
+static uint64_t _cmd_seq(cmd_buffer_t *buffer) {
+    return atomic_fetch_add_explicit(&buffer->seq, 1, memory_order_relaxed);
+}
+
+static void *_cmd_alloc(cmd_buffer_t *buffer,
+                        uint32_t word_n) {
+    uint32_t worker_id = ce_task_a0->worker_id();
+    uint64_t **arena = &buffer->arena[worker_id];
+
+    uint32_t offset = ce_array_size(*arena);
+    ce_array_resize(*arena, offset + word_n, _G.allocator);
+
+    return *arena + offset;
+}
+
+static cmd_buffer_t *_new_cmd_buff(world_instance_t *w) {
+    if (ce_array_empty(w->cmd_buf_free)) {
+        cmd_buffer_t *buffer = CE_ALLOC(_G.allocator, cmd_buffer_t, sizeof(cmd_buffer_t));
+        *buffer = (cmd_buffer_t) {};
+
+        ce_array_push(w->cmd_buf_pool, buffer, _G.allocator);
+        return buffer;
+    }
+
+    cmd_buffer_t *buffer = ce_array_back(w->cmd_buf_free);
+    ce_array_pop_back(w->cmd_buf_free);
+    return buffer;
+}
+
+static void _free_cmd_buff(world_instance_t *w,
+                           cmd_buffer_t *buffer) {
+    for (uint32_t i = 0; i < TASK_MAX_WORKERS; ++i) {
+        ce_array_clean(buffer->arena[i]);
+    }
+
+    atomic_store_explicit(&buffer->seq, 0, memory_order_relaxed);
+    ce_array_push(w->cmd_buf_free, buffer, _G.allocator);
+}
+
+static void *virtual_alloc(uint64_t size) {
+    return CE_REALLOC(ce_memory_a0->virt_system, void, NULL, size, 0);
+}
+
+//static void virtual_free(void* ptr, uint64_t size) {
 //    munmap(ptr, size);
 //}
 
-static void _init_spawn_infos(spawn_infos_t *infos) {
-    infos->obj_spawninfo_pool = virtual_alloc(sizeof(spawn_info_t) * MAX_ENTITIES);
-    ce_mpmc_init(&infos->obj_spawninfo_free, 4096, sizeof(uint64_t), _G.allocator);
+static void _init_spawn_infos(spawn_infos_t *infos) {
+    infos->obj_spawninfo_pool = virtual_alloc(sizeof(spawn_info_t) * MAX_ENTITIES);
+    ce_mpmc_init(&infos->obj_spawninfo_free, 4096, sizeof(uint64_t), _G.allocator);
+}
+
+static void _add_spawn_obj(ce_cdb_t0 db,
+                           spawn_infos_t *infos,
+                           uint64_t obj,
+                           struct ct_entity_t0 ent) {
+    CE_ASSERT("ecs", ent.h != 0);
+
+    uint64_t idx = ce_hash_lookup(&infos->obj_entmap, obj, UINT64_MAX);
+
+    if (idx == UINT64_MAX) {
+        ce_hash_add(&infos->obj_entmap, obj, ent.h, _G.allocator);
+    }
+
+    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
+    if (spawninfo_idx == UINT64_MAX) {
+        if (!ce_mpmc_dequeue(&infos->obj_spawninfo_free, &spawninfo_idx)) {
+            spawninfo_idx = atomic_fetch_add(&infos->obj_spawninfo_pool_n, 1);
+            infos->obj_spawninfo_pool[spawninfo_idx] = (spawn_info_t) {};
+        }
+
+        ce_hash_add(&infos->obj_spawninfo_map, obj, spawninfo_idx, _G.allocator);
+    }
+
+    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
+    spawn_info->ent_obj = obj;
+
+    ce_array_push(spawn_info->ents, ent, _G.allocator);
+}
+
+static void _add_ent_spawn_obj(ce_cdb_t0 db,
+                               world_instance_t *world,
+                               uint64_t obj,
+                               struct ct_entity_t0 ent) {
+    _add_spawn_obj(db, &world->obj_spawninfo, obj, ent);
+}
+
+static void _add_comp_spawn_obj(ce_cdb_t0 db,
+                                world_instance_t *world,
+                                uint64_t obj,
+                                struct ct_entity_t0 ent) {
+    _add_spawn_obj(db, &world->comp_spawninfo, obj, ent);
+}
+
+static spawn_info_t *_get_spawninfo(spawn_infos_t *infos,
+                                    uint64_t obj) {
+    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
+    if (UINT64_MAX == spawninfo_idx) {
+        return NULL;
+    }
+
+    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
+    return spawn_info;
+}
+
+void _free_spawninfo(spawn_infos_t *infos,
+                     uint64_t obj) {
+    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
+    if (UINT64_MAX == spawninfo_idx) {
+        return;
+    }
+
+    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
+    ce_array_clean(spawn_info->ents);
+    ce_mpmc_enqueue(&infos->obj_spawninfo_free, &spawninfo_idx);
+}
+
+void _free_spawninfo_ent(spawn_infos_t *infos,
+                         uint64_t obj,
+                         ct_entity_t0 ent) {
+    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
+    if (UINT64_MAX == spawninfo_idx) {
+        return;
+    }
+
+    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
+
+    uint32_t ent_n = ce_array_size(spawn_info->ents);
+    for (int i = 0; i < ent_n; ++i) {
+        if (spawn_info->ents[i].h == ent.h) {
+            spawn_info->ents[i] = spawn_info->ents[ent_n - 1];
+            ce_array_pop_back(spawn_info->ents);
+            return;
+        }
+    }
+}
+
+static void *get_all(ct_world_t0 world,
+                     uint64_t component_name,
+                     ct_ecs_ent_chunk_o0 *_item) {
+    query_item_t *item = (query_item_t *) _item;
+    ent_chunk_t *chunk = item->chunk;
+
+    world_instance_t *w = get_world_instance(world);
+    archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
+
+    uint64_t comp_idx = component_idx(storage, component_name);
+
+    uint8_t *data = _get_component_array(storage, chunk, comp_idx);
+    if (!data) {
+        return NULL;
+    }
+
+    return data + (storage->size[comp_idx] * item->first);
+}
+
+static const void *get_shared(ct_world_t0 world,
+                              uint64_t component_name,
+                              ct_ecs_ent_chunk_o0 *_item) {
+    ent_chunk_t *chunk = ((query_item_t *) _item)->chunk;
+
+    world_instance_t *w = get_world_instance(world);
+    archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
+
+    uint64_t comp_idx = component_idx(storage, component_name);
+
+    if ((comp_idx == UINT64_MAX) || !storage->shared_offset[comp_idx]) {
+        return NULL;
+    }
+
+    return ((uint8_t *) chunk) + storage->shared_offset[comp_idx];
+}
+
+static void set_shared(ct_world_t0 world,
+                       ct_entity_t0 ent,
+                       uint64_t component_name,
+                       const void *value) {
+    _set_shared(get_world_instance(world), ent, component_name, value);
+}
+
+static bool has(ct_world_t0 world,
+                struct ct_entity_t0 ent,
+                uint64_t *component_name,
+                uint32_t name_count) {
+    world_instance_t *w = get_world_instance(world);
+
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+
+    if (!chunk) {
+        return false;
+    }
+
+    ct_archemask_t0 ent_type = chunk->archetype_mask;
+    ct_archemask_t0 mask = combine_component(component_name, name_count);
+
+    return _archetype_all(ent_type, mask);
+}
+
+
+static ct_archemask_t0 combine_component_obj(ce_cdb_t0 db,
+                                             const uint64_t *component_obj,
+                                             uint32_t name_count) {
+    ct_archemask_t0 new_type = {};
+    for (int i = 0; i < name_count; ++i) {
+        uint64_t type = ce_cdb_a0->obj_type(db, component_obj[i]);
+        _mask_set(&new_type, type);
+    }
+
+    return new_type;
+}
+
+static void add_components(ct_world_t0 world,
+                           struct ct_entity_t0 ent,
+                           const ct_component_pair_t0 *components,
+                           uint32_t components_count) {
+    uint64_t types[components_count];
+    for (int i = 0; i < components_count; ++i) {
+        types[i] = components[i].type;
+    }
+
+    world_instance_t *w = get_world_instance(world);
+
+    if (components_count == 1) {
+        _add_one_component(w, ent, types[0]);
+    } else {
+        ct_archemask_t0 component_mask = combine_component(types, components_count);
+
+        ent_chunk_t *chunk = _entity_chunk(w, ent);
+        if (chunk) {
+            component_mask = _archetype_add(chunk->archetype_mask, component_mask);
+        }
+
+        _add_components_to_archetype(world, ent, component_mask);
+    }
+
+    for (int i = 0; i < components_count; ++i) {
+        if (components[i].data) {
+            _write_component(w, ent, types[i], components[i].data);
+        }
+    }
+}
+
+static void remove_buff(ct_ecs_cmd_buffer_t *buffer,
+                        ct_world_t0 world,
+                        ct_entity_t0 ent,
+                        const uint64_t *component_name,
+                        uint32_t name_count) {
+    uint32_t word_n = CMD_WORDS(sizeof(cmd_t)) + name_count;
+
+    cmd_t *cmd = _cmd_alloc((cmd_buffer_t *) buffer, word_n);
+    *cmd = (cmd_t) {
+            .type = REMOVE_COMPONENT_CMD,
+            .world = world,
+            .ent = ent,
+            .seq = _cmd_seq((cmd_buffer_t *) buffer),
+            .n = name_count,
+            .word_n = word_n,
+    };
+
+    memcpy(cmd + 1, component_name, sizeof(uint64_t) * name_count);
+}
+
+static void add_buff(ct_ecs_cmd_buffer_t *buffer,
+                     ct_world_t0 world,
+                     ct_entity_t0 ent,
+                     const ct_component_pair_t0 *components,
+                     uint32_t components_count) {
+    uint32_t word_n = CMD_WORDS(sizeof(cmd_t))
+                      + CMD_WORDS(sizeof(cmd_component_t) * components_count);
+
+    uint32_t sizes[components_count];
+    for (int i = 0; i < components_count; ++i) {
+        ct_ecs_component_i0 *ci = get_interface(components[i].type);
+
+        sizes[i] = (ci && components[i].data) ? ci->size : 0;
+        word_n += CMD_WORDS(sizes[i]);
+    }
+
+    uint64_t *words = _cmd_alloc((cmd_buffer_t *) buffer, word_n);
+
+    cmd_t *cmd = (cmd_t *) words;
+    *cmd = (cmd_t) {
+            .type = ADD_COMPONENT_CMD,
+            .world = world,
+            .ent = ent,
+            .seq = _cmd_seq((cmd_buffer_t *) buffer),
+            .n = components_count,
+            .word_n = word_n,
+    };
+
+    cmd_component_t *comps = (cmd_component_t *) (cmd + 1);
+    uint32_t data = CMD_WORDS(sizeof(cmd_t))
+                    + CMD_WORDS(sizeof(cmd_component_t) * components_count);
+
+    for (int i = 0; i < components_count; ++i) {
+        comps[i] = (cmd_component_t) {
+                .type = components[i].type,
+                .size = sizes[i],
+        };
+
+        if (sizes[i]) {
+            comps[i].data = data;
+            memcpy(words + data, components[i].data, sizes[i]);
+            data += CMD_WORDS(sizes[i]);
+        }
+    }
+}
+
+static void _add_components_from_obj(world_instance_t *world,
+                                     ce_cdb_t0 db,
+                                     struct ct_entity_t0 ent,
+                                     uint64_t obj) {
+    uint64_t mew_component = obj;
+    ce_hash_add(&world->component_obj_map, mew_component, mew_component, _G.allocator);
+
+    uint64_t component_type = ce_cdb_a0->obj_type(ce_cdb_a0->db(), obj);
+
+    ct_ecs_component_i0 *ci = get_interface(component_type);
+
+    if (!ci) {
+        return;
+    }
+    _add_one_component(world, ent, component_type);
+
+    _component_from_obj(world, db, ent, component_type, obj);
+
+    _add_comp_spawn_obj(db, world, obj, ent);
+}
+
+static void remove_components(ct_world_t0 world,
+                              struct ct_entity_t0 ent,
+                              const uint64_t *component_name,
+                              uint32_t name_count) {
+    world_instance_t *w = get_world_instance(world);
+
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+
+    if (!chunk) {
+        return;
+    }
+
+    ct_archemask_t0 new_type = chunk->archetype_mask;
+    ct_archemask_t0 comp_type = combine_component(component_name, name_count);
+
+    if (_archetype_none(new_type, comp_type)) {
+        return;
+    }
+
+    new_type = _archetype_remove(new_type, comp_type);
+
+    archetype_t *storage = _get_archetype(w, chunk->archetype_mask);
+
+    if (!storage) {
+        return;
+    }
+
+    uint32_t idx = _entity_data_idx(w, ent);
+
+    if (!_archetype_empty(new_type)) {
+        if (name_count == 1) {
+            _move_by_edge(w, ent, component_name[0], false);
+            return;
+        }
+
+        _add_to_archetype(w, ent, new_type);
+        _move_data_from_archetype(w, ent, chunk, idx, chunk->archetype_mask, new_type);
+    }
+
+    _remove_from_archetype(w, ent, idx, chunk, chunk->archetype_mask);
+
+    if (_archetype_empty(new_type)) {
+        _entity_chunk(w, ent) = NULL;
+
+        if (storage->has_system_state) {
+            ce_handler_destroy(&w->entity_handler, ent.h, _G.allocator);
+        }
+    }
+}
+
+
+// True if mask has exactly one component, its name is returned in name.
+static bool _archetype_single(ct_archemask_t0 mask,
+                              uint64_t *name) {
+    uint32_t idx = UINT32_MAX;
+
+    for (uint32_t i = 0; i < CT_ECS_MASK_WORDS; ++i) {
+        if (!mask.mask[i]) {
+            continue;
+        }
+
+        if ((idx != UINT32_MAX) || (mask.mask[i] & (mask.mask[i] - 1))) {
+            return false;
+        }
+
+        idx = (i * 64) + __builtin_ctzll(mask.mask[i]);
+    }
+
+    if (idx == UINT32_MAX) {
+        return false;
+    }
+
+    *name = _G.components_name[idx];
+    return true;
+}
+
+// Move entity to new_type in one step, components in both types keep data.
+static void _move_to_archetype(world_instance_t *w,
+                               ct_entity_t0 ent,
+                               ct_archemask_t0 new_type) {
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+
+    if (!chunk) {
+        if (!_archetype_empty(new_type)) {
+            _add_to_archetype(w, ent, new_type);
+        }
+        return;
+    }
+
+    ct_archemask_t0 old_type = chunk->archetype_mask;
+    if (_archetype_eq(old_type, new_type)) {
+        return;
+    }
+
+    ct_archemask_t0 added = _archetype_remove(new_type, old_type);
+    ct_archemask_t0 removed = _archetype_remove(old_type, new_type);
+
+    uint64_t name;
+    if (_archetype_empty(removed) && _archetype_single(added, &name)) {
+        _move_by_edge(w, ent, name, true);
+        return;
+    }
+
+    if (_archetype_empty(added) && !_archetype_empty(new_type)
+        && _archetype_single(removed, &name)) {
+        _move_by_edge(w, ent, name, false);
+        return;
+    }
+
+    bool has_system_state = w->archetype_pool[chunk->archetype_idx].has_system_state;
+    uint32_t idx = _entity_data_idx(w, ent);
+
+    if (!_archetype_empty(new_type)) {
+        _add_to_archetype(w, ent, new_type);
+        _move_data_from_archetype(w, ent, chunk, idx, old_type, new_type);
+    }
+
+    _remove_from_archetype(w, ent, idx, chunk, old_type);
+
+    if (_archetype_empty(new_type)) {
+        _entity_chunk(w, ent) = NULL;
+
+        if (has_system_state) {
+            ce_handler_destroy(&w->entity_handler, ent.h, _G.allocator);
+        }
+    }
+}
+
+static cmd_merge_t *_get_cmd_merge(world_instance_t *w,
+                                   ct_world_t0 world,
+                                   ct_entity_t0 ent) {
+    struct {
+        ct_world_t0 world;
+        ct_entity_t0 ent;
+    } key_data = {world, ent};
+
+    uint64_t key = ce_hash_murmur2_64(&key_data, sizeof(key_data), 0);
+    uint64_t idx = ce_hash_lookup(&w->cmd_merge_map, key, UINT64_MAX);
+
+    if (idx == UINT64_MAX) {
+        idx = ce_array_size(w->cmd_merge);
+        ce_array_push(w->cmd_merge, ((cmd_merge_t) {
+                .world = world,
+                .ent = ent,
+                .data = UINT32_MAX,
+        }), _G.allocator);
+
+        ce_hash_add(&w->cmd_merge_map, key, idx, _G.allocator);
+    }
+
+    return &w->cmd_merge[idx];
+}
+
+static void _add_cmd_merge_data(world_instance_t *w,
+                                cmd_merge_t *merge,
+                                uint64_t type,
+                                const void *data) {
+    uint32_t idx = ce_array_size(w->cmd_merge_data);
+    ce_array_push(w->cmd_merge_data, ((cmd_merge_data_t) {
+            .type = type,
+            .data = data,
+            .next = merge->data,
+    }), _G.allocator);
+
+    merge->data = idx;
+}
+
+static void _merge_cmd(world_instance_t *w,
+                       const cmd_t *cmd) {
+    cmd_merge_t *merge = _get_cmd_merge(w, cmd->world, cmd->ent);
+
+    if (cmd->type == ADD_COMPONENT_CMD) {
+        const cmd_component_t *comps = (const cmd_component_t *) (cmd + 1);
+
+        for (uint32_t i = 0; i < cmd->n; ++i) {
+            ct_archemask_t0 comp_type = combine_component(&comps[i].type, 1);
+            merge->add = _archetype_add(merge->add, comp_type);
+            merge->remove = _archetype_remove(merge->remove, comp_type);
+
+            if (comps[i].data) {
+                _add_cmd_merge_data(w, merge, comps[i].type,
+                                    ((const uint64_t *) cmd) + comps[i].data);
+            }
+        }
+    } else if (cmd->type == REMOVE_COMPONENT_CMD) {
+        const uint64_t *names = (const uint64_t *) (cmd + 1);
+
+        ct_archemask_t0 comp_type = combine_component(names, cmd->n);
+        merge->remove = _archetype_add(merge->remove, comp_type);
+        merge->removed = _archetype_add(merge->removed, comp_type);
+        merge->add = _archetype_remove(merge->add, comp_type);
+
+        for (uint32_t i = 0; i < cmd->n; ++i) {
+            _add_cmd_merge_data(w, merge, names[i], NULL);
+        }
+    }
+}
+
+static void _apply_cmd_merge(world_instance_t *scratch,
+                             const cmd_merge_t *merge) {
+    world_instance_t *w = get_world_instance(merge->world);
+    ct_entity_t0 ent = merge->ent;
+
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+    ct_archemask_t0 old_type = chunk ? chunk->archetype_mask : (ct_archemask_t0) {};
+
+    ct_archemask_t0 new_type = _archetype_remove(old_type, merge->remove);
+    new_type = _archetype_add(new_type, merge->add);
+
+    _move_to_archetype(w, ent, new_type);
+
+    // Removed and added back in same buffer, stays in archetype but data is reset.
+    ct_archemask_t0 reset = _archetype_and(_archetype_and(old_type, new_type),
+                                           merge->removed);
+    if (!_archetype_empty(reset)) {
+        archetype_t *storage = &w->archetype_pool[_entity_chunk(w, ent)->archetype_idx];
+
+        for (uint32_t i = 0; i < storage->component_n; ++i) {
+            uint64_t name = storage->name[i];
+            if (!_mask_has(reset, name)) {
+                continue;
+            }
+
+            if (storage->shared_offset[i]) {
+                uint32_t size = get_interface(name)->size;
+                uint8_t zero[size];
+                memset(zero, 0, size);
+                _set_shared(w, ent, name, zero);
+
+                // Chunk changed, storage is same.
+                continue;
+            }
+
+            if (!storage->size[i]) {
+                continue;
+            }
+
+            void *data = get_one(merge->world, name, ent, true);
+            memset(data, 0, storage->size[i]);
+        }
+    }
+
+    // Newest data wins
+    ct_archemask_t0 done = {};
+    uint32_t data_idx = merge->data;
+    while (data_idx != UINT32_MAX) {
+        const cmd_merge_data_t *data = &scratch->cmd_merge_data[data_idx];
+        data_idx = data->next;
+
+        if (_mask_has(done, data->type)) {
+            continue;
+        }
+        _mask_set(&done, data->type);
+
+        if (!data->data) {
+            continue;
+        }
+
+        _write_component(w, ent, data->type, data->data);
+    }
+}
+
+static int _cmp_cmd_seq(const void *a,
+                        const void *b) {
+    const cmd_t *c1 = *(const cmd_t **) a;
+    const cmd_t *c2 = *(const cmd_t **) b;
+
+    return (c1->seq > c2->seq) - (c1->seq < c2->seq);
+}
+
+// Commands for same entity are merged to one archetype move.
+// Merge scratch is in stepped world w.
+static void _execute_cmd(world_instance_t *w,
+                         cmd_buffer_t *buffer) {
+    // Play in issue order across arenas, last issued command for entity wins
+    // independent of worker that issued it.
+    for (uint32_t i = 0; i < TASK_MAX_WORKERS; ++i) {
+        const uint64_t *arena = buffer->arena[i];
+        const uint32_t word_n = ce_array_size(arena);
+
+        uint32_t offset = 0;
+        while (offset < word_n) {
+            const cmd_t *cmd = (const cmd_t *) (arena + offset);
+            ce_array_push(w->cmd_order, cmd, _G.allocator);
+            offset += cmd->word_n;
+        }
+    }
+
+    const uint32_t cmd_n = ce_array_size(w->cmd_order);
+    qsort(w->cmd_order, cmd_n, sizeof(const cmd_t *), _cmp_cmd_seq);
+
+    for (uint32_t i = 0; i < cmd_n; ++i) {
+        _merge_cmd(w, w->cmd_order[i]);
+    }
+
+    const uint32_t merge_n = ce_array_size(w->cmd_merge);
+    for (uint32_t i = 0; i < merge_n; ++i) {
+        _apply_cmd_merge(w, &w->cmd_merge[i]);
+    }
+
+    ce_array_clean(w->cmd_order);
+    ce_hash_clean(&w->cmd_merge_map);
+    ce_array_clean(w->cmd_merge);
+    ce_array_clean(w->cmd_merge_data);
+}
+
+typedef struct process_data_t {
+    ct_world_t0 world;
+    query_item_t *items;
+    void *data;
+    ct_ecs_foreach_fce_t fce;
+} process_data_t;
+
+static void _process_range(uint32_t begin,
+                           uint32_t end,
+                           void *data) {
+    process_data_t *pdata = data;
+
+    for (uint32_t i = begin; i < end; ++i) {
+        query_item_t *item = &pdata->items[i];
+
+        pdata->fce(pdata->world, _get_entity_array(item->chunk) + item->first,
+                   (ct_ecs_ent_chunk_o0 *) item, item->n, pdata->data);
+    }
+}
+
+static bool chunk_changed(uint32_t version,
+                          uint32_t rq_version) {
+    if (!rq_version) {
+        return true;
+    }
+
+    return (int32_t)(version - rq_version) > 0;
+}
+
+static bool _block_changed(archetype_t *storage,
+                           const query_match_t *match,
+                           ent_chunk_t *chunk,
+                           uint32_t block,
+                           uint32_t rq_version) {
+    const uint32_t read_n = ce_array_size(match->read);
+    for (uint32_t j = 0; j < read_n; ++j) {
+        uint32_t *version = _block_version(storage, chunk, match->read[j]);
+        if (chunk_changed(version[block], rq_version)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Write components are changed for event queries, except query itself.
+static void _push_item(world_instance_t *w,
+                       query_item_t **items,
+                       archetype_t *storage,
+                       const query_match_t *match,
+                       ent_chunk_t *chunk,
+                       uint32_t first,
+                       uint32_t n,
+                       uint32_t rq_version,
+                       uint64_t event_self) {
+    // Update version for write component.
+    const uint32_t write_n = ce_array_size(match->write);
+    for (uint32_t j = 0; j < write_n; ++j) {
+        _stamp_version(storage, chunk, match->write[j], first, n, rq_version);
+
+        uint64_t queries = storage->event_change[match->write[j]] & ~event_self;
+        if (queries) {
+            _event_set(w, storage, chunk, first, n, queries);
+        }
+    }
+
+    query_item_t item = {.chunk = chunk, .first = first, .n = n};
+    ce_array_push(*items, item, _G.allocator);
+}
+
+// Push chunk ranges to process, only_changed push changed blocks merged to ranges.
+static void _collect_chunk_items(world_instance_t *w,
+                                 query_item_t **items,
+                                 archetype_t *storage,
+                                 const query_match_t *match,
+                                 ent_chunk_t *chunk,
+                                 const ct_ecs_query_t0 *query,
+                                 uint32_t rq_version) {
+    if (!chunk->ent_n) {
+        return;
+    }
+
+    if (!query->only_changed || !rq_version) {
+        _push_item(w, items, storage, match, chunk, 0, chunk->ent_n, rq_version, 0);
+        return;
+    }
+
+    bool chunk_comp_changed = false;
+
+    const uint32_t read_n = ce_array_size(match->read);
+    for (uint32_t j = 0; j < read_n; ++j) {
+        chunk_comp_changed |= chunk_changed(chunk->version[match->read[j]],
+                                            rq_version);
+    }
+
+    if (!chunk_comp_changed) {
+        return;
+    }
+
+    const uint32_t block_n = (chunk->ent_n + CHUNK_BLOCK_SIZE - 1) / CHUNK_BLOCK_SIZE;
+
+    uint32_t range_begin = UINT32_MAX;
+    for (uint32_t b = 0; b <= block_n; ++b) {
+        bool changed = (b < block_n) && _block_changed(storage, match, chunk, b, rq_version);
+
+        if (changed) {
+            if (range_begin == UINT32_MAX) {
+                range_begin = b;
+            }
+            continue;
+        }
+
+        if (range_begin == UINT32_MAX) {
+            continue;
+        }
+
+        uint32_t first = range_begin * CHUNK_BLOCK_SIZE;
+        uint32_t last = b * CHUNK_BLOCK_SIZE;
+        if (last > chunk->ent_n) {
+            last = chunk->ent_n;
+        }
+
+        _push_item(w, items, storage, match, chunk, first, last - first, rq_version, 0);
+        range_begin = UINT32_MAX;
+    }
+}
+
+static int _cmp_query_item(const void *a,
+                           const void *b) {
+    const query_item_t *i1 = a;
+    const query_item_t *i2 = b;
+
+    if (i1->group != i2->group) {
+        return i1->group < i2->group ? -1 : 1;
+    }
+
+    if (i1->chunk != i2->chunk) {
+        return i1->chunk < i2->chunk ? -1 : 1;
+    }
+
+    return i1->first < i2->first ? -1 : (i1->first > i2->first);
+}
+
+static void _group_query_items(archetype_t *storage,
+                               query_item_t *items,
+                               uint32_t n,
+                               uint64_t group_by) {
+    uint64_t comp_idx = component_idx(storage, group_by);
+
+    if ((comp_idx == UINT64_MAX) || !storage->shared_offset[comp_idx]) {
+        return;
+    }
+
+    uint32_t offset = storage->shared_offset[comp_idx];
+    uint32_t size = get_interface(group_by)->size;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        items[i].group = ce_hash_murmur2_64(((uint8_t *) items[i].chunk) + offset, size, 0);
+    }
+}
+
+static const query_match_t *_query_archetype_match(query_cache_t *cache,
+                                                   uint32_t archetype_idx) {
+    const uint32_t match_n = ce_array_size(cache->matches);
+    for (uint32_t i = 0; i < match_n; ++i) {
+        if (cache->matches[i].archetype_idx == archetype_idx) {
+            return &cache->matches[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Push runs of entities with event from chunks with pending events, events are cleared.
+static void _collect_event_items(world_instance_t *w,
+                                 query_cache_t *cache,
+                                 const ct_ecs_query_t0 *query,
+                                 uint32_t rq_version,
+                                 query_item_t **items) {
+    const uint32_t query_idx = cache->event_idx - 1;
+    const uint64_t query_bit = 1ULL << query_idx;
+
+    uint32_t worker_id = ce_task_a0->worker_id();
+    query_scratch_t *scratch = &_G.query_scratch[worker_id];
+    ce_array_clean(scratch->event_chunks);
+
+    ce_os_thread_a0->spin_lock(&w->event_lock);
+    uint32_t pending_n = ce_array_size(cache->event_chunks);
+    if (pending_n) {
+        ce_array_push_n(scratch->event_chunks, cache->event_chunks, pending_n, _G.allocator);
+        ce_array_clean(cache->event_chunks);
+    }
+    ce_os_thread_a0->spin_unlock(&w->event_lock);
+
+    const uint32_t chunk_n = ce_array_size(scratch->event_chunks);
+    for (uint32_t i = 0; i < chunk_n; ++i) {
+        ent_chunk_t *chunk = scratch->event_chunks[i];
+
+        if (!(atomic_fetch_and(&chunk->event_mask, ~query_bit) & query_bit)) {
+            continue;
+        }
+
+        archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
+        const query_match_t *match = _query_archetype_match(cache, chunk->archetype_idx);
+        event_bits_t bits = _event_query_bits(chunk, query_idx);
+
+        uint32_t begin = ce_array_size(*items);
+        uint32_t run_first = 0;
+        uint32_t run_n = 0;
+
+        for (uint32_t b = 0; b < storage->block_n; ++b) {
+            uint64_t word = atomic_exchange(&bits[b], 0);
+
+            while (word && match) {
+                uint32_t bit = __builtin_ctzll(word);
+                uint32_t len = 64 - bit;
+                uint64_t rest = ~(word >> bit);
+                if (rest) {
+                    len = __builtin_ctzll(rest);
+                }
+
+                word &= (len == 64) ? 0 : ~(((1ULL << len) - 1) << bit);
+
+                uint32_t first = (b * 64) + bit;
+                if (run_n && ((run_first + run_n) == first)) {
+                    run_n += len;
+                    continue;
+                }
+
+                if (run_n) {
+                    _push_item(w, items, storage, match, chunk, run_first, run_n,
+                               rq_version, query_bit);
+                }
+
+                run_first = first;
+                run_n = len;
+            }
+        }
+
+        if (run_n) {
+            _push_item(w, items, storage, match, chunk, run_first, run_n,
+                       rq_version, query_bit);
+        }
+
+        if (query->group_by) {
+            _group_query_items(storage, *items + begin,
+                               ce_array_size(*items) - begin, query->group_by);
+        }
+    }
+}
+
+static void _collect_query_items(world_instance_t *w,
+                                 query_cache_t *cache,
+                                 const ct_ecs_query_t0 *query,
+                                 uint32_t rq_version,
+                                 query_item_t **items) {
+    ce_array_clean(*items);
+
+    if (cache->event_overflow) {
+        return;
+    }
+
+    if (cache->event_idx) {
+        _collect_event_items(w, cache, query, rq_version, items);
+
+        if (query->group_by) {
+            qsort(*items, ce_array_size(*items), sizeof(query_item_t), _cmp_query_item);
+        }
+        return;
+    }
+
+    const uint32_t match_n = ce_array_size(cache->matches);
+    for (uint32_t i = 0; i < match_n; ++i) {
+        const query_match_t *match = &cache->matches[i];
+        archetype_t *storage = &w->archetype_pool[match->archetype_idx];
+
+        uint32_t begin = ce_array_size(*items);
+
+        ent_chunk_t *chunk = storage->first;
+        while (chunk) {
+            _collect_chunk_items(w, items, storage, match, chunk, query, rq_version);
+            chunk = chunk->next;
+        }
+
+        if (query->group_by) {
+            _group_query_items(storage, *items + begin,
+                               ce_array_size(*items) - begin, query->group_by);
+        }
+    }
+
+    // Same shared values are processed in sequence.
+    if (query->group_by) {
+        qsort(*items, ce_array_size(*items), sizeof(query_item_t), _cmp_query_item);
+    }
+}
+
+static query_item_t *_take_query_buffer() {
+    uint32_t worker_id = ce_task_a0->worker_id();
+    query_scratch_t *scratch = &_G.query_scratch[worker_id];
+
+    if (!ce_array_any(scratch->free_buffers)) {
+        return NULL;
+    }
+
+    query_item_t *items = ce_array_back(scratch->free_buffers);
+    ce_array_pop_back(scratch->free_buffers);
+    return items;
+}
+
+// Worker id is read again, query can end on other worker.
+static void _give_query_buffer(query_item_t *items) {
+    uint32_t worker_id = ce_task_a0->worker_id();
+    query_scratch_t *scratch = &_G.query_scratch[worker_id];
+    ce_array_push(scratch->free_buffers, items, _G.allocator);
+}
+
+static void process_query(ct_world_t0 world,
+                          ct_ecs_query_t0 query,
+                          uint32_t rq_version,
+                          ct_ecs_foreach_fce_t fce,
+                          void *data) {
+    world_instance_t *w = get_world_instance(world);
+    query_cache_t *cache = _get_query_cache(w, &query);
+
+    query_item_t *items = _take_query_buffer();
+    _collect_query_items(w, cache, &query, rq_version, &items);
+
+    process_data_t pdata = {
+            .world = world,
+            .items = items,
+            .data = data,
+            .fce = fce,
+    };
+
+    // Wait can continue on other worker, system run there now.
+    uint64_t system = _current_system();
+
+    ce_task_a0->parallel_for(0, ce_array_size(items), 0,
+                             _process_range, &pdata);
+
+    _set_current_system(system);
+
+    _give_query_buffer(items);
+}
+
+
+static void process_query_serial(ct_world_t0 world,
+                                 ct_ecs_query_t0 query,
+                                 uint32_t rq_version,
+                                 ct_ecs_foreach_fce_t fce,
+                                 void *data) {
+    world_instance_t *w = get_world_instance(world);
+    query_cache_t *cache = _get_query_cache(w, &query);
+
+    query_item_t *items = _take_query_buffer();
+    _collect_query_items(w, cache, &query, rq_version, &items);
+
+    process_data_t pdata = {
+            .world = world,
+            .items = items,
+            .data = data,
+            .fce = fce,
+    };
+
+    _process_range(0, ce_array_size(items), &pdata);
+
+    _give_query_buffer(items);
+}
+
+uint64_t _get_component_obj(world_instance_t *world,
+                            uint64_t obj) {
+    if (ce_hash_lookup(&world->component_obj_map, obj, 0)) {
+        return obj;
+    }
+
+    uint64_t parent = ce_cdb_a0->parent(ce_cdb_a0->db(), obj);
+    if (!parent) {
+        return 0;
+    }
+
+    return _get_component_obj(world, parent);
+}
+
+spawn_info_t *_get_component_spawninfo(world_instance_t *world,
+                                       uint64_t obj) {
+    spawn_info_t *si = _get_spawninfo(&world->comp_spawninfo, obj);
+
+    if (si) {
+        return si;
+    }
+
+    uint64_t parent = ce_cdb_a0->parent(ce_cdb_a0->db(), obj);
+    if (!parent) {
+        return 0;
+    }
+
+    return _get_component_spawninfo(world, parent);
+}
+
+static void _build_graphs() {
+    ce_hash_clean(&_G.system_map);
+    ce_hash_clean(&_G.system_access_map);
+    ce_array_clean(_G.system_access);
+    ce_hash_clean(&_G.system_group_map);
+    ce_hash_clean(&_G.system_group_g_map);
+
+    uint64_t *graphs = NULL;
+
+    ce_api_entry_t0 it = ce_api_a0->first(CT_ECS_SYSTEM_GROUP_I);
+    while (it.api) {
+        ct_system_group_i0 *i = (it.api);
+
+        uint64_t name = i->name;
+
+        ce_hash_add(&_G.system_group_map, name, (uint64_t) i, _G.allocator);
+
+        uint64_t graph_idx = ce_hash_lookup(&_G.system_group_g_map, name, UINT64_MAX);
+        if (UINT64_MAX == graph_idx) {
+            graph_idx = _new_graph();
+            ce_hash_add(&_G.system_group_g_map, name, graph_idx, _G.allocator);
+            ce_array_push(graphs, graph_idx, _G.allocator);
+        }
+
+        if (i->group) {
+            uint64_t group_graph_idx = ce_hash_lookup(&_G.system_group_g_map, i->group, UINT64_MAX);
+            if (group_graph_idx == UINT64_MAX) {
+                group_graph_idx = _new_graph();
+                ce_hash_add(&_G.system_group_g_map, i->group, group_graph_idx, _G.allocator);
+                ce_array_push(graphs, group_graph_idx, _G.allocator);
+            }
+
+            ce_ba_graph_t *g = &_G.graph_pool[group_graph_idx];
+
+            ce_bag_add(g, name,
+                       i->before.ptr, i->before.len,
+                       i->after.ptr, i->after.len,
+                       _G.allocator);
+        }
+
+        it = ce_api_a0->next(it);
+    }
+
+    it = ce_api_a0->first(CT_ECS_SYSTEM_I);
+    while (it.api) {
+        struct ct_system_i0 *i = (it.api);
+
+        uint64_t name = i->name;
+
+        ce_hash_add(&_G.system_map, name, (uint64_t) i, _G.allocator);
+
+        system_access_t access = {
+                .read = combine_component(i->read.ptr, i->read.len),
+                .write = combine_component(i->write.ptr, i->write.len),
+                .exclusive = !i->read.len && !i->write.len,
+        };
+        ce_hash_add(&_G.system_access_map, name,
+                    ce_array_size(_G.system_access), _G.allocator);
+        ce_array_push(_G.system_access, access, _G.allocator);
+
+        if (!i->group) {
+            i->group = CT_ECS_SIMULATION_GROUP;
+        }
+
+        uint64_t graph_idx = ce_hash_lookup(&_G.system_group_g_map, i->group, UINT64_MAX);
+        if (graph_idx != UINT64_MAX) {
+            ce_ba_graph_t *g = &_G.graph_pool[graph_idx];
+            ce_bag_add(g, name,
+                       i->before.ptr, i->before.len,
+                       i->after.ptr, i->after.len,
+                       _G.allocator);
+        }
+
+
+        it = ce_api_a0->next(it);
+    }
+
+    uint64_t graph_n = ce_array_size(graphs);
+    for (uint64_t j = 0; j < graph_n; ++j) {
+        ce_ba_graph_t *g = &_G.graph_pool[graphs[j]];
+        ce_bag_build(g, _G.allocator);
+    }
+
+    ce_array_free(graphs, _G.allocator);
+}
+
+static bool _system_conflict(const system_access_t *a1,
+                             const system_access_t *a2) {
+    if (a1->exclusive || a2->exclusive) {
+        return true;
+    }
+
+    ct_archemask_t0 a2_all = _archetype_add(a2->read, a2->write);
+    ct_archemask_t0 a1_all = _archetype_add(a1->read, a1->write);
+
+    return _archetype_any(a1->write, a2_all) || _archetype_any(a2->write, a1_all);
+}
+
+// System must run after other (before/after declared in group).
+static bool _system_depend(ce_ba_graph_t *g,
+                           uint64_t system,
+                           uint64_t other) {
+    uint64_t idx = ce_hash_lookup(&g->graph_map, system, UINT64_MAX);
+    if (idx == UINT64_MAX) {
+        return false;
+    }
+
+    const uint64_t *after = g->after[idx];
+    const uint32_t after_n = ce_array_size(after);
+    for (uint32_t i = 0; i < after_n; ++i) {
+        if (after[i] == other) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-static void _add_spawn_obj(ce_cdb_t0 db,
-                           spawn_infos_t *infos,
-                           uint64_t obj,
-                           struct ct_entity_t0 ent) {
-    CE_ASSERT("ecs", ent.h != 0);
+static void _run_system(void *data) {
+    system_run_t *run = data;
 
-    uint64_t idx = ce_hash_lookup(&infos->obj_entmap, obj, UINT64_MAX);
+    if (run->system->process) {
+        uint64_t prev_system = _current_system();
+        _set_current_system(run->system->name);
+
+        run->system->process(run->world, run->dt, run->rq_version,
+                             (ct_ecs_cmd_buffer_t *) run->cmd_buf);
+
+        _set_current_system(prev_system);
+    }
+}
+
+static void _next_system_version(world_instance_t *w) {
+    w->global_system_version++;
+    if (w->global_system_version == 0) {
+        w->global_system_version++;
+    }
+}
+
+static void _begin_wave(world_instance_t *w,
+                        system_run_t *wave,
+                        uint32_t wave_n) {
+    _next_system_version(w);
+
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        wave[i].rq_version = ce_hash_lookup(&w->last_system_version,
+                                            wave[i].system->name, 0);
+    }
+}
+
+static void _end_wave(world_instance_t *w,
+                      system_run_t *wave,
+                      uint32_t wave_n) {
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        ce_hash_add(&w->last_system_version, wave[i].system->name,
+                    w->global_system_version, _G.allocator);
+    }
+
+    _next_system_version(w);
+
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        _execute_cmd(w, wave[i].cmd_buf);
+    }
+}
+
+// Systems in wave share version, they never touch same components.
+// Command buffers are played back after whole wave with next version.
+static void _run_wave(world_instance_t *w,
+                      system_run_t *wave,
+                      uint32_t wave_n) {
+    if (!wave_n) {
+        return;
+    }
+
+    _begin_wave(w, wave, wave_n);
+
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        wave[i].cmd_buf = _new_cmd_buff(w);
+    }
+
+    if (wave_n == 1) {
+        _run_system(&wave[0]);
+    } else {
+        ce_task_item_t0 items[wave_n];
+        for (uint32_t i = 0; i < wave_n; ++i) {
+            items[i] = (ce_task_item_t0) {
+                    .name = "ecs_system",
+                    .work = _run_system,
+                    .data = &wave[i],
+                    .priority = TASK_PRIORITY_CRITICAL,
+            };
+        }
+
+        ce_task_counter_t0 *counter = NULL;
+        ce_task_a0->add(items, wave_n, &counter);
+        ce_task_a0->wait_for_counter(counter, 0);
+    }
+
+    _end_wave(w, wave, wave_n);
+
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        _free_cmd_buff(w, wave[i].cmd_buf);
+    }
+}
+
+typedef struct wave_end_t {
+    world_instance_t *w;
+    system_run_t *wave;
+    uint32_t wave_n;
+    system_run_t *next;
+    uint32_t next_n;
+} wave_end_t;
+
+static void _end_wave_task(void *data) {
+    wave_end_t *end = data;
+
+    _end_wave(end->w, end->wave, end->wave_n);
+
+    if (end->next_n) {
+        _begin_wave(end->w, end->next, end->next_n);
+    }
+}
+
+// Waves as add_after chain: wave systems -> playback (and next wave begin)
+// -> next wave systems, only last playback is waited.
+// Systems and playback run on workers.
+static void _run_wave_chain(world_instance_t *w,
+                            system_run_t *runs,
+                            const uint32_t *waves,
+                            uint32_t wave_n) {
+    if (!wave_n) {
+        return;
+    }
+
+    // Buffers before submit, playback does not touch buffer pool.
+    const uint32_t run_n = ce_array_size(runs);
+    for (uint32_t i = 0; i < run_n; ++i) {
+        runs[i].cmd_buf = _new_cmd_buff(w);
+    }
+
+    wave_end_t ends[wave_n];
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        const uint32_t next = first + waves[i];
+
+        ends[i] = (wave_end_t) {
+                .w = w,
+                .wave = runs + first,
+                .wave_n = waves[i],
+                .next = runs + next,
+                .next_n = (i + 1 < wave_n) ? waves[i + 1] : 0,
+        };
+
+        first = next;
+    }
+
+    _begin_wave(w, runs, waves[0]);
+
+    ce_task_counter_t0 *prev = NULL;
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        ce_task_item_t0 items[waves[i]];
+        for (uint32_t j = 0; j < waves[i]; ++j) {
+            items[j] = (ce_task_item_t0) {
+                    .name = "ecs_system",
+                    .work = _run_system,
+                    .data = &ends[i].wave[j],
+                    .priority = TASK_PRIORITY_CRITICAL,
+            };
+        }
+
+        ce_task_counter_t0 *systems = NULL;
+        ce_task_a0->add_after(&prev, prev ? 1 : 0, items, waves[i], &systems);
+        if (prev) {
+            ce_task_a0->release_counter(prev);
+        }
+
+        ce_task_counter_t0 *end = NULL;
+        ce_task_a0->add_after(&systems, 1, &(ce_task_item_t0) {
+                .name = "ecs_playback",
+                .work = _end_wave_task,
+                .data = &ends[i],
+                .priority = TASK_PRIORITY_CRITICAL,
+        }, 1, &end);
+        ce_task_a0->release_counter(systems);
+
+        prev = end;
+    }
+
+    ce_task_a0->wait_for_counter(prev, 0);
+
+    for (uint32_t i = 0; i < run_n; ++i) {
+        _free_cmd_buff(w, runs[i].cmd_buf);
+    }
+}
+
+static void _close_plan_wave(world_instance_t *w,
+                             uint32_t *wave_first) {
+    const uint32_t run_n = ce_array_size(w->plan_runs);
+
+    if (run_n > *wave_first) {
+        ce_array_push(w->plan_waves, run_n - *wave_first, _G.allocator);
+    }
+
+    *wave_first = run_n;
+}
+
+// Systems in topological order are packed to waves until conflict or dependency.
+// Subgroup close current wave and its waves follow in place.
+static void _plan_group(world_instance_t *w,
+                        uint64_t group_name,
+                        float dt,
+                        uint32_t *wave_first) {
+    uint64_t group_graph = ce_hash_lookup(&_G.system_group_g_map, group_name, UINT64_MAX);
+    if (group_graph == UINT64_MAX) {
+        return;
+    }
+
+    ce_ba_graph_t *g = &_G.graph_pool[group_graph];
+    uint64_t *outputs = g->output;
+
+    const uint64_t systems_n = ce_array_size(outputs);
+    for (int i = 0; i < systems_n; ++i) {
+        ct_system_i0 *sys = (ct_system_i0 *) ce_hash_lookup(&_G.system_map, outputs[i], 0);
+
+        ct_system_group_i0 *sysg = (ct_system_group_i0 *) ce_hash_lookup(&_G.system_group_map,
+                                                                         outputs[i], 0);
+
+        if (sys) {
+            uint64_t access_idx = ce_hash_lookup(&_G.system_access_map, outputs[i], 0);
+            const system_access_t *access = &_G.system_access[access_idx];
+
+            const uint32_t run_n = ce_array_size(w->plan_runs);
+            for (uint32_t j = *wave_first; j < run_n; ++j) {
+                if (_system_conflict(access, w->plan_runs[j].access)
+                    || _system_depend(g, outputs[i], w->plan_runs[j].system->name)) {
+                    _close_plan_wave(w, wave_first);
+                    break;
+                }
+            }
+
+            ce_array_push(w->plan_runs, ((system_run_t) {
+                    .world = w->world,
+                    .system = sys,
+                    .access = access,
+                    .dt = dt,
+            }), _G.allocator);
+        } else if (sysg) {
+            _close_plan_wave(w, wave_first);
+            _plan_group(w, sysg->name, dt, wave_first);
+        }
+    }
+}
+
+// Chain submit all waves at once, without it every wave is waited on calling
+// thread (thread affine systems, presentation).
+static void _process_group(ct_world_t0 world,
+                           uint64_t group_name,
+                           float dt,
+                           bool chain) {
+    world_instance_t *w = get_world_instance(world);
+
+    ce_array_clean(w->plan_runs);
+    ce_array_clean(w->plan_waves);
+
+    uint32_t wave_first = 0;
+    _plan_group(w, group_name, dt, &wave_first);
+    _close_plan_wave(w, &wave_first);
+
+    const uint32_t wave_n = ce_array_size(w->plan_waves);
+
+    if (chain) {
+        _run_wave_chain(w, w->plan_runs, w->plan_waves, wave_n);
+        return;
+    }
+
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < wave_n; ++i) {
+        _run_wave(w, w->plan_runs + first, w->plan_waves[i]);
+        first += w->plan_waves[i];
+    }
+}
+
+// Move n entities from src tail to dst, columns are copied as blocks.
+static void _chunk_move(world_instance_t *w,
+                        archetype_t *storage,
+                        ent_chunk_t *src,
+                        ent_chunk_t *dst,
+                        uint32_t n) {
+    if (!n) {
+        return;
+    }
+
+    const uint32_t src_first = src->ent_n - n;
+    const uint32_t dst_first = dst->ent_n;
+
+    ct_entity_t0 *src_ents = _get_entity_array(src) + src_first;
+    memcpy(_get_entity_array(dst) + dst_first, src_ents, sizeof(ct_entity_t0) * n);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t idx = handler_idx(src_ents[i].h);
+        w->entity_idx[idx] = dst_first + i;
+        w->entity_chunk[idx] = dst;
+
+        if (src->event_mask) {
+            _event_move(w, storage, src, src_first + i, dst, dst_first + i);
+        }
+    }
+
+    for (uint32_t i = 0; i < storage->component_n; ++i) {
+        // Moved data keep changes visible for change filters.
+        uint32_t *src_block = _block_version(storage, src, i);
+        uint32_t *dst_block = _block_version(storage, dst, i);
+
+        uint32_t version = 0;
+        const uint32_t src_last = (src_first + n - 1) / CHUNK_BLOCK_SIZE;
+        for (uint32_t b = src_first / CHUNK_BLOCK_SIZE; b <= src_last; ++b) {
+            if (src_block[b] > version) {
+                version = src_block[b];
+            }
+        }
+
+        const uint32_t dst_last = (dst_first + n - 1) / CHUNK_BLOCK_SIZE;
+        for (uint32_t b = dst_first / CHUNK_BLOCK_SIZE; b <= dst_last; ++b) {
+            if (version > dst_block[b]) {
+                dst_block[b] = version;
+            }
+        }
+
+        if (version > dst->version[i]) {
+            dst->version[i] = version;
+        }
+
+        uint32_t size = storage->size[i];
+        if (!size) {
+            continue;
+        }
+
+        uint8_t *src_data = _get_component_array(storage, src, i);
+        uint8_t *dst_data = _get_component_array(storage, dst, i);
+
+        memcpy(dst_data + (dst_first * size), src_data + (src_first * size), size * n);
+    }
+
+    src->ent_n -= n;
+    dst->ent_n += n;
+}
+
+static int _cmp_compact_item(const void *a,
+                             const void *b) {
+    const compact_item_t *i1 = a;
+    const compact_item_t *i2 = b;
+
+    if (i1->shared_hash != i2->shared_hash) {
+        return i1->shared_hash < i2->shared_hash ? -1 : 1;
+    }
+
+    return i1->ent_n < i2->ent_n ? -1 : (i1->ent_n > i2->ent_n);
+}
+
+// Empty sparsest chunks of group to fullest chunks of same group.
+static uint32_t _compact_group(world_instance_t *w,
+                               archetype_t *storage,
+                               compact_item_t *items,
+                               uint32_t item_n,
+                               uint32_t *budget) {
+    // Same hash but other shared values => leave group as is.
+    const uint8_t *shared = _chunk_shared(storage, items[0].chunk);
+    for (uint32_t i = 1; i < item_n; ++i) {
+        if (!_chunk_has_shared(storage, items[i].chunk, shared, items[0].shared_hash)) {
+            return 0;
+        }
+    }
+
+    uint32_t free_n = 0;
+    for (uint32_t i = 0; i < item_n; ++i) {
+        free_n += storage->max_ent - items[i].chunk->ent_n;
+    }
+
+    uint32_t moved = 0;
+    uint32_t lo = 0;
+    uint32_t hi = item_n - 1;
+
+    while ((lo < hi) && *budget) {
+        ent_chunk_t *src = items[lo].chunk;
+        ent_chunk_t *dst = items[hi].chunk;
+
+        // Sparsest chunk does not fit to others => no chunk does.
+        if ((free_n - (storage->max_ent - src->ent_n)) < src->ent_n) {
+            break;
+        }
+
+        uint32_t n = storage->max_ent - dst->ent_n;
+        if (n > src->ent_n) {
+            n = src->ent_n;
+        }
+
+        if (n > *budget) {
+            n = *budget;
+        }
+
+        _chunk_move(w, storage, src, dst, n);
+        moved += n;
+        *budget -= n;
+
+        if (!src->ent_n) {
+            free_n -= storage->max_ent;
+            _unlink_chunk(w, storage, src);
+            ++lo;
+        }
+
+        if (dst->ent_n == storage->max_ent) {
+            --hi;
+        }
+    }
+
+    return moved;
+}
+
+// Chunks are bucketed by shared values and occupancy once per call.
+// Budget count visited chunks and moved entities. Archetype with more chunks
+// than budget left is deferred to next call, where it is first. First
+// archetype always make progress, its visits take at most half of budget.
+static uint32_t _compact_archetype(world_instance_t *w,
+                                   archetype_t *storage,
+                                   uint32_t *budget,
+                                   bool first,
+                                   bool *deferred) {
+    ce_array_clean(w->compact_items);
+
+    const uint32_t visit_max = first ? (*budget / 2) : (*budget - 1);
+    uint32_t visit_n = 0;
+
+    for (ent_chunk_t *chunk = storage->first; chunk; chunk = chunk->next) {
+        if (visit_n < visit_max) {
+            ++visit_n;
+        } else if (!first) {
+            *deferred = true;
+            return 0;
+        }
+
+        if (chunk->ent_n >= storage->max_ent) {
+            continue;
+        }
+
+        compact_item_t item = {
+                .chunk = chunk,
+                .shared_hash = chunk->shared_hash,
+                .ent_n = chunk->ent_n,
+        };
+        ce_array_push(w->compact_items, item, _G.allocator);
+    }
+
+    *budget -= visit_n;
+
+    compact_item_t *items = w->compact_items;
+    const uint32_t item_n = ce_array_size(items);
+    qsort(items, item_n, sizeof(compact_item_t), _cmp_compact_item);
+
+    uint32_t moved = 0;
+    for (uint32_t begin = 0; begin < item_n;) {
+        uint32_t end = begin + 1;
+        while ((end < item_n) && (items[end].shared_hash == items[begin].shared_hash)) {
+            ++end;
+        }
+
+        if (!*budget) {
+            return moved;
+        }
+
+        moved += _compact_group(w, storage, items + begin, end - begin, budget);
+        begin = end;
+    }
+
+    // Budget left => every group is compacted.
+    if (*budget) {
+        storage->fragmented = false;
+    }
+
+    return moved;
+}
+
+static void set_chunk_size(ct_world_t0 world,
+                           uint32_t chunk_size) {
+    world_instance_t *w = get_world_instance(world);
+    w->chunk_size = _align_up(chunk_size, CHUNK_SIZE_ALIGN);
+}
+
+static uint32_t compact(ct_world_t0 world,
+                        uint32_t max_moves) {
+    world_instance_t *w = get_world_instance(world);
+
+    uint32_t moved = 0;
+    uint32_t budget = max_moves;
+
+    const uint32_t archetype_n = ce_array_size(w->archetype_array);
+    for (uint32_t i = 0; (i < archetype_n) && budget; ++i) {
+        // Round robin between calls
+        uint32_t archetype_idx = w->archetype_array[w->compact_cursor % archetype_n];
+        archetype_t *storage = &w->archetype_pool[archetype_idx];
+
+        if (storage->fragmented) {
+            bool deferred = false;
+            moved += _compact_archetype(w, storage, &budget, budget == max_moves, &deferred);
+
+            // Next call start with it.
+            if (deferred) {
+                break;
+            }
+        }
+
+        ++w->compact_cursor;
+    }
+
+    return moved;
+}
+
+static void world_stats(ct_world_t0 world,
+                        ct_ecs_world_stats_t0 *stats) {
+    world_instance_t *w = get_world_instance(world);
+
+    *stats = (ct_ecs_world_stats_t0) {
+            .compact_moved_n = w->compact_moved_n,
+    };
+
+    const uint32_t archetype_n = ce_array_size(w->archetype_array);
+    for (uint32_t i = 0; i < archetype_n; ++i) {
+        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
+
+        stats->archetype_n += 1;
+
+        ent_chunk_t *chunk = storage->first;
+        while (chunk) {
+            stats->entity_n += chunk->ent_n;
+            stats->chunk_n += 1;
+            stats->chunk_capacity += storage->max_ent;
+            chunk = chunk->next;
+        }
+    }
+}
+
+// SNAPSHOT
+
+// Image: header | generation | free idx | entity obj | archetypes
+//        | per archetype components, chunks | component stream
+// Chunks are raw chunk memory at page aligned offsets.
+#define SNAPSHOT_VERSION 1
+
+typedef struct snapshot_header_t {
+    uint32_t version;
+    uint32_t archetype_n;
+    uint64_t size;
+    uint64_t handle_n;
+    uint64_t free_n;
+    uint64_t generation_offset;
+    uint64_t free_offset;
+    uint64_t obj_offset;
+    uint64_t archetype_offset;
+    // Data written by component snapshot hooks
+    uint64_t stream_offset;
+    uint64_t stream_size;
+} snapshot_header_t;
+
+typedef struct snapshot_archetype_t {
+    uint32_t component_n;
+    uint32_t chunk_n;
+    uint32_t chunk_size;
+    uint32_t ent_offset;
+    uint32_t max_ent;
+    uint32_t _pad;
+    uint64_t component_offset;
+    uint64_t chunk_offset;
+} snapshot_archetype_t;
+
+// Layout of component in chunk, restore is refused if it differs.
+typedef struct snapshot_component_t {
+    uint64_t name;
+    uint32_t size;
+    uint32_t offset;
+    uint32_t shared_offset;
+    uint32_t _pad;
+} snapshot_component_t;
+
+// Append size bytes at aligned offset, data NULL = only reserve.
+static uint64_t _image_push(uint8_t **image,
+                            const void *data,
+                            uint64_t size,
+                            uint64_t align,
+                            ce_alloc_t0 *alloc) {
+    const uint64_t begin = ce_array_size(*image);
+    const uint64_t offset = _align_up(begin, align);
+
+    ce_array_resize(*image, offset + size, alloc);
+    memset(*image + begin, 0, offset - begin);
+
+    if (data) {
+        memcpy(*image + offset, data, size);
+    }
+
+    return offset;
+}
+
+static bool _image_has(const snapshot_header_t *header,
+                       uint64_t offset,
+                       uint64_t size) {
+    return (offset <= header->size) && (size <= (header->size - offset));
+}
+
+static void snapshot(ct_world_t0 world,
+                     uint8_t **image,
+                     ce_alloc_t0 *alloc) {
+    world_instance_t *w = get_world_instance(world);
+
+    const uint32_t archetype_n = ce_array_size(w->archetype_array);
+    const uint64_t handle_n = ce_array_size(w->entity_handler.generation);
+    const uint64_t free_n = ce_array_size(w->entity_handler.free_idx);
+
+    // Whole image in one allocation, chunks are most of it.
+    uint64_t size = sizeof(snapshot_header_t)
+                    + (handle_n * (sizeof(char) + sizeof(uint64_t)))
+                    + (free_n * sizeof(uint64_t))
+                    + (archetype_n * sizeof(snapshot_archetype_t)) + 64;
+
+    for (uint32_t i = 0; i < archetype_n; ++i) {
+        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
+
+        size += (storage->component_n * sizeof(snapshot_component_t)) + CHUNK_SIZE_ALIGN;
+
+        for (ent_chunk_t *chunk = storage->first; chunk; chunk = chunk->next) {
+            size += storage->chunk_size;
+        }
+    }
+
+    ce_array_clean(*image);
+    ce_array_set_capacity(*image, size + 1, alloc);
+
+    _image_push(image, NULL, sizeof(snapshot_header_t), sizeof(uint64_t), alloc);
+
+    const uint64_t generation_offset = _image_push(image, w->entity_handler.generation,
+                                                   handle_n, sizeof(uint64_t), alloc);
+
+    const uint64_t free_offset = _image_push(image, w->entity_handler.free_idx,
+                                             sizeof(uint64_t) * free_n,
+                                             sizeof(uint64_t), alloc);
+
+    const uint64_t obj_offset = _image_push(image, w->entity_obj,
+                                            sizeof(uint64_t) * handle_n,
+                                            sizeof(uint64_t), alloc);
+
+    const uint64_t archetype_offset = _image_push(image, NULL,
+                                                  sizeof(snapshot_archetype_t) * archetype_n,
+                                                  sizeof(uint64_t), alloc);
+
+    uint8_t *stream = NULL;
+
+    for (uint32_t i = 0; i < archetype_n; ++i) {
+        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
+
+        const uint64_t component_offset = _image_push(image, NULL,
+                                                      sizeof(snapshot_component_t) *
+                                                      storage->component_n,
+                                                      sizeof(uint64_t), alloc);
+
+        snapshot_component_t *component = (snapshot_component_t *) (*image + component_offset);
+        for (uint32_t j = 0; j < storage->component_n; ++j) {
+            component[j] = (snapshot_component_t) {
+                    .name = storage->name[j],
+                    .size = storage->size[j],
+                    .offset = storage->offset[j],
+                    .shared_offset = storage->shared_offset[j],
+            };
+        }
+
+        const uint64_t chunk_offset = _align_up(ce_array_size(*image), CHUNK_SIZE_ALIGN);
+        uint32_t chunk_n = 0;
+
+        for (ent_chunk_t *chunk = storage->first; chunk; chunk = chunk->next) {
+            uint64_t offset = _image_push(image, chunk, storage->chunk_size,
+                                          CHUNK_SIZE_ALIGN, alloc);
+
+            // Runtime pointers are not part of image.
+            ent_chunk_t *image_chunk = (ent_chunk_t *) (*image + offset);
+            image_chunk->event_mask = 0;
+            image_chunk->event_bits = NULL;
+            image_chunk->next = NULL;
+            image_chunk->prev = NULL;
+
+            ct_entity_t0 *ent = _get_entity_array(chunk);
+            for (uint32_t j = 0; j < storage->component_n; ++j) {
+                ct_ecs_component_i0 *ci = get_interface(storage->name[j]);
+                if (!ci->snapshot || !storage->size[j]) {
+                    continue;
+                }
+
+                ci->snapshot(world, ent, _get_component_array(storage, chunk, j),
+                             chunk->ent_n, &stream, alloc);
+            }
+
+            ++chunk_n;
+        }
 
-    if (idx == UINT64_MAX) {
-        ce_hash_add(&infos->obj_entmap, obj, ent.h, _G.allocator);
+        snapshot_archetype_t *archetype = (snapshot_archetype_t *) (*image + archetype_offset);
+        archetype[i] = (snapshot_archetype_t) {
+                .component_n = storage->component_n,
+                .chunk_n = chunk_n,
+                .chunk_size = storage->chunk_size,
+                .ent_offset = storage->ent_offset,
+                .max_ent = storage->max_ent,
+                .component_offset = component_offset,
+                .chunk_offset = chunk_offset,
+        };
     }
 
-    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
-    if (spawninfo_idx == UINT64_MAX) {
-        if (!ce_mpmc_dequeue(&infos->obj_spawninfo_free, &spawninfo_idx)) {
-            spawninfo_idx = atomic_fetch_add(&infos->obj_spawninfo_pool_n, 1);
-            infos->obj_spawninfo_pool[spawninfo_idx] = (spawn_info_t) {};
-        }
+    const uint64_t stream_size = ce_array_size(stream);
+    const uint64_t stream_offset = _image_push(image, stream, stream_size,
+                                               sizeof(uint64_t), alloc);
+    ce_array_free(stream, alloc);
+
+    *((snapshot_header_t *) *image) = (snapshot_header_t) {
+            .version = SNAPSHOT_VERSION,
+            .archetype_n = archetype_n,
+            .size = ce_array_size(*image),
+            .handle_n = handle_n,
+            .free_n = free_n,
+            .generation_offset = generation_offset,
+            .free_offset = free_offset,
+            .obj_offset = obj_offset,
+            .archetype_offset = archetype_offset,
+            .stream_offset = stream_offset,
+            .stream_size = stream_size,
+    };
+}
 
-        ce_hash_add(&infos->obj_spawninfo_map, obj, spawninfo_idx, _G.allocator);
+static bool _snapshot_layout_eq(archetype_t *storage,
+                                const snapshot_archetype_t *archetype,
+                                const snapshot_component_t *component) {
+    if ((storage->component_n != archetype->component_n)
+        || (storage->chunk_size != archetype->chunk_size)
+        || (storage->ent_offset != archetype->ent_offset)
+        || (storage->max_ent != archetype->max_ent)) {
+        return false;
     }
 
-    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
-    spawn_info->ent_obj = obj;
-    spawn_info->ev_queue = ce_cdb_a0->new_obj_listener(db, obj);
+    for (uint32_t i = 0; i < storage->component_n; ++i) {
+        if ((storage->name[i] != component[i].name)
+            || (storage->size[i] != component[i].size)
+            || (storage->offset[i] != component[i].offset)
+            || (storage->shared_offset[i] != component[i].shared_offset)) {
+            return false;
+        }
+    }
 
-    ce_array_push(spawn_info->ents, ent, _G.allocator);
+    return true;
 }
 
-static void _add_ent_spawn_obj(ce_cdb_t0 db,
-                               world_instance_t *world,
-                               uint64_t obj,
-                               struct ct_entity_t0 ent) {
-    _add_spawn_obj(db, &world->obj_spawninfo, obj, ent);
-}
+// Archetypes without chunks, backward because free swap with last.
+static void _free_empty_archetypes(world_instance_t *w) {
+    for (uint32_t i = ce_array_size(w->archetype_array); i > 0; --i) {
+        archetype_t *storage = &w->archetype_pool[w->archetype_array[i - 1]];
 
-static void _add_comp_spawn_obj(ce_cdb_t0 db,
-                                world_instance_t *world,
-                                uint64_t obj,
-                                struct ct_entity_t0 ent) {
-    _add_spawn_obj(db, &world->comp_spawninfo, obj, ent);
+        if (!storage->first) {
+            _free_archetype(w, storage);
+        }
+    }
 }
 
-static spawn_info_t *_get_spawninfo(spawn_infos_t *infos,
-                                    uint64_t obj) {
-    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
-    if (UINT64_MAX == spawninfo_idx) {
-        return NULL;
+// Chunk entities are handles of image, each entity in one slot only.
+static bool _snapshot_chunks_valid(const uint8_t *image,
+                                   const snapshot_header_t *header,
+                                   const snapshot_archetype_t *archetype) {
+    const uint64_t handle_n = header->handle_n;
+
+    const uint64_t *free_idx = (const uint64_t *) (image + header->free_offset);
+    for (uint64_t i = 0; i < header->free_n; ++i) {
+        if (free_idx[i] >= handle_n) {
+            return false;
+        }
     }
 
-    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
-    return spawn_info;
-}
+    const uint64_t used_size = sizeof(uint64_t) * ((handle_n / 64) + 1);
+    uint64_t *used = CE_ALLOC(_G.allocator, uint64_t, used_size);
+    memset(used, 0, used_size);
 
-void _free_spawninfo(spawn_infos_t *infos,
-                     uint64_t obj) {
-    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
-    if (UINT64_MAX == spawninfo_idx) {
-        return;
-    }
+    bool valid = true;
+    for (uint32_t i = 0; valid && (i < header->archetype_n); ++i) {
+        const snapshot_archetype_t *a = &archetype[i];
 
-    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
-    ce_array_clean(spawn_info->ents);
-    ce_mpmc_enqueue(&infos->obj_spawninfo_free, &spawninfo_idx);
-}
+        for (uint32_t j = 0; valid && (j < a->chunk_n); ++j) {
+            const ent_chunk_t *chunk = (const ent_chunk_t *) (image + a->chunk_offset +
+                                                              ((uint64_t) j * a->chunk_size));
 
-void _free_spawninfo_ent(spawn_infos_t *infos,
-                         uint64_t obj,
-                         ct_entity_t0 ent) {
-    uint64_t spawninfo_idx = ce_hash_lookup(&infos->obj_spawninfo_map, obj, UINT64_MAX);
-    if (UINT64_MAX == spawninfo_idx) {
-        return;
-    }
+            if ((chunk->ent_n > a->max_ent) || (chunk->ent_offset != a->ent_offset)) {
+                valid = false;
+                break;
+            }
 
-    spawn_info_t *spawn_info = &infos->obj_spawninfo_pool[spawninfo_idx];
+            const ct_entity_t0 *ent = (const ct_entity_t0 *) (((const uint8_t *) chunk) +
+                                                              a->ent_offset);
+            for (uint32_t k = 0; k < chunk->ent_n; ++k) {
+                uint64_t idx = handler_idx(ent[k].h);
+                uint64_t bit = 1ULL << (idx % 64);
 
-    uint32_t ent_n = ce_array_size(spawn_info->ents);
-    for (int i = 0; i < ent_n; ++i) {
-        if (spawn_info->ents[i].h == ent.h) {
-            spawn_info->ents[i] = spawn_info->ents[ent_n - 1];
-            ce_array_pop_back(spawn_info->ents);
-            return;
+                if ((idx >= handle_n) || (used[idx / 64] & bit)) {
+                    valid = false;
+                    break;
+                }
+
+                used[idx / 64] |= bit;
+            }
         }
     }
+
+    CE_FREE(_G.allocator, used);
+    return valid;
 }
 
-static void *get_all(ct_world_t0 world,
-                     uint64_t component_name,
-                     ct_ecs_ent_chunk_o0 *_item) {
-    ent_chunk_t *chunk = (ent_chunk_t *) _item;
+// Restore drop current data, components free what they own.
+static void _release_chunk(world_instance_t *w,
+                           archetype_t *storage,
+                           ent_chunk_t *chunk) {
+    ct_entity_t0 *ent = _get_entity_array(chunk);
 
-    world_instance_t *w = get_world_instance(world);
-    archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
+    for (uint32_t i = 0; i < storage->component_n; ++i) {
+        ct_ecs_component_i0 *ci = get_interface(storage->name[i]);
+        if (!ci || !ci->release || !storage->size[i]) {
+            continue;
+        }
 
-    uint64_t comp_idx = component_idx(storage, component_name);
+        ci->release(w->world, ent, _get_component_array(storage, chunk, i), chunk->ent_n);
+    }
 
-    return _get_component_array(storage, chunk, comp_idx);
+    _free_chunk(w, chunk);
 }
 
-static bool has(ct_world_t0 world,
-                struct ct_entity_t0 ent,
-                uint64_t *component_name,
-                uint32_t name_count) {
+static bool restore(ct_world_t0 world,
+                    const uint8_t *image,
+                    uint64_t size) {
     world_instance_t *w = get_world_instance(world);
 
-    ent_chunk_t *chunk = _entity_chunk(w, ent);
-
-    if (!chunk) {
+    const snapshot_header_t *header = (const snapshot_header_t *) image;
+
+    if ((size < sizeof(snapshot_header_t))
+        || (header->version != SNAPSHOT_VERSION)
+        || (header->size > size)
+        || (header->handle_n > MAX_ENTITIES)
+        || !_image_has(header, header->generation_offset, header->handle_n)
+        || !_image_has(header, header->free_offset, sizeof(uint64_t) * header->free_n)
+        || !_image_has(header, header->obj_offset, sizeof(uint64_t) * header->handle_n)
+        || !_image_has(header, header->archetype_offset,
+                       sizeof(snapshot_archetype_t) * header->archetype_n)
+        || !_image_has(header, header->stream_offset, header->stream_size)) {
+        ce_log_a0->error(LOG_WHERE, "Invalid world snapshot");
         return false;
     }
 
-    ct_archemask_t0 ent_type = chunk->archetype_mask;
+    const snapshot_archetype_t *archetype = (const snapshot_archetype_t *) (image +
+                                                                            header->archetype_offset);
+    const uint32_t archetype_n = header->archetype_n;
 
-    uint64_t mask = 0;
-    for (int i = 0; i < name_count; ++i) {
-        mask |= (1 << ce_hash_lookup(&_G.component_types, component_name[i], 0));
-    }
+    // Archetypes first, world is not changed if some layout does not match.
+    uint32_t storage_idx[archetype_n];
+    for (uint32_t i = 0; i < archetype_n; ++i) {
+        const snapshot_archetype_t *a = &archetype[i];
+        const snapshot_component_t *component = (const snapshot_component_t *) (image +
+                                                                                 a->component_offset);
 
-    return ((ent_type.mask & mask) == mask);
-}
+        bool valid = _image_has(header, a->component_offset,
+                                sizeof(snapshot_component_t) * a->component_n)
+                     && _image_has(header, a->chunk_offset,
+                                   (uint64_t) a->chunk_size * a->chunk_n);
 
+        for (uint32_t j = 0; valid && (j < a->component_n); ++j) {
+            valid = get_interface(component[j].name) != NULL;
+        }
 
-static ct_archemask_t0 combine_component_obj(ce_cdb_t0 db,
-                                             const uint64_t *component_obj,
-                                             uint32_t name_count) {
-    uint64_t new_type = 0;
-    for (int i = 0; i < name_count; ++i) {
-        uint64_t type = ce_cdb_a0->obj_type(db, component_obj[i]);
-        new_type |= (1 << ce_hash_lookup(&_G.component_types, type, 0));
-    }
+        if (valid) {
+            uint64_t name[a->component_n];
+            for (uint32_t j = 0; j < a->component_n; ++j) {
+                name[j] = component[j].name;
+            }
 
-    return (ct_archemask_t0) {new_type};
-}
+            archetype_t *storage = _get_or_create_archetype(w, combine_component(name,
+                                                                                 a->component_n));
+            storage_idx[i] = storage->idx;
+            valid = _snapshot_layout_eq(storage, a, component);
+        }
 
-static void add_components(ct_world_t0 world,
-                           struct ct_entity_t0 ent,
-                           const ct_component_pair_t0 *components,
-                           uint32_t components_count) {
-    uint64_t types[components_count];
-    for (int i = 0; i < components_count; ++i) {
-        types[i] = components[i].type;
+        if (!valid) {
+            ce_log_a0->error(LOG_WHERE, "World snapshot does not match components");
+            _free_empty_archetypes(w);
+            return false;
+        }
     }
-    ct_archemask_t0 component_mask = combine_component(types, components_count);
 
-    world_instance_t *w = get_world_instance(world);
-    ent_chunk_t *chunk = _entity_chunk(w, ent);
-    if (chunk) {
-        component_mask = _archetype_add(chunk->archetype_mask, component_mask);
+    if (!_snapshot_chunks_valid(image, header, archetype)) {
+        ce_log_a0->error(LOG_WHERE, "Invalid world snapshot chunks");
+        _free_empty_archetypes(w);
+        return false;
     }
 
-    _add_components_to_archetype(world, ent, component_mask);
+    // Current chunks go to pool and are reused for image.
+    const uint32_t live_n = ce_array_size(w->archetype_array);
+    for (uint32_t i = 0; i < live_n; ++i) {
+        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
 
-    for (int i = 0; i < components_count; ++i) {
-        if (components[i].data) {
-            uint8_t *comp_data = get_one(world, types[i], ent, false);
-            ct_ecs_component_i0 *ci = get_interface(types[i]);
-            uint64_t component_size = ci->size;
-            memcpy(comp_data, components[i].data, component_size);
+        ent_chunk_t *chunk = storage->first;
+        while (chunk) {
+            ent_chunk_t *next = chunk->next;
+            _release_chunk(w, storage, chunk);
+            chunk = next;
         }
+
+        storage->first = NULL;
+        storage->fragmented = false;
     }
-}
 
-static void remove_buff(ct_ecs_cmd_buffer_t *buffer,
-                        ct_world_t0 world,
-                        ct_entity_t0 ent,
-                        const uint64_t *component_name,
-                        uint32_t name_count) {
-    ce_mpmc_queue_t0 *b = (ce_mpmc_queue_t0 *) buffer;
+    // Entity handles
+    const uint64_t handle_n = header->handle_n;
+    const uint64_t old_handle_n = ce_array_size(w->entity_handler.generation);
+    memset(w->entity_chunk, 0, sizeof(ent_chunk_t *) * old_handle_n);
 
-    for (int i = 0; i < name_count; ++i) {
-        void *new_data = NULL;
+    ce_array_resize(w->entity_handler.generation, handle_n, _G.allocator);
+    memcpy(w->entity_handler.generation, image + header->generation_offset, handle_n);
+
+    ce_array_resize(w->entity_handler.free_idx, header->free_n, _G.allocator);
+    memcpy(w->entity_handler.free_idx, image + header->free_offset,
+           sizeof(uint64_t) * header->free_n);
+
+    memcpy(w->entity_obj, image + header->obj_offset, sizeof(uint64_t) * handle_n);
+
+    // Chunks
+    for (uint32_t i = 0; i < archetype_n; ++i) {
+        const snapshot_archetype_t *a = &archetype[i];
+        archetype_t *storage = &w->archetype_pool[storage_idx[i]];
+
+        const uint32_t version_n = storage->component_n * (1 + storage->block_n);
+
+        ent_chunk_t *last = NULL;
+        for (uint32_t j = 0; j < a->chunk_n; ++j) {
+            ent_chunk_t *chunk = _get_new_chunk(w, storage->chunk_size);
+            memcpy(chunk, image + a->chunk_offset + ((uint64_t) j * a->chunk_size),
+                   storage->chunk_size);
+
+            chunk->archetype_mask = storage->archetype_mask;
+            chunk->archetype_idx = storage->idx;
+            chunk->size = storage->chunk_size;
+            chunk->event_mask = 0;
+            chunk->event_bits = NULL;
+
+            chunk->next = NULL;
+            chunk->prev = last;
+            if (last) {
+                last->next = chunk;
+            } else {
+                storage->first = chunk;
+            }
+            last = chunk;
+
+            // Restored data is new for only_changed queries.
+            for (uint32_t k = 0; k < version_n; ++k) {
+                chunk->version[k] = w->global_system_version;
+            }
+
+            if (chunk->ent_n < storage->max_ent) {
+                storage->fragmented = true;
+            }
 
-        new_data = CE_ALLOC(_G.allocator, char, sizeof(uint64_t) * name_count);
-        memcpy(new_data, component_name, sizeof(uint64_t) * name_count);
+            ct_entity_t0 *ent = _get_entity_array(chunk);
+            for (uint32_t k = 0; k < chunk->ent_n; ++k) {
+                w->entity_idx[handler_idx(ent[k].h)] = k;
+                w->entity_chunk[handler_idx(ent[k].h)] = chunk;
+            }
 
-        ce_mpmc_enqueue(b, &(cmd_t) {
-                .type = REMOVE_COMPONENT_CMD,
-                .remove = {
-                        .world = world,
-                        .components = new_data,
-                        .n = name_count,
-                        .ent = ent
-                },
-        });
+            if (storage->event_arrive) {
+                _event_set(w, storage, chunk, 0, chunk->ent_n, storage->event_arrive);
+            }
+        }
     }
-}
 
-static void add_buff(ct_ecs_cmd_buffer_t *buffer,
-                     ct_world_t0 world,
-                     ct_entity_t0 ent,
-                     const ct_component_pair_t0 *components,
-                     uint32_t components_count) {
-    ce_mpmc_queue_t0 *b = (ce_mpmc_queue_t0 *) buffer;
+    _free_empty_archetypes(w);
+    w->compact_cursor = 0;
 
-    for (int i = 0; i < components_count; ++i) {
-        ct_ecs_component_i0 *ci = get_interface(components[i].type);
+    // Component hooks after all entities are live, same order as snapshot.
+    // After first short read hooks get empty stream, so they only reset data.
+    const uint8_t *stream = image + header->stream_offset;
+    const uint8_t *stream_end = stream + header->stream_size;
+    bool stream_valid = true;
+    for (uint32_t i = 0; i < archetype_n; ++i) {
+        archetype_t *storage = &w->archetype_pool[storage_idx[i]];
 
-        void *new_data = NULL;
+        for (ent_chunk_t *chunk = storage->first; chunk; chunk = chunk->next) {
+            ct_entity_t0 *ent = _get_entity_array(chunk);
+
+            for (uint32_t j = 0; j < storage->component_n; ++j) {
+                ct_ecs_component_i0 *ci = get_interface(storage->name[j]);
+                if (!ci->restore || !storage->size[j]) {
+                    continue;
+                }
 
-        if (ci->size) {
-            new_data = CE_ALLOC(_G.allocator, char, ci->size);
-            memcpy(new_data, components[i].data, ci->size);
+                uint64_t stream_size = stream_valid ? (uint64_t) (stream_end - stream) : 0;
+                stream_valid &= ci->restore(world, ent, _get_component_array(storage, chunk, j),
+                                            chunk->ent_n, &stream, stream_size);
+            }
         }
+    }
+
+    if (!stream_valid) {
+        ce_log_a0->error(LOG_WHERE, "Snapshot component stream is too short");
+    }
 
+    return stream_valid;
+}
 
-        ce_mpmc_enqueue(b, &(cmd_t) {
-                .type = ADD_COMPONENT_CMD,
-                .add = {
-                        .world = world,
-                        .data = new_data,
-                        .component_type = components[i].type,
-                        .component_size = ci->size,
-                        .ent = ent
-                },
-        });
+// Graphs are shared by all worlds, rebuilt before any world is stepped.
+static void _update_graphs() {
+    if (_G.built_graph_version == _G.graph_version) {
+        return;
     }
+
+    _G.built_graph_version = _G.graph_version;
+    _build_graphs();
 }
 
+// Touch only world state, simulation of worlds runs concurrently.
+static void _step_simulation(world_instance_t *w,
+                             float dt) {
+    _process_group(w->world, CT_ECS_SIMULATION_GROUP, dt, true);
+}
 
-static void _add_components_from_obj(world_instance_t *world,
-                                     ce_cdb_t0 db,
-                                     struct ct_entity_t0 ent,
-                                     uint64_t obj) {
-    uint64_t mew_component = obj;
-    ce_hash_add(&world->component_obj_map, mew_component, mew_component, _G.allocator);
+// Presentation systems use renderer (viewport builders, default encoder)
+// that is not thread safe, so run it on calling thread.
+static void _step_presentation(world_instance_t *w,
+                               float dt) {
+    _process_group(w->world, CT_ECS_PRESENTATION_GROUP, dt, false);
 
-    uint64_t component_type = ce_cdb_a0->obj_type(ce_cdb_a0->db(), obj);
+    w->compact_moved_n = compact(w->world, COMPACT_MOVES_PER_STEP);
+}
 
-    ct_ecs_component_i0 *ci = get_interface(component_type);
+static void _step_simulation_task(void *data) {
+    world_step_t *ws = data;
+    _step_simulation(ws->w, ws->dt);
+}
 
-    if (!ci) {
+static void step(ct_world_t0 world,
+                 float dt) {
+    _update_graphs();
+
+    world_instance_t *w = get_world_instance(world);
+    _step_simulation(w, dt);
+    _step_presentation(w, dt);
+}
+
+static void step_worlds(const ct_world_t0 *worlds,
+                        uint32_t n,
+                        float dt) {
+    if (!n) {
         return;
     }
-    ct_archemask_t0 new_type = combine_component(&component_type, 1);
-    _add_components_to_archetype(world->world, ent, new_type);
 
-    uint8_t *comp_data = get_one(world->world, component_type, ent, false);
+    _update_graphs();
 
-    if (ci->from_cdb_obj) {
-        ci->from_cdb_obj(world->world, db, obj, comp_data);
+    if (n == 1) {
+        step(worlds[0], dt);
+        return;
     }
 
-    _add_comp_spawn_obj(db, world, obj, ent);
+    world_step_t steps[n];
+    ce_task_item_t0 items[n];
+    for (uint32_t i = 0; i < n; ++i) {
+        steps[i] = (world_step_t) {
+                .w = get_world_instance(worlds[i]),
+                .dt = dt,
+        };
+
+        items[i] = (ce_task_item_t0) {
+                .name = "ecs_world",
+                .work = _step_simulation_task,
+                .data = &steps[i],
+                .priority = TASK_PRIORITY_CRITICAL,
+        };
+    }
+
+    ce_task_counter_t0 *counter = NULL;
+    ce_task_a0->add(items, n, &counter);
+    ce_task_a0->wait_for_counter(counter, 0);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        _step_presentation(steps[i].w, dt);
+    }
 }
 
-static void remove_components(ct_world_t0 world,
-                              struct ct_entity_t0 ent,
-                              const uint64_t *component_name,
-                              uint32_t name_count) {
+static void create_entities(ct_world_t0 world,
+                            struct ct_entity_t0 *entity,
+                            uint32_t count) {
+
+    world_instance_t *w = get_world_instance(world);
+
+    for (int i = 0; i < count; ++i) {
+        struct ct_entity_t0 ent = {.h = ce_handler_create(&w->entity_handler,
+                                                          _G.allocator)};
+
+        CE_ASSERT("ecs", ent.h != 0);
+
+        entity[i] = ent;
+
+        uint64_t idx = handler_idx(ent.h);
+
+        w->entity_obj[idx] = 0;
+        w->entity_chunk[idx] = NULL;
+    }
+}
+
+static void create_entities_objs(ct_world_t0 world,
+                                 struct ct_entity_t0 *entity,
+                                 uint32_t count,
+                                 uint64_t *objs) {
+
+    world_instance_t *w = get_world_instance(world);
+
+    for (int i = 0; i < count; ++i) {
+        struct ct_entity_t0 ent = {.h = ce_handler_create(&w->entity_handler,
+                                                          _G.allocator)};
+
+        CE_ASSERT("ecs", ent.h != 0);
+
+        entity[i] = ent;
+
+        uint64_t idx = handler_idx(ent.h);
+
+        uint64_t obj = objs[i];
+        w->entity_obj[idx] = obj;
+        w->entity_chunk[idx] = NULL;
+    }
+}
+
+
+static void destroy(ct_world_t0 world,
+                    struct ct_entity_t0 *entity,
+                    uint32_t count) {
     world_instance_t *w = get_world_instance(world);
 
-    ent_chunk_t *chunk = _entity_chunk(w, ent);
+    for (uint32_t i = 0; i < count; ++i) {
+        ct_entity_t0 ent = entity[i];
+
+        uint64_t data_idx = _entity_data_idx(w, ent);
+        ent_chunk_t *chunk = _entity_chunk(w, ent);
+
+        ct_child_c *child = get_one(world, CT_CHILD_COMPONENT, ent, false);
+
+        archetype_t *storage = NULL;
+        if (chunk) {
+            storage = _get_archetype(w, chunk->archetype_mask);
+            if ((storage) && storage->has_system_state) {
+                ct_archemask_t0 new_type = _archetype_and(chunk->archetype_mask,
+                                                          _G.system_state_components_mask);
+
+                if (_archetype_eq(new_type, chunk->archetype_mask)) {
+                    continue;
+                }
+
+                _add_to_archetype(w, ent, new_type);
+                _move_data_from_archetype(w, ent, chunk, data_idx, chunk->archetype_mask, new_type);
+            }
+            _remove_from_archetype(w, ent, data_idx, chunk, chunk->archetype_mask);
+        } else {
+            CE_UNUSED(chunk);
+        }
 
-    ct_archemask_t0 new_type = chunk->archetype_mask;
-    ct_archemask_t0 comp_type = combine_component(component_name, name_count);
+        if (child) {
+            destroy(world, child->child, ce_array_size(child->child));
+        }
 
-    if (_archetype_none(new_type, comp_type)) {
-        return;
-    }
+        if (storage && !storage->has_system_state) {
+            ce_handler_destroy(&w->entity_handler, ent.h, _G.allocator);
+        }
 
-    new_type.mask &= ~(comp_type.mask);
+        uint64_t ent_obj = _entity_obj(w, ent);
 
-    archetype_t *storage = _get_archetype(w, chunk->archetype_mask);
+        const ce_cdb_obj_o0 *r = ce_cdb_a0->read(ce_cdb_a0->db(), ent_obj);
+        uint64_t components_n = ce_cdb_a0->read_objset_num(r, ENTITY_COMPONENTS);
+        uint64_t components_keys[components_n];
+        ce_cdb_a0->read_objset(r, ENTITY_COMPONENTS, components_keys);
+        for (int j = 0; j < components_n; ++j) {
+            _free_spawninfo_ent(&w->comp_spawninfo, components_keys[j], ent);
+        }
 
-    if (!storage) {
-        return;
+        _free_spawninfo_ent(&w->obj_spawninfo, ent_obj, ent);
     }
+}
 
-    uint32_t idx = _entity_data_idx(w, ent);
+// Fill n free slots in chunk, component data is written per column.
+// Init value is broadcast, columns are copied from column_first entity.
+static void _chunk_fill(world_instance_t *w,
+                        archetype_t *storage,
+                        ent_chunk_t *chunk,
+                        const ct_entity_t0 *ents,
+                        uint32_t n,
+                        const void **init,
+                        const uint8_t **columns,
+                        uint32_t column_first) {
+    const uint32_t first = chunk->ent_n;
+    chunk->ent_n += n;
+
+    memcpy(_get_entity_array(chunk) + first, ents, sizeof(ct_entity_t0) * n);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t idx = handler_idx(ents[i].h);
+        w->entity_idx[idx] = first + i;
+        w->entity_chunk[idx] = chunk;
+    }
 
-    if (new_type.mask) {
-        _add_to_archetype(w, ent, new_type);
-        _move_data_from_archetype(w, ent, chunk, idx, chunk->archetype_mask, new_type);
+    if (storage->event_arrive) {
+        _event_set(w, storage, chunk, first, n, storage->event_arrive);
     }
 
-    _remove_from_archetype(w, ent, idx, chunk, chunk->archetype_mask);
+    for (uint32_t i = 0; i < storage->component_n; ++i) {
+        _stamp_version(storage, chunk, i, first, n, w->global_system_version);
 
-    if (!new_type.mask) {
-        if (storage->has_system_state) {
-            ce_handler_destroy(&w->entity_handler, ent.h, _G.allocator);
+        uint32_t size = storage->size[i];
+        if (!size) {
+            continue;
         }
-    }
-}
 
+        uint8_t *data = _get_component_array(storage, chunk, i);
+        data += first * size;
 
-static void _execute_cmd(ce_mpmc_queue_t0 *buffer) {
-    cmd_t cmd;
-    while (ce_mpmc_dequeue(buffer, &cmd)) {
-        if (cmd.type == ADD_COMPONENT_CMD) {
-            add_component_t *add_cmd = &cmd.add;
-            add_components(add_cmd->world, add_cmd->ent,
-                           (ct_component_pair_t0[]) {
-                                   {
-                                           .type = add_cmd->component_type,
-                                           .data = add_cmd->data
-                                   }
-                           }, 1);
+        if (columns && columns[i]) {
+            memcpy(data, columns[i] + (column_first * size), size * n);
+            continue;
+        }
 
-            if (add_cmd->data) {
-                CE_FREE(_G.allocator, add_cmd->data);
-            }
-        } else if (cmd.type == REMOVE_COMPONENT_CMD) {
-            remove_components_t *remove_cmd = &cmd.remove;
-            remove_components(remove_cmd->world, remove_cmd->ent,
-                              remove_cmd->components, remove_cmd->n);
+        if (!init || !init[i]) {
+            memset(data, 0, size * n);
+            continue;
+        }
 
-            CE_FREE(_G.allocator, remove_cmd->components);
+        // Broadcast init value, copied block doubles every step.
+        memcpy(data, init[i], size);
+        uint32_t done = 1;
+        while (done < n) {
+            uint32_t copy_n = done < (n - done) ? done : (n - done);
+            memcpy(data + (done * size), data, copy_n * size);
+            done += copy_n;
         }
     }
 }
 
-typedef struct process_data_t {
-    ct_world_t0 world;
-    ct_entity_t0 *ents;
-    ct_ecs_ent_chunk_o0 *chunk;
-    uint64_t count;
-    void *data;
-    ct_ecs_foreach_fce_t fce;
-} process_data_t;
+// Place entities to chunks with shared values, free space first.
+static void _archetype_fill(world_instance_t *w,
+                            archetype_t *storage,
+                            const uint8_t *shared,
+                            const ct_entity_t0 *ents,
+                            uint32_t count,
+                            const void **init,
+                            const uint8_t **columns) {
+    uint64_t shared_hash = _shared_hash(storage, shared);
 
-static void _process_task(void *data) {
-    process_data_t *pdata = data;
-    pdata->fce(pdata->world, pdata->ents, pdata->chunk, pdata->count, pdata->data);
-}
+    uint32_t done = 0;
 
-static bool _can_run_query_on_archetype(ct_archemask_t0 mask,
-                                        const ct_ecs_query_t0 *query) {
-    if (query->all.mask) {
-        if (!_archetype_all(mask, query->all)) {
-            return false;
+    // Free space in existing chunks
+    ent_chunk_t *chunk = storage->first;
+    while (chunk && (done < count)) {
+        uint32_t free_n = storage->max_ent - chunk->ent_n;
+        if (free_n && _chunk_has_shared(storage, chunk, shared, shared_hash)) {
+            uint32_t n = free_n < (count - done) ? free_n : (count - done);
+            _chunk_fill(w, storage, chunk, ents + done, n, init, columns, done);
+            done += n;
         }
-    }
 
-    if (query->none.mask) {
-        if (!_archetype_none(mask, query->none)) {
-            return false;
-        }
+        chunk = chunk->next;
     }
 
-    if (query->any.mask) {
-        if (_archetype_any(mask, query->any) == 0) {
-            return false;
-        }
-    }
+    while (done < count) {
+        chunk = _new_archetype_chunk(w, storage, shared, shared_hash);
 
-    return true;
+        uint32_t n = storage->max_ent < (count - done) ? storage->max_ent
+                                                       : (count - done);
+        _chunk_fill(w, storage, chunk, ents + done, n, init, columns, done);
+        done += n;
+    }
 }
 
-static bool chunk_changed(uint32_t version,
-                          uint32_t rq_version) {
-    if (!rq_version) {
-        return true;
+static void create_batch(ct_world_t0 world,
+                         ct_archemask_t0 archetype,
+                         uint32_t count,
+                         ct_entity_t0 *out,
+                         const ct_component_pair_t0 *init_data,
+                         uint32_t init_data_n) {
+    if (!count) {
+        return;
     }
 
-    return (int32_t)(version - rq_version) > 0;
-}
+    world_instance_t *w = get_world_instance(world);
 
-static bool _need_process_chunk(archetype_t *storage,
-                                ent_chunk_t *chunk,
-                                const ct_ecs_query_t0 *query,
-                                uint64_t rq_version,
-                                world_instance_t *w) {
-    uint32_t ent_n = chunk->ent_n;
+    ce_handler_create_n(&w->entity_handler, (uint64_t *) out, count, _G.allocator);
 
-    if (!ent_n) {
-        return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t idx = handler_idx(out[i].h);
+
+        w->entity_obj[idx] = 0;
+        w->entity_chunk[idx] = NULL;
+    }
+
+    for (uint32_t i = 0; i < init_data_n; ++i) {
+        _mask_set(&archetype, init_data[i].type);
     }
 
-    ct_archemask_t0 used_components = _archetype_add(query->all, query->any);
+    if (_archetype_empty(archetype)) {
+        return;
+    }
 
-    if (query->only_changed) {
-        bool chunk_comp_changed = false;
-        for (int j = 0; j < storage->component_n; ++j) {
-            uint64_t comp_name = storage->name[j];
-            ct_archemask_t0 comp_mask = component_mask(comp_name);
+    archetype_t *storage = _get_or_create_archetype(w, archetype);
 
-            if (!_archetype_any(used_components, comp_mask)) {
-                continue;
-            }
+    const void *init[storage->component_n];
+    memset(init, 0, sizeof(init));
 
-            if (_archetype_none(query->write, comp_mask)) {
-                chunk_comp_changed |= chunk_changed(chunk->version[j], rq_version);
-            }
+    uint8_t *shared = _build_shared(w, storage, NULL);
+
+    for (uint32_t i = 0; i < init_data_n; ++i) {
+        uint64_t comp_idx = component_idx(storage, init_data[i].type);
+        if (comp_idx == UINT64_MAX) {
+            continue;
         }
 
-        if (!chunk_comp_changed) {
-            return false;
+        uint32_t shared_offset = storage->shared_offset[comp_idx];
+        if (shared_offset && init_data[i].data) {
+            memcpy(shared + (shared_offset - storage->shared_begin), init_data[i].data,
+                   get_interface(init_data[i].type)->size);
+            continue;
         }
+
+        init[comp_idx] = init_data[i].data;
     }
 
-    // Update version for write component.
-    for (int j = 0; j < storage->component_n; ++j) {
-        uint64_t comp_name = storage->name[j];
-        ct_archemask_t0 comp_mask = component_mask(comp_name);
+    _archetype_fill(w, storage, shared, out, count, init, NULL);
+}
 
-        if (_archetype_any(query->write, comp_mask)) {
-            chunk->version[j] = rq_version;
-        }
+static bool _can_destroy_fast(world_instance_t *w,
+                              ct_entity_t0 ent) {
+    if (_entity_obj(w, ent)) {
+        return false;
     }
 
-    return true;
+    ent_chunk_t *chunk = _entity_chunk(w, ent);
+    if (!chunk) {
+        return true;
+    }
+
+    archetype_t *storage = &w->archetype_pool[chunk->archetype_idx];
+    return !storage->has_system_state
+           && !_mask_has(chunk->archetype_mask, CT_CHILD_COMPONENT);
 }
 
-static void process_query(ct_world_t0 world,
-                          ct_ecs_query_t0 query,
-                          uint32_t rq_version,
-                          ct_ecs_foreach_fce_t fce,
-                          void *data) {
+// Entities without obj, children and system state are removed directly and
+// handles are freed per run, rest goes through destroy.
+static void destroy_batch(ct_world_t0 world,
+                          ct_entity_t0 *entity,
+                          uint32_t count) {
     world_instance_t *w = get_world_instance(world);
 
-    const uint32_t type_count = ce_array_size(w->archetype_array);
-
-    ce_task_item_t0 *tasks = NULL;
-    process_data_t *task_data = NULL;
-
-    for (int i = 0; i < type_count; ++i) {
-        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
+    uint32_t run_begin = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        ct_entity_t0 ent = entity[i];
 
-        ent_chunk_t *chunk = storage->first;
+        if (!_can_destroy_fast(w, ent)) {
+            ce_handler_destroy_n(&w->entity_handler, (uint64_t *) (entity + run_begin),
+                                 i - run_begin, _G.allocator);
+            run_begin = i + 1;
 
-        if (!_can_run_query_on_archetype(storage->archetype_mask, &query)) {
+            destroy(world, &entity[i], 1);
             continue;
         }
 
-        while (chunk) {
-            if (!_need_process_chunk(storage, chunk, &query, rq_version, w)) {
-                chunk = chunk->next;
-                continue;
-            }
+        ent_chunk_t *chunk = _entity_chunk(w, ent);
+        if (chunk) {
+            _remove_from_archetype(w, ent, _entity_data_idx(w, ent),
+                                   chunk, chunk->archetype_mask);
+            _entity_chunk(w, ent) = NULL;
+        }
+    }
 
-            ct_entity_t0 *ents = _get_entity_array(chunk);
+    ce_handler_destroy_n(&w->entity_handler, (uint64_t *) (entity + run_begin),
+                         count - run_begin, _G.allocator);
+}
 
-            uint32_t idx = ce_array_size(task_data);
-            ce_array_push(task_data, ((process_data_t) {
-                    .world = world,
-                    .ents = ents,
-                    .chunk = (ct_ecs_ent_chunk_o0 *) chunk,
-                    .count = chunk->ent_n,
-                    .data = data,
-                    .fce = fce,
-            }), _G.allocator);
+static uint64_t cdb_type() {
+    return ENTITY_RESOURCE_ID;
+}
 
-            ce_array_push(tasks, ((ce_task_item_t0) {
-                    .data = &task_data[idx],
-                    .name = "ecs_process",
-                    .work = _process_task
-            }), _G.allocator);
+static struct ct_entity_t0 spawn_entity_live(ct_world_t0 world,
+                                             uint64_t name);
 
-            chunk = chunk->next;
-        }
-    }
+static struct ct_entity_t0 load(uint64_t resource,
+                                ct_world_t0 world) {
 
-    ce_task_counter_t0 *counter = NULL;
-    ce_task_a0->add(tasks, ce_array_size(tasks), &counter);
-    ce_task_a0->wait_for_counter(counter, 0);
+    ct_entity_t0 ent = spawn_entity_live(world, resource);
 
-    ce_array_free(task_data, _G.allocator);
-    ce_array_free(tasks, _G.allocator);
+    return ent;
 }
 
 
-static void process_query_serial(ct_world_t0 world,
-                                 ct_ecs_query_t0 query,
-                                 uint32_t rq_version,
-                                 ct_ecs_foreach_fce_t fce,
-                                 void *data) {
-    world_instance_t *w = get_world_instance(world);
+void *get_resource_interface(uint64_t name_hash) {
+    static struct ct_resource_preview_i0 ct_resource_preview_i0 = {
+            .load = load,
+    };
 
-    const uint32_t type_count = ce_array_size(w->archetype_array);
+    if (name_hash == RESOURCE_PREVIEW_I) {
+        return &ct_resource_preview_i0;
+    };
 
-    for (int i = 0; i < type_count; ++i) {
-        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
+    return NULL;
+}
 
-        ent_chunk_t *chunk = storage->first;
+static const char *display_icon() {
+    return ICON_FA_CUBES;
+}
 
-        if (!_can_run_query_on_archetype(storage->archetype_mask, &query)) {
-            continue;
-        }
+static const char *name() {
+    return "entity";
+}
 
-        while (chunk) {
-            if (!_need_process_chunk(storage, chunk, &query, rq_version, w)) {
-                chunk = chunk->next;
-                continue;
-            }
+// PREFAB
 
-            ct_entity_t0 *ents = _get_entity_array(chunk);
+// Compiled entity tree: header | groups | components | parents | data.
+// Entities are ordered by group, group is archetype with same shared values.
+#define PREFAB_VERSION 1
 
-            fce(world, ents, (ct_ecs_ent_chunk_o0 *) chunk, chunk->ent_n, data);
+typedef struct prefab_header_t {
+    uint32_t version;
+    uint32_t ent_n;
+    uint32_t root;
+    uint32_t group_n;
+    // int32_t parent[ent_n], -1 = no parent
+    uint32_t parent_offset;
+    uint32_t size;
+} prefab_header_t;
+
+typedef struct prefab_group_t {
+    uint32_t first;
+    uint32_t ent_n;
+    uint32_t comp_n;
+    uint32_t comp_offset;
+} prefab_group_t;
 
-            chunk = chunk->next;
-        }
-    }
+typedef struct prefab_component_t {
+    uint64_t type;
+    uint32_t size;
+    uint32_t is_shared;
+    // Shared one value, other ent_n values. 0 = zero data
+    uint32_t data_offset;
+    uint32_t _pad;
+} prefab_component_t;
+
+typedef struct prefab_ent_t {
+    uint64_t obj;
+    int32_t parent;
+    uint32_t group;
+    // Sorted types and values with same order
+    uint32_t type_first;
+    uint32_t type_n;
+    uint32_t value_first;
+    uint64_t key;
+} prefab_ent_t;
+
+typedef struct prefab_builder_t {
+    ce_cdb_t0 db;
+    prefab_ent_t *ents;
+    uint64_t *types;
+    uint8_t *values;
+    uint32_t *groups;
+} prefab_builder_t;
+
+static int _cmp_type(const void *a,
+                     const void *b) {
+    uint64_t t1 = *(const uint64_t *) a;
+    uint64_t t2 = *(const uint64_t *) b;
+    return t1 < t2 ? -1 : (t1 > t2);
 }
 
-uint64_t _get_component_obj(world_instance_t *world,
-                            uint64_t obj) {
-    if (ce_hash_lookup(&world->component_obj_map, obj, 0)) {
-        return obj;
-    }
+static uint32_t _prefab_value_size(uint64_t type) {
+    return _align_up(get_interface(type)->size, sizeof(uint64_t));
+}
 
-    uint64_t parent = ce_cdb_a0->parent(ce_cdb_a0->db(), obj);
-    if (!parent) {
-        return 0;
+static bool _prefab_ent_eq(prefab_builder_t *b,
+                           const prefab_ent_t *e1,
+                           const prefab_ent_t *e2) {
+    if ((e1->key != e2->key) || (e1->type_n != e2->type_n)) {
+        return false;
     }
 
-    return _get_component_obj(world, parent);
-}
+    if (memcmp(b->types + e1->type_first, b->types + e2->type_first,
+               sizeof(uint64_t) * e1->type_n)) {
+        return false;
+    }
 
-spawn_info_t *_get_component_spawninfo(world_instance_t *world,
-                                       uint64_t obj) {
-    spawn_info_t *si = _get_spawninfo(&world->comp_spawninfo, obj);
+    uint32_t v1 = e1->value_first;
+    uint32_t v2 = e2->value_first;
+    for (uint32_t i = 0; i < e1->type_n; ++i) {
+        uint64_t type = b->types[e1->type_first + i];
+        uint32_t size = _prefab_value_size(type);
 
-    if (si) {
-        return si;
-    }
+        if (get_interface(type)->is_shared && memcmp(b->values + v1, b->values + v2, size)) {
+            return false;
+        }
 
-    uint64_t parent = ce_cdb_a0->parent(ce_cdb_a0->db(), obj);
-    if (!parent) {
-        return 0;
+        v1 += size;
+        v2 += size;
     }
 
-    return _get_component_spawninfo(world, parent);
+    return true;
 }
 
-static void _build_graphs() {
-    ce_hash_clean(&_G.system_map);
-    ce_hash_clean(&_G.system_group_map);
-    ce_hash_clean(&_G.system_group_g_map);
-
-    uint64_t *graphs = NULL;
+// Read entity and children, false if some component can not be compiled.
+static bool _prefab_add_ent(prefab_builder_t *b,
+                            uint64_t obj,
+                            int32_t parent) {
+    const ce_cdb_obj_o0 *r = ce_cdb_a0->read(b->db, obj);
+    if (!r) {
+        return false;
+    }
 
-    ce_api_entry_t0 it = ce_api_a0->first(CT_ECS_SYSTEM_GROUP_I);
-    while (it.api) {
-        ct_system_group_i0 *i = (it.api);
+    uint64_t components_n = ce_cdb_a0->read_objset_num(r, ENTITY_COMPONENTS);
+    uint64_t components_keys[components_n];
+    ce_cdb_a0->read_objset(r, ENTITY_COMPONENTS, components_keys);
 
-        uint64_t name = i->name;
+    prefab_ent_t ent = {
+            .obj = obj,
+            .parent = parent,
+            .type_first = ce_array_size(b->types),
+            .value_first = ce_array_size(b->values),
+    };
 
-        ce_hash_add(&_G.system_group_map, name, (uint64_t) i, _G.allocator);
+    for (uint32_t i = 0; i < components_n; ++i) {
+        uint64_t type = ce_cdb_a0->obj_type(b->db, components_keys[i]);
+        ct_ecs_component_i0 *ci = get_interface(type);
 
-        uint64_t graph_idx = ce_hash_lookup(&_G.system_group_g_map, name, UINT64_MAX);
-        if (UINT64_MAX == graph_idx) {
-            graph_idx = _new_graph();
-            ce_hash_add(&_G.system_group_g_map, name, graph_idx, _G.allocator);
-            ce_array_push(graphs, graph_idx, _G.allocator);
+        if (!ci || ci->no_prefab) {
+            return false;
         }
 
-        if (i->group) {
-            uint64_t group_graph_idx = ce_hash_lookup(&_G.system_group_g_map, i->group, UINT64_MAX);
-            if (group_graph_idx == UINT64_MAX) {
-                group_graph_idx = _new_graph();
-                ce_hash_add(&_G.system_group_g_map, i->group, group_graph_idx, _G.allocator);
-                ce_array_push(graphs, group_graph_idx, _G.allocator);
-            }
-
-            ce_ba_graph_t *g = &_G.graph_pool[group_graph_idx];
+        ce_array_push(b->types, type, _G.allocator);
+    }
 
-            ce_bag_add(g, name,
-                       i->before.ptr, i->before.len,
-                       i->after.ptr, i->after.len,
-                       _G.allocator);
+    if (parent >= 0) {
+        if (!get_interface(CT_PARENT_COMPONENT)) {
+            return false;
         }
 
-        it = ce_api_a0->next(it);
+        ce_array_push(b->types, CT_PARENT_COMPONENT, _G.allocator);
     }
 
-    it = ce_api_a0->first(CT_ECS_SYSTEM_I);
-    while (it.api) {
-        struct ct_system_i0 *i = (it.api);
+    ent.type_n = ce_array_size(b->types) - ent.type_first;
+    qsort(b->types + ent.type_first, ent.type_n, sizeof(uint64_t), _cmp_type);
 
-        uint64_t name = i->name;
+    // Values in type order
+    for (uint32_t i = 0; i < ent.type_n; ++i) {
+        uint64_t type = b->types[ent.type_first + i];
+        ct_ecs_component_i0 *ci = get_interface(type);
 
-        ce_hash_add(&_G.system_map, name, (uint64_t) i, _G.allocator);
+        uint32_t offset = ce_array_size(b->values);
+        ce_array_resize(b->values, offset + _prefab_value_size(type), _G.allocator);
+        memset(b->values + offset, 0, _prefab_value_size(type));
 
-        if (!i->group) {
-            i->group = CT_ECS_SIMULATION_GROUP;
+        if (!ci->from_cdb_obj || !ci->size) {
+            continue;
         }
-
-        uint64_t graph_idx = ce_hash_lookup(&_G.system_group_g_map, i->group, UINT64_MAX);
-        if (graph_idx != UINT64_MAX) {
-            ce_ba_graph_t *g = &_G.graph_pool[graph_idx];
-            ce_bag_add(g, name,
-                       i->before.ptr, i->before.len,
-                       i->after.ptr, i->after.len,
-                       _G.allocator);
+
+        for (uint32_t j = 0; j < components_n; ++j) {
+            if (ce_cdb_a0->obj_type(b->db, components_keys[j]) == type) {
+                ci->from_cdb_obj((ct_world_t0) {}, b->db, components_keys[j],
+                                 b->values + offset);
+                break;
+            }
         }
+    }
 
+    // Key from archetype and shared values
+    ent.key = ce_hash_murmur2_64(b->types + ent.type_first,
+                                 sizeof(uint64_t) * ent.type_n, 0);
 
-        it = ce_api_a0->next(it);
-    }
+    uint32_t value = ent.value_first;
+    for (uint32_t i = 0; i < ent.type_n; ++i) {
+        uint64_t type = b->types[ent.type_first + i];
+        uint32_t size = _prefab_value_size(type);
 
-    uint64_t graph_n = ce_array_size(graphs);
-    for (uint64_t j = 0; j < graph_n; ++j) {
-        ce_ba_graph_t *g = &_G.graph_pool[graphs[j]];
-        ce_bag_build(g, _G.allocator);
+        if (get_interface(type)->is_shared) {
+            ent.key = ce_hash_murmur2_64(b->values + value, size, ent.key);
+        }
+
+        value += size;
     }
 
-    ce_array_free(graphs, _G.allocator);
-}
+    int32_t ent_idx = ce_array_size(b->ents);
+    ce_array_push(b->ents, ent, _G.allocator);
 
-static void _process_group(ct_world_t0 world,
-                           uint64_t group_name,
-                           float dt) {
-    world_instance_t *w = get_world_instance(world);
+    uint64_t children_n = ce_cdb_a0->read_objset_num(r, ENTITY_CHILDREN);
+    uint64_t keys[children_n];
+    ce_cdb_a0->read_objset(r, ENTITY_CHILDREN, keys);
 
-    uint64_t group_graph = ce_hash_lookup(&_G.system_group_g_map, group_name, UINT64_MAX);
-    if (group_graph == UINT64_MAX) {
-        return;
+    for (uint32_t i = 0; i < children_n; ++i) {
+        if (!_prefab_add_ent(b, keys[i], ent_idx)) {
+            return false;
+        }
     }
 
-    ce_ba_graph_t *g = &_G.graph_pool[group_graph];
-    uint64_t *outputs = g->output;
+    return true;
+}
 
-    const uint64_t systems_n = ce_array_size(outputs);
-    for (int i = 0; i < systems_n; ++i) {
-        ct_system_i0 *sys = (ct_system_i0 *) ce_hash_lookup(&_G.system_map, outputs[i], 0);
+static void _prefab_builder_free(prefab_builder_t *b) {
+    ce_array_free(b->ents, _G.allocator);
+    ce_array_free(b->types, _G.allocator);
+    ce_array_free(b->values, _G.allocator);
+    ce_array_free(b->groups, _G.allocator);
+}
 
-        ct_system_group_i0 *sysg = (ct_system_group_i0 *) ce_hash_lookup(&_G.system_group_map,
-                                                                         outputs[i], 0);
+// Build prefab blob for entity tree, NULL if tree can not be compiled.
+static uint8_t *_build_prefab(ce_cdb_t0 db,
+                              uint64_t obj) {
+    prefab_builder_t b = {.db = db};
 
-        if (sys) {
-            uint32_t cmd_buf_idx = _new_cmd_buff();
-            ce_mpmc_queue_t0 *buff = &_G.cmd_buf_pool[cmd_buf_idx];
+    if (!_prefab_add_ent(&b, obj, -1)) {
+        _prefab_builder_free(&b);
+        return NULL;
+    }
 
-            w->global_system_version++;
-            if (w->global_system_version == 0) {
-                w->global_system_version++;
-            }
+    const uint32_t ent_n = ce_array_size(b.ents);
 
-            uint32_t rq_version = ce_hash_lookup(&w->last_system_version, outputs[i], 0);
+    // Group entities, group is represented by first entity.
+    for (uint32_t i = 0; i < ent_n; ++i) {
+        prefab_ent_t *ent = &b.ents[i];
 
-            if (sys->process) {
-                sys->process(w->world, dt, rq_version, (ct_ecs_cmd_buffer_t *) buff);
+        const uint32_t group_n = ce_array_size(b.groups);
+        uint32_t g = 0;
+        for (; g < group_n; ++g) {
+            if (_prefab_ent_eq(&b, &b.ents[b.groups[g]], ent)) {
+                break;
             }
+        }
 
-            ce_hash_add(&w->last_system_version, outputs[i], w->global_system_version,
-                        _G.allocator);
-
-            _execute_cmd(buff);
-            _free_cmd_buff(cmd_buf_idx);
-        } else if (sysg) {
-            _process_group(world, sysg->name, dt);
+        if (g == group_n) {
+            ce_array_push(b.groups, i, _G.allocator);
         }
 
+        ent->group = g;
     }
 
-}
+    const uint32_t group_n = ce_array_size(b.groups);
 
-static void step(ct_world_t0 world,
-                 float dt) {
+    // Layout
+    uint32_t group_ent_n[group_n];
+    uint32_t group_first[group_n];
+    memset(group_ent_n, 0, sizeof(group_ent_n));
 
-    world_instance_t *w = get_world_instance(world);
-    if (w->global_world_version != w->last_world_version) {
-        w->last_world_version = w->global_world_version;
-        _build_graphs();
+    for (uint32_t i = 0; i < ent_n; ++i) {
+        group_ent_n[b.ents[i].group] += 1;
     }
 
-    _process_group(world, CT_ECS_SIMULATION_GROUP, dt);
-    _process_group(world, CT_ECS_PRESENTATION_GROUP, dt);
-}
+    uint32_t size = sizeof(prefab_header_t) + (sizeof(prefab_group_t) * group_n);
+    uint32_t first = 0;
+    for (uint32_t g = 0; g < group_n; ++g) {
+        group_first[g] = first;
+        first += group_ent_n[g];
+        size += sizeof(prefab_component_t) * b.ents[b.groups[g]].type_n;
+    }
 
-static void create_entities(ct_world_t0 world,
-                            struct ct_entity_t0 *entity,
-                            uint32_t count) {
+    const uint32_t parent_offset = size;
+    size = _align_up(size + (sizeof(int32_t) * ent_n), sizeof(uint64_t));
 
-    world_instance_t *w = get_world_instance(world);
+    uint32_t data_offset = size;
+    for (uint32_t g = 0; g < group_n; ++g) {
+        const prefab_ent_t *ent = &b.ents[b.groups[g]];
 
-    for (int i = 0; i < count; ++i) {
-        struct ct_entity_t0 ent = {.h = ce_handler_create(&w->entity_handler,
-                                                          _G.allocator)};
+        for (uint32_t i = 0; i < ent->type_n; ++i) {
+            uint64_t type = b.types[ent->type_first + i];
+            ct_ecs_component_i0 *ci = get_interface(type);
 
-        CE_ASSERT("ecs", ent.h != 0);
+            size += ci->is_shared ? _prefab_value_size(type)
+                                  : _align_up(ci->size * group_ent_n[g], sizeof(uint64_t));
+        }
+    }
 
-        entity[i] = ent;
+    uint8_t *blob = NULL;
+    ce_array_resize(blob, size, _G.allocator);
+    memset(blob, 0, size);
 
-        uint64_t idx = handler_idx(ent.h);
+    // Entity index in prefab
+    uint32_t ent_idx[ent_n];
+    uint32_t group_fill[group_n];
+    memset(group_fill, 0, sizeof(group_fill));
 
-        w->entity_obj[idx] = 0;
-        w->entity_chunk[idx] = NULL;
+    for (uint32_t i = 0; i < ent_n; ++i) {
+        uint32_t g = b.ents[i].group;
+        ent_idx[i] = group_first[g] + group_fill[g]++;
     }
-}
 
-static void create_entities_objs(ct_world_t0 world,
-                                 struct ct_entity_t0 *entity,
-                                 uint32_t count,
-                                 uint64_t *objs) {
+    prefab_header_t *header = (prefab_header_t *) blob;
+    *header = (prefab_header_t) {
+            .version = PREFAB_VERSION,
+            .ent_n = ent_n,
+            .root = ent_idx[0],
+            .group_n = group_n,
+            .parent_offset = parent_offset,
+            .size = size,
+    };
 
-    world_instance_t *w = get_world_instance(world);
+    int32_t *parents = (int32_t *) (blob + parent_offset);
+    for (uint32_t i = 0; i < ent_n; ++i) {
+        int32_t parent = b.ents[i].parent;
+        parents[ent_idx[i]] = (parent < 0) ? -1 : (int32_t) ent_idx[parent];
+    }
 
-    for (int i = 0; i < count; ++i) {
-        struct ct_entity_t0 ent = {.h = ce_handler_create(&w->entity_handler,
-                                                          _G.allocator)};
+    prefab_group_t *groups = (prefab_group_t *) (header + 1);
+    uint32_t comp_offset = sizeof(prefab_header_t) + (sizeof(prefab_group_t) * group_n);
 
-        CE_ASSERT("ecs", ent.h != 0);
+    for (uint32_t g = 0; g < group_n; ++g) {
+        const prefab_ent_t *group_ent = &b.ents[b.groups[g]];
 
-        entity[i] = ent;
+        groups[g] = (prefab_group_t) {
+                .first = group_first[g],
+                .ent_n = group_ent_n[g],
+                .comp_n = group_ent->type_n,
+                .comp_offset = comp_offset,
+        };
 
-        uint64_t idx = handler_idx(ent.h);
+        prefab_component_t *comps = (prefab_component_t *) (blob + comp_offset);
+        comp_offset += sizeof(prefab_component_t) * group_ent->type_n;
 
-        uint64_t obj = objs[i];
-        w->entity_obj[idx] = obj;
-        w->entity_chunk[idx] = NULL;
-    }
-}
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < group_ent->type_n; ++i) {
+            uint64_t type = b.types[group_ent->type_first + i];
+            ct_ecs_component_i0 *ci = get_interface(type);
 
+            comps[i] = (prefab_component_t) {
+                    .type = type,
+                    .size = ci->size,
+                    .is_shared = ci->is_shared,
+            };
 
-static void destroy(ct_world_t0 world,
-                    struct ct_entity_t0 *entity,
-                    uint32_t count) {
-    world_instance_t *w = get_world_instance(world);
+            if (ci->size) {
+                comps[i].data_offset = data_offset;
+
+                if (ci->is_shared) {
+                    memcpy(blob + data_offset, b.values + group_ent->value_first + value,
+                           ci->size);
+                    data_offset += _prefab_value_size(type);
+                } else {
+                    // Column in prefab entity order
+                    for (uint32_t e = 0; e < ent_n; ++e) {
+                        const prefab_ent_t *ent = &b.ents[e];
+                        if (ent->group != g) {
+                            continue;
+                        }
 
-    for (uint32_t i = 0; i < count; ++i) {
-        ct_entity_t0 ent = entity[i];
+                        uint32_t col_idx = ent_idx[e] - group_first[g];
+                        memcpy(blob + data_offset + (col_idx * ci->size),
+                               b.values + ent->value_first + value, ci->size);
+                    }
 
-        uint64_t data_idx = _entity_data_idx(w, ent);
-        ent_chunk_t *chunk = _entity_chunk(w, ent);
+                    data_offset += _align_up(ci->size * group_ent_n[g], sizeof(uint64_t));
+                }
+            }
 
-        ct_child_c *child = get_one(world, CT_CHILD_COMPONENT, ent, false);
+            value += _prefab_value_size(type);
+        }
+    }
 
-        archetype_t *storage = NULL;
-        if (chunk) {
-            storage = _get_archetype(w, chunk->archetype_mask);
-            if ((storage) && storage->has_system_state) {
-                ct_archemask_t0 new_type = {
-                        chunk->archetype_mask.mask & _G.system_state_components_mask};
+    _prefab_builder_free(&b);
+    return blob;
+}
 
-                if (new_type.mask == chunk->archetype_mask.mask) {
-                    continue;
-                }
+// Spawn prefab by archetype bulk fill, false if prefab does not match components.
+static bool _spawn_prefab(world_instance_t *w,
+                          const uint8_t *blob,
+                          uint64_t blob_size,
+                          ct_entity_t0 *root) {
+    const prefab_header_t *header = (const prefab_header_t *) blob;
 
-                _add_to_archetype(w, ent, new_type);
-                _move_data_from_archetype(w, ent, chunk, data_idx, chunk->archetype_mask, new_type);
+    if ((blob_size < sizeof(prefab_header_t))
+        || (header->version != PREFAB_VERSION)
+        || (header->size != blob_size)) {
+        return false;
+    }
+
+    const prefab_group_t *groups = (const prefab_group_t *) (header + 1);
+
+    for (uint32_t g = 0; g < header->group_n; ++g) {
+        const prefab_component_t *comps =
+                (const prefab_component_t *) (blob + groups[g].comp_offset);
+
+        for (uint32_t i = 0; i < groups[g].comp_n; ++i) {
+            ct_ecs_component_i0 *ci = get_interface(comps[i].type);
+
+            if (!ci || (ci->size != comps[i].size) || (ci->is_shared != comps[i].is_shared)) {
+                return false;
             }
-            _remove_from_archetype(w, ent, data_idx, chunk, chunk->archetype_mask);
-        } else {
-            CE_UNUSED(chunk);
         }
+    }
 
-        if (child) {
-            destroy(world, child->child, ce_array_size(child->child));
-        }
+    const uint32_t ent_n = header->ent_n;
 
-        if (storage && !storage->has_system_state) {
-            ce_handler_destroy(&w->entity_handler, ent.h, _G.allocator);
-        }
+    ct_entity_t0 *ents = CE_ALLOC(_G.allocator, ct_entity_t0, sizeof(ct_entity_t0) * ent_n);
+    ce_handler_create_n(&w->entity_handler, (uint64_t *) ents, ent_n, _G.allocator);
 
-        uint64_t ent_obj = _entity_obj(w, ent);
+    for (uint32_t i = 0; i < ent_n; ++i) {
+        uint64_t idx = handler_idx(ents[i].h);
 
-        const ce_cdb_obj_o0 *r = ce_cdb_a0->read(ce_cdb_a0->db(), ent_obj);
-        uint64_t components_n = ce_cdb_a0->read_objset_num(r, ENTITY_COMPONENTS);
-        uint64_t components_keys[components_n];
-        ce_cdb_a0->read_objset(r, ENTITY_COMPONENTS, components_keys);
-        for (int j = 0; j < components_n; ++j) {
-            _free_spawninfo_ent(&w->comp_spawninfo, components_keys[j], ent);
+        w->entity_obj[idx] = 0;
+        w->entity_chunk[idx] = NULL;
+    }
+
+    for (uint32_t g = 0; g < header->group_n; ++g) {
+        const prefab_group_t *group = &groups[g];
+        const prefab_component_t *comps =
+                (const prefab_component_t *) (blob + group->comp_offset);
+
+        uint64_t types[group->comp_n];
+        for (uint32_t i = 0; i < group->comp_n; ++i) {
+            types[i] = comps[i].type;
         }
 
-        _free_spawninfo_ent(&w->obj_spawninfo, ent_obj, ent);
-    }
-}
+        archetype_t *storage = _get_or_create_archetype(w, combine_component(types,
+                                                                             group->comp_n));
 
-static uint64_t cdb_type() {
-    return ENTITY_RESOURCE_ID;
-}
+        const uint8_t *columns[storage->component_n];
+        memset(columns, 0, sizeof(columns));
 
-static struct ct_entity_t0 spawn_entity(ct_world_t0 world,
-                                        uint64_t name);
+        uint8_t *shared = _build_shared(w, storage, NULL);
 
-static struct ct_entity_t0 load(uint64_t resource,
-                                ct_world_t0 world) {
+        for (uint32_t i = 0; i < group->comp_n; ++i) {
+            if (!comps[i].data_offset) {
+                continue;
+            }
 
-    ct_entity_t0 ent = spawn_entity(world, resource);
+            uint64_t comp_idx = component_idx(storage, comps[i].type);
+            const uint8_t *data = blob + comps[i].data_offset;
 
-    return ent;
-}
+            if (comps[i].is_shared) {
+                memcpy(shared + (storage->shared_offset[comp_idx] - storage->shared_begin),
+                       data, comps[i].size);
+            } else {
+                columns[comp_idx] = data;
+            }
+        }
 
+        _archetype_fill(w, storage, shared, ents + group->first, group->ent_n, NULL, columns);
+    }
 
-void *get_resource_interface(uint64_t name_hash) {
-    static struct ct_resource_preview_i0 ct_resource_preview_i0 = {
-            .load = load,
-    };
+    const int32_t *parents = (const int32_t *) (blob + header->parent_offset);
+    for (uint32_t i = 0; i < ent_n; ++i) {
+        if (parents[i] < 0) {
+            continue;
+        }
 
-    if (name_hash == RESOURCE_PREVIEW_I) {
-        return &ct_resource_preview_i0;
-    };
+        ct_parent_c *parent = get_one(w->world, CT_PARENT_COMPONENT, ents[i], true);
+        parent->parent = ents[parents[i]];
+    }
 
-    return NULL;
-}
+    *root = ents[header->root];
 
-static const char *display_icon() {
-    return ICON_FA_CUBES;
+    CE_FREE(_G.allocator, ents);
+    return true;
 }
 
-static const char *name() {
-    return "entity";
-}
+static bool compilator(ce_cdb_t0 db,
+                       uint64_t obj) {
+    uint8_t *blob = _build_prefab(db, obj);
+
+    if (!blob) {
+        ce_log_a0->debug(LOG_WHERE,
+                         "Entity 0x%" PRIx64 " has component without prefab "
+                         "support, spawn falls back to cdb", obj);
+        return true;
+    }
 
-static bool compilator(ce_cdb_t0 db, uint64_t obj){
+    ce_cdb_obj_o0 *writer = ce_cdb_a0->write_begin(db, obj);
+    ce_cdb_a0->set_blob(writer, ENTITY_PREFAB, blob, ce_array_size(blob));
+    ce_cdb_a0->write_commit(writer);
+
+    ce_array_free(blob, _G.allocator);
     return true;
 }
 
@@ -1550,6 +4958,25 @@ static struct ct_entity_t0 spawn_entity(ct_world_t0 world,
         return (ct_entity_t0) {0};
     }
 
+    const ce_cdb_obj_o0 *reader = ce_cdb_a0->read(ce_cdb_a0->db(), name);
+
+    uint64_t blob_size = 0;
+    const uint8_t *blob = ce_cdb_a0->read_blob(reader, ENTITY_PREFAB, &blob_size, NULL);
+
+    ct_entity_t0 root = {};
+    if (blob && _spawn_prefab(get_world_instance(world), blob, blob_size, &root)) {
+        return root;
+    }
+
+    return spawn_entity_live(world, name);
+}
+
+static struct ct_entity_t0 spawn_entity_live(ct_world_t0 world,
+                                             uint64_t name) {
+    if (!name) {
+        return (ct_entity_t0) {0};
+    }
+
     ce_cdb_t0 db = ce_cdb_a0->db();
 
     uint64_t entity_obj = name;
@@ -1576,7 +5003,7 @@ static struct ct_entity_t0 spawn_entity(ct_world_t0 world,
 
     archetype_t *storage = _get_archetype(w, ent_type);
 
-    const uint64_t idx = _entity_data_idx(w, root_ent);
+    uint64_t idx = _entity_data_idx(w, root_ent);
     ent_chunk_t *chunk = _entity_chunk(w, root_ent);
 
     for (int i = 0; i < components_n; ++i) {
@@ -1592,7 +5019,12 @@ static struct ct_entity_t0 spawn_entity(ct_world_t0 world,
 
         uint32_t size = storage->size[cidx];
 
-        if (size) {
+        if (ci->is_shared) {
+            _component_from_obj(w, ce_cdb_a0->db(), root_ent, component_type, component_obj);
+
+            idx = _entity_data_idx(w, root_ent);
+            chunk = _entity_chunk(w, root_ent);
+        } else if (size) {
             void *data = _get_component_array(storage, chunk, cidx);
 
             uint8_t *comp_data = data + (idx * size);
@@ -1611,7 +5043,7 @@ static struct ct_entity_t0 spawn_entity(ct_world_t0 world,
 
     for (int i = 0; i < children_n; ++i) {
         uint64_t child = keys[i];
-        ct_entity_t0 child_ent = spawn_entity(world, child);
+        ct_entity_t0 child_ent = spawn_entity_live(world, child);
 
         add_components(world, child_ent,
                        CE_ARR_ARG(((ct_component_pair_t0[]) {
@@ -1662,7 +5094,7 @@ static ct_world_t0 create_world(const char *name) {
 
     w->world = world;
     w->db = ce_cdb_a0->db();
-    w->global_world_version = 1;
+    w->chunk_size = CHUNK_SIZE;
     w->name = ce_memory_a0->str_dup(name, _G.allocator);
 
 
@@ -1678,39 +5110,35 @@ static void query_collect_ents(ct_world_t0 world,
                                ct_entity_t0 **ents,
                                const ce_alloc_t0 *alloc) {
     world_instance_t *w = get_world_instance(world);
+    query_cache_t *cache = _get_query_cache(w, &query);
 
-    const uint32_t type_count = ce_array_size(w->archetype_array);
-
-    for (int i = 0; i < type_count; ++i) {
-        archetype_t *storage = &w->archetype_pool[w->archetype_array[i]];
-
-        ent_chunk_t *chunk = storage->first;
+    const uint32_t match_n = ce_array_size(cache->matches);
+    for (uint32_t i = 0; i < match_n; ++i) {
+        ent_chunk_t *chunk = w->archetype_pool[cache->matches[i].archetype_idx].first;
 
-        if (!_can_run_query_on_archetype(storage->archetype_mask, &query)) {
-            continue;
+        while (chunk) {
+            ce_array_push_n(*ents, _get_entity_array(chunk), chunk->ent_n, alloc);
+            chunk = chunk->next;
         }
-
-        ce_array_push_n(*ents, ents, chunk->ent_n, alloc);
     }
 }
 
 static ct_entity_t0 query_get_first(ct_world_t0 world,
                                     ct_ecs_query_t0 query) {
     world_instance_t *w = get_world_instance(world);
+    query_cache_t *cache = _get_query_cache(w, &query);
 
-    const uint32_t type_count = ce_array_size(w->archetype_pool);
+    const uint32_t match_n = ce_array_size(cache->matches);
+    for (uint32_t i = 0; i < match_n; ++i) {
+        ent_chunk_t *chunk = w->archetype_pool[cache->matches[i].archetype_idx].first;
 
-    for (int i = 0; i < type_count; ++i) {
-        archetype_t *storage = &w->archetype_pool[i];
-
-        ent_chunk_t *chunk = storage->first;
+        while (chunk) {
+            if (chunk->ent_n) {
+                return _get_entity_array(chunk)[0];
+            }
 
-        if (!_can_run_query_on_archetype(storage->archetype_mask, &query)) {
-            continue;
+            chunk = chunk->next;
         }
-
-        ct_entity_t0 *ents = _get_entity_array(chunk);
-        return ents[0];
     }
 
     return (ct_entity_t0) {0};
@@ -1721,10 +5149,17 @@ static struct ct_ecs_a0 _api = {
         .create_world = create_world,
         .destroy_world = destroy_world,
         .step = step,
+        .step_worlds = step_worlds,
 
         .buff_add_component = add_buff,
         .buff_remove_component = remove_buff,
 
+        .set_chunk_size = set_chunk_size,
+        .compact = compact,
+        .world_stats = world_stats,
+        .snapshot = snapshot,
+        .restore = restore,
+
 };
 
 
@@ -1734,8 +5169,11 @@ static struct ct_ecs_e_a0 e_api = {
         // ENTITY
         .create_entities = create_entities,
         .destroy_entities = destroy,
+        .create_batch = create_batch,
+        .destroy_batch = destroy_batch,
         .entity_alive = alive,
         .spawn_entity = spawn_entity,
+        .spawn_entity_live = spawn_entity_live,
 };
 
 struct ct_ecs_e_a0 *ct_ecs_e_a0 = &e_api;
@@ -1746,6 +5184,8 @@ static struct ct_ecs_c_a0 c_api = {
         .combine_component = combine_component,
         .get_all = get_all,
         .get_one = get_one,
+        .get_shared = get_shared,
+        .set_shared = set_shared,
         .add = add_components,
         .remove = remove_components,
 };
@@ -1784,23 +5224,105 @@ static void _on_api_add(uint64_t name,
                     (uint64_t) component_i, _G.allocator);
 
         if (!contian) {
+            if (_G.component_count >= CT_ECS_MAX_COMPONENTS) {
+                ce_log_a0->error(LOG_WHERE, "component limit %d reached",
+                                 CT_ECS_MAX_COMPONENTS);
+                return;
+            }
+
             const uint64_t cid = _G.component_count++;
             ce_hash_add(&_G.component_types, component_i->cdb_type, cid, _G.allocator);
             ce_array_push(_G.components_name, component_i->cdb_type, _G.allocator);
             if (component_i->is_system_state) {
-                _G.system_state_components_mask |= (uint64_t) (1llu << cid);
+                _mask_set(&_G.system_state_components_mask, component_i->cdb_type);
             }
+
+            // System access masks need rebuild
+            _G.graph_version++;
         }
 
     } else if (CT_ECS_SYSTEM_I == name) {
-        uint32_t n = ce_array_size(_G.world_array);
-        for (int i = 0; i < n; ++i) {
-            _G.world_array[i].global_world_version++;
-        }
+        _G.graph_version++;
     }
 }
 
 
+// Entity prop events come from one db wide queue, only subscribed objects
+// are looked up so cost scale with changes not with spawned objects.
+static void _sync_ent_obj_event(world_instance_t *world,
+                                ce_cdb_t0 db,
+                                spawn_info_t *si,
+                                const ce_cdb_prop_ev_t0 *ev) {
+    if (ev->prop == ENTITY_CHILDREN) {
+        if (ev->ev_type == CE_CDB_OBJSET_ADD_EVENT) {
+            uint64_t ent_obj = ev->new_value.subobj;
+
+            uint64_t ents_n = ce_array_size(si->ents);
+            for (int e = 0; e < ents_n; ++e) {
+                ct_entity_t0 ent = si->ents[e];
+                ct_entity_t0 new_ents = spawn_entity_live(world->world, ent_obj);
+
+                add_components(world->world, new_ents,
+                               CE_ARR_ARG(((ct_component_pair_t0[]) {
+                                       {
+                                               .type = CT_PARENT_COMPONENT,
+                                               .data = &(ct_parent_c) {
+                                                       .parent = ent,
+                                               }
+                                       }
+                               })));
+
+            }
+
+        } else if (ev->ev_type == CE_CDB_PROP_MOVE_EVENT) {
+            uint64_t ent_obj = ev->value.subobj;
+            uint64_t to_ent_obj = ev->to;
+
+            spawn_info_t *to_si = _get_spawninfo(&world->obj_spawninfo, to_ent_obj);
+            if (!to_si) {
+                return;
+            }
+
+            spawn_info_t *ent_si = _get_spawninfo(&world->obj_spawninfo, ent_obj);
+            if (!ent_si) {
+                return;
+            }
+
+            for (int j = 0; j < ce_array_size(to_si->ents); ++j) {
+                ct_entity_t0 to_ent = to_si->ents[j];
+                ct_entity_t0 ent = ent_si->ents[j];
+
+                add_components(world->world, ent,
+                               CE_ARR_ARG(((ct_component_pair_t0[]) {
+                                       {
+                                               .type = CT_PARENT_COMPONENT,
+                                               .data = &(ct_parent_c) {
+                                                       .parent = to_ent,
+                                               }
+                                       }
+                               })));
+            }
+        }
+    } else if (ev->prop == ENTITY_COMPONENTS) {
+        if (ev->ev_type == CE_CDB_OBJSET_ADD_EVENT) {
+            uint64_t comp_obj = ev->new_value.subobj;
+            uint64_t k = ce_cdb_a0->obj_type(db, comp_obj);
+
+            uint64_t ents_n = ce_array_size(si->ents);
+            for (int e = 0; e < ents_n; ++e) {
+                ct_entity_t0 ent = si->ents[e];
+                ent_chunk_t *chunk = _entity_chunk(world, ent);
+
+                if (chunk && _mask_has(chunk->archetype_mask, k)) {
+                    continue;
+                }
+
+                _add_components_from_obj(world, db, ent, comp_obj);
+            }
+        }
+    }
+}
+
 static void _sync_task(float dt) {
 //    return;
     uint32_t wn = ce_array_size(_G.world_array);
@@ -1808,6 +5330,25 @@ static void _sync_task(float dt) {
 
     ce_cdb_t0 db = ce_cdb_a0->db();
 
+    // entity props
+    ce_cdb_prop_ev_t0 prop_ev = {};
+    while (ce_cdb_a0->pop_objs_events(_G.obj_queue, &prop_ev)) {
+        if ((prop_ev.prop != ENTITY_CHILDREN) && (prop_ev.prop != ENTITY_COMPONENTS)) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < wn; ++i) {
+            struct world_instance_t *world = &_G.world_array[i];
+            spawn_info_t *si = _get_spawninfo(&world->obj_spawninfo, prop_ev.obj);
+
+            if (!si) {
+                continue;
+            }
+
+            _sync_ent_obj_event(world, db, si, &prop_ev);
+        }
+    }
+
     // changed
     ce_cdb_ev_t0 objs_ev = {};
     while (ce_cdb_a0->pop_changed_obj(_G.changed_obj_queue, &objs_ev)) {
@@ -1859,94 +5400,9 @@ static void _sync_task(float dt) {
         } else if (objs_ev.ev_type == CE_CDB_OBJ_CHANGE_EVENT) {
             uint64_t type = ce_cdb_a0->obj_type(db, objs_ev.obj);
 
-            // is entity?
+            // entity changes come from prop events
             if (type == ENTITY_INSTANCE) {
-                for (uint32_t i = 0; i < wn; ++i) {
-                    struct world_instance_t *world = &_G.world_array[i];
-                    spawn_info_t *si = _get_spawninfo(&world->obj_spawninfo, objs_ev.obj);
-
-                    if (!si) {
-                        continue;
-                    }
-
-                    ce_cdb_prop_ev_t0 ev = {};
-                    while (ce_cdb_a0->pop_obj_events(si->ev_queue, &ev)) {
-                        if (ev.prop == ENTITY_CHILDREN) {
-                            if (ev.ev_type == CE_CDB_OBJSET_ADD_EVENT) {
-                                uint64_t ent_obj = ev.new_value.subobj;
-
-                                uint64_t ents_n = ce_array_size(si->ents);
-                                for (int e = 0; e < ents_n; ++e) {
-                                    ct_entity_t0 ent = si->ents[e];
-                                    ct_entity_t0 new_ents = spawn_entity(world->world, ent_obj);
-
-                                    add_components(world->world, new_ents,
-                                                   CE_ARR_ARG(((ct_component_pair_t0[]) {
-                                                           {
-                                                                   .type = CT_PARENT_COMPONENT,
-                                                                   .data = &(ct_parent_c) {
-                                                                           .parent = ent,
-                                                                   }
-                                                           }
-                                                   })));
-
-                                }
-
-                            } else if (ev.ev_type == CE_CDB_PROP_MOVE_EVENT) {
-                                uint64_t ent_obj = ev.value.subobj;
-                                uint64_t to_ent_obj = ev.to;
-
-                                spawn_info_t *to_si = _get_spawninfo(&world->obj_spawninfo,
-                                                                     to_ent_obj);
-                                if (!to_si) {
-                                    continue;
-                                }
-
-                                spawn_info_t *ent_si = _get_spawninfo(&world->obj_spawninfo,
-                                                                      ent_obj);
-                                if (!ent_si) {
-                                    continue;
-                                }
-
-                                for (int j = 0; j < ce_array_size(to_si->ents); ++j) {
-                                    ct_entity_t0 to_ent = to_si->ents[j];
-                                    ct_entity_t0 ent = ent_si->ents[j];
-
-                                    add_components(world->world, ent,
-                                                   CE_ARR_ARG(((ct_component_pair_t0[]) {
-                                                           {
-                                                                   .type = CT_PARENT_COMPONENT,
-                                                                   .data = &(ct_parent_c) {
-                                                                           .parent = to_ent,
-                                                                   }
-                                                           }
-                                                   })));
-                                }
-                            }
-                        } else if (ev.prop == ENTITY_COMPONENTS) {
-                            if (ev.ev_type == CE_CDB_OBJSET_ADD_EVENT) {
-                                uint64_t comp_obj = ev.new_value.subobj;
-                                uint64_t k = ce_cdb_a0->obj_type(db, comp_obj);
-
-                                uint64_t ents_n = ce_array_size(si->ents);
-                                for (int e = 0; e < ents_n; ++e) {
-                                    ct_entity_t0 ent = si->ents[e];
-                                    ct_archemask_t0 ent_type = _entity_chunk(world,
-                                                                             ent)->archetype_mask;
-
-                                    ct_archemask_t0 new_type = combine_component(&k, 1);
-                                    new_type = _archetype_add(ent_type, new_type);
-
-                                    if (_archetype_eq(ent_type, new_type)) {
-                                        continue;
-                                    }
-
-                                    _add_components_from_obj(world, db, ent, comp_obj);
-                                }
-                            }
-                        }
-                    }
-                }
+                continue;
             } else {
                 for (uint32_t i = 0; i < wn; ++i) {
                     struct world_instance_t *world = &_G.world_array[i];
@@ -1969,15 +5425,7 @@ static void _sync_task(float dt) {
                     for (int e = 0; e < ents_n; ++e) {
                         ct_entity_t0 ent = si->ents[e];
 
-                        void *data = get_one(world->world, comp_type, ent, true);
-
-                        if (!data) {
-                            continue;
-                        }
-
-                        if (ci->from_cdb_obj) {
-                            ci->from_cdb_obj(world->world, db, si->ent_obj, data);
-                        }
+                        _component_from_obj(world, db, ent, comp_type, si->ent_obj);
                     }
                 }
             }
@@ -2009,6 +5457,10 @@ static ce_cdb_prop_def_t0 entity_prop[] = {
                 .type = CE_CDB_TYPE_SET_SUBOBJECT,
                 .obj_type = ENTITY_CHILDREN,
         },
+        {
+                .name = "prefab",
+                .type = CE_CDB_TYPE_BLOB,
+        },
 };
 
 
@@ -2074,10 +5526,21 @@ static void ecs_debuger_draw(uint64_t content,
                 ce_buffer_printf(&str_buff, _G.allocator, "%s | ", display_name);
             }
 
-            if (archetype->archetype_mask.mask == 0) {
+            if (_archetype_empty(archetype->archetype_mask)) {
                 ce_buffer_printf(&str_buff, _G.allocator, "empty");
             }
 
+            uint32_t ent_n = 0;
+            uint32_t chunk_n = 0;
+            for (ent_chunk_t *chunk = archetype->first; chunk; chunk = chunk->next) {
+                ent_n += chunk->ent_n;
+                chunk_n += 1;
+            }
+
+            ce_buffer_printf(&str_buff, _G.allocator, " %u ents, %u chunks (%.0f%%)",
+                             ent_n, chunk_n,
+                             chunk_n ? (100.0f * ent_n) / (chunk_n * archetype->max_ent) : 0.0f);
+
             ct_debugui_a0->Selectable(str_buff, false, 0, &CE_VEC2_ZERO);
             ce_array_clean(str_buff);
         }
@@ -2110,13 +5573,12 @@ void CE_MODULE_LOAD(ecs)(struct ce_api_a0 *api,
             .db = ce_cdb_a0->db(),
             .obj_queue = ce_cdb_a0->new_objs_listener(ce_cdb_a0->db()),
             .changed_obj_queue = ce_cdb_a0->new_changed_obj_listener(ce_cdb_a0->db()),
+            .graph_version = 1,
     };
 
 
     ce_handler_create(&_G.world_handler, _G.allocator);
 
-    ce_array_set_capacity(_G.cmd_buf_pool, 64, _G.allocator);
-
     api->add_api(CT_ECS_API, &_api, sizeof(_api));
     api->add_api(CT_ECS_E_API, &e_api, sizeof(e_api));
     api->add_api(CT_ECS_C_API, &c_api, sizeof(c_api));
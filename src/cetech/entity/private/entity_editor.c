@@ -181,7 +181,7 @@ static void close(uint64_t context_obj) {
 
 static uint64_t open(uint64_t obj) {
     entity_editor *editor = _new_editor();
-    editor->entity = ct_ecs_e_a0->spawn_entity(editor->world, obj);
+    editor->entity = ct_ecs_e_a0->spawn_entity_live(editor->world, obj);
     return (uint64_t) editor;
 }
 
@@ -14,6 +14,7 @@
 #include <celib/fs.h>
 #include <celib/containers/hash.h>
 #include <celib/containers/bagraph.h>
+#include <celib/task.h>
 #include <cetech/resource/resource.h>
 
 #include <cetech/machine/machine.h>
@@ -121,6 +122,15 @@ bool cetech_kernel_init(int argc,
 
     init_config(argc, argv);
 
+    // Task module is loaded before config, apply task.* now.
+    ce_task_a0->configure();
+
+    // -task.trace trace.json
+    const char *trace_file = ce_config_a0->read_str(CONFIG_TASK_TRACE, NULL);
+    if (trace_file) {
+        ce_task_a0->trace_start(trace_file);
+    }
+
     init_static_modules();
 
     uint64_t root = ce_id_a0->id64("modules");
@@ -283,6 +293,16 @@ static void cetech_kernel_start() {
     ct_metrics_a0->reg_float_metric("dt");
     ct_metrics_a0->reg_float_metric("memory.system");
 
+    static const char *task_lane_metric[TASK_PRIORITY_COUNT] = {
+            [TASK_PRIORITY_NORMAL] = "task.queue.normal",
+            [TASK_PRIORITY_CRITICAL] = "task.queue.critical",
+            [TASK_PRIORITY_BACKGROUND] = "task.queue.background",
+    };
+
+    for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+        ct_metrics_a0->reg_float_metric(task_lane_metric[i]);
+    }
+
     while (_G.is_running) {
         ce_module_a0->do_reload();
 
@@ -295,6 +315,11 @@ static void cetech_kernel_start() {
         ct_metrics_a0->set_float(ce_id_a0->id64("memory.system"),
                                      t->vt->allocated_size(t->inst)* 0.000001);
 
+        for (uint32_t i = 0; i < TASK_PRIORITY_COUNT; ++i) {
+            ct_metrics_a0->set_float(ce_id_a0->id64(task_lane_metric[i]),
+                                     ce_task_a0->queue_depth(i));
+        }
+
         _build_update_graph(&_G.updateg);
         _update(&_G.updateg, dt);
 
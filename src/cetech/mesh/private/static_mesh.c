@@ -38,44 +38,57 @@ static struct _G {
 typedef struct mesh_render_data {
     uint8_t viewid;
     uint64_t layer_name;
+
+    // Last geometry
+    uint64_t scene;
+    uint64_t mesh;
+    ct_scene_geom_obj_t0 geom;
 } mesh_render_data;
 
+// Mesh is shared, whole range use same geometry and material.
 void render_static_mesh(ct_world_t0 world,
                         struct ct_entity_t0 *entities,
                         ct_ecs_ent_chunk_o0 *item,
                         uint32_t n,
                         void *_data) {
-     mesh_render_data *data = _data;
+    mesh_render_data *data = _data;
 
     ct_local_to_world_c *transforms = ct_ecs_c_a0->get_all(world, LOCAL_TO_WORLD_COMPONENT, item);
-    ct_mesh_component *static_meshs = ct_ecs_c_a0->get_all(world, STATIC_MESH_COMPONENT, item);
+    const ct_mesh_component *m_c = ct_ecs_c_a0->get_shared(world, STATIC_MESH_COMPONENT, item);
 
-    for (int i = 0; i < n; ++i) {
-        ct_local_to_world_c t_c = transforms[i];
-        ct_mesh_component m_c = static_meshs[i];
+    if (!m_c || !m_c->scene || !m_c->material) {
+        return;
+    }
 
-        if (!m_c.scene || !m_c.material) {
-            continue;
-        }
+    // Ranges are grouped by mesh, geometry is read once per group.
+    if ((data->scene != m_c->scene) || (data->mesh != m_c->mesh)) {
+        data->scene = m_c->scene;
+        data->mesh = m_c->mesh;
+        data->geom = (ct_scene_geom_obj_t0) {};
 
-        uint64_t geom_obj = ct_scene_a0->get_geom_obj(m_c.scene, m_c.mesh);
+        uint64_t geom_obj = ct_scene_a0->get_geom_obj(m_c->scene, m_c->mesh);
 
-        if (!geom_obj) {
-            continue;
+        if (geom_obj) {
+            ce_cdb_a0->read_to(ce_cdb_a0->db(), geom_obj, &data->geom, sizeof(data->geom));
         }
+    }
 
-        ct_scene_geom_obj_t0 go = {};
-        ce_cdb_a0->read_to(ce_cdb_a0->db(), geom_obj, &go, sizeof(go));
+    const ct_scene_geom_obj_t0 *go = &data->geom;
 
-        bgfx_index_buffer_handle_t ibh = {.idx = (uint16_t) go.ib};
-        bgfx_vertex_buffer_handle_t vbh = {.idx = (uint16_t) go.vb};
+    if (!go->vb_size) {
+        return;
+    }
 
-        ct_gfx_a0->bgfx_set_transform(t_c.world.m, 1);
+    bgfx_index_buffer_handle_t ibh = {.idx = (uint16_t) go->ib};
+    bgfx_vertex_buffer_handle_t vbh = {.idx = (uint16_t) go->vb};
+
+    for (int i = 0; i < n; ++i) {
+        ct_gfx_a0->bgfx_set_transform(transforms[i].world.m, 1);
 
-        ct_gfx_a0->bgfx_set_vertex_buffer(0, vbh, 0, (uint32_t) go.vb_size);
-        ct_gfx_a0->bgfx_set_index_buffer(ibh, 0, (uint32_t) go.ib_size);
+        ct_gfx_a0->bgfx_set_vertex_buffer(0, vbh, 0, (uint32_t) go->vb_size);
+        ct_gfx_a0->bgfx_set_index_buffer(ibh, 0, (uint32_t) go->ib_size);
 
-        ct_material_a0->submit(m_c.material, data->layer_name, data->viewid);
+        ct_material_a0->submit(m_c->material, data->layer_name, data->viewid);
     }
 }
 
@@ -149,6 +162,7 @@ void render(ct_world_t0 world,
                                 (ct_ecs_query_t0) {
                                         .all = CT_ECS_ARCHETYPE(STATIC_MESH_COMPONENT,
                                                                 LOCAL_TO_WORLD_COMPONENT),
+                                        .group_by = STATIC_MESH_COMPONENT,
                                 }, 0,
                                 render_static_mesh, &render_data);
 }
@@ -163,7 +177,7 @@ static void _mesh_render_on_spawn(ct_world_t0 world,
                                   void *data) {
     ct_mesh_component *c = data;
 
-    const ce_cdb_obj_o0 *r = ce_cdb_a0->read(ce_cdb_a0->db(), obj);
+    const ce_cdb_obj_o0 *r = ce_cdb_a0->read(db, obj);
 
     const char *mesh = ce_cdb_a0->read_str(r, PROP_MESH, 0);
     const char *node = ce_cdb_a0->read_str(r, PROP_NODE, 0);
@@ -181,6 +195,7 @@ static struct ct_ecs_component_i0 ct_component_api = {
         .display_name = display_name,
         .cdb_type = STATIC_MESH_COMPONENT,
         .size = sizeof(ct_mesh_component),
+        .is_shared = true,
         .from_cdb_obj = _mesh_render_on_spawn,
 };
 
@@ -206,7 +206,7 @@ static void spawn_children_system(ct_world_t0 world,
     ct_ecs_q_a0->foreach_serial(world,
                                 (ct_ecs_query_t0) {
                                         .all = CT_ECS_ARCHETYPE(CT_PARENT_COMPONENT),
-                                        .none = CT_ECS_ARCHETYPE(CT_PREVIOUS_PARENT_COMPONENT)
+                                        .added = CT_ECS_ARCHETYPE(CT_PARENT_COMPONENT),
                                 }, rq_version,
                                 _spawn_children, cmd);
 
@@ -276,27 +276,35 @@ static struct ct_system_i0 spawn_children_system_i0 = {
         .name = SPAWN_CHILDERN,
         .process = spawn_children_system,
         .group = CT_ECS_SIMULATION_GROUP,
+        .read = CT_ECS_READ(CT_PARENT_COMPONENT),
+        .write = CT_ECS_WRITE(CT_CHILD_COMPONENT),
 };
 
 static struct ct_system_i0 change_previous_parent_system_i0 = {
         .name = CHANGE_PREVIOUS_PARENT,
         .after = CT_ECS_AFTER(SPAWN_CHILDERN),
         .process = change_previous_parent_system,
-        .group = CT_ECS_SIMULATION_GROUP
+        .group = CT_ECS_SIMULATION_GROUP,
+        .read = CT_ECS_READ(CT_PARENT_COMPONENT),
+        .write = CT_ECS_WRITE(CT_CHILD_COMPONENT, CT_PREVIOUS_PARENT_COMPONENT),
 };
 
 static struct ct_system_i0 change_previous_parent_system2_i0 = {
         .name = CHANGE_PREVIOUS2_PARENT,
         .after = CT_ECS_AFTER(CHANGE_PREVIOUS_PARENT),
         .process = change_previous_parent_system2,
-        .group = CT_ECS_SIMULATION_GROUP
+        .group = CT_ECS_SIMULATION_GROUP,
+        .read = CT_ECS_READ(CT_PARENT_COMPONENT),
+        .write = CT_ECS_WRITE(CT_CHILD_COMPONENT, CT_PREVIOUS_PARENT_COMPONENT),
 };
 
 static struct ct_system_i0 parent_system_i0 = {
         .name = CT_PARENT_SYSTEM,
         .after = CT_ECS_AFTER(CHANGE_PREVIOUS2_PARENT),
         .process = parent_system,
-        .group = CT_ECS_SIMULATION_GROUP
+        .group = CT_ECS_SIMULATION_GROUP,
+        .read = CT_ECS_READ(CT_PARENT_COMPONENT),
+        .write = CT_ECS_WRITE(CT_CHILD_COMPONENT, CT_PREVIOUS_PARENT_COMPONENT),
 };
 
 // Parent
@@ -327,11 +335,82 @@ const char *child_parent_display_name() {
     return "Child";
 }
 
+// Child arrays go to snapshot stream as count + children.
+static void child_snapshot(ct_world_t0 world,
+                           const ct_entity_t0 *ent,
+                           const void *data,
+                           uint32_t n,
+                           uint8_t **stream,
+                           ce_alloc_t0 *alloc) {
+    const ct_child_c *child = data;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t child_n = ce_array_size(child[i].child);
+        ce_array_push_n(*stream, (uint8_t *) &child_n, sizeof(uint64_t), alloc);
+
+        if (child_n) {
+            ce_array_push_n(*stream, (uint8_t *) child[i].child,
+                            sizeof(ct_entity_t0) * child_n, alloc);
+        }
+    }
+}
+
+static bool child_restore(ct_world_t0 world,
+                          const ct_entity_t0 *ent,
+                          void *data,
+                          uint32_t n,
+                          const uint8_t **stream,
+                          uint64_t stream_size) {
+    ct_child_c *child = data;
+    const uint8_t *end = *stream + stream_size;
+    bool valid = true;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        child[i].child = NULL;
+
+        uint64_t child_n = 0;
+        if (!valid || ((uint64_t) (end - *stream) < sizeof(uint64_t))) {
+            valid = false;
+            continue;
+        }
+
+        memcpy(&child_n, *stream, sizeof(uint64_t));
+        *stream += sizeof(uint64_t);
+
+        if (child_n > ((uint64_t) (end - *stream) / sizeof(ct_entity_t0))) {
+            valid = false;
+            continue;
+        }
+
+        if (child_n) {
+            ce_array_push_n(child[i].child, (const ct_entity_t0 *) *stream,
+                            child_n, _G.alloc);
+            *stream += sizeof(ct_entity_t0) * child_n;
+        }
+    }
+
+    return valid;
+}
+
+static void child_release(ct_world_t0 world,
+                          const ct_entity_t0 *ent,
+                          void *data,
+                          uint32_t n) {
+    ct_child_c *child = data;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        ce_array_free(child[i].child, _G.alloc);
+    }
+}
+
 static struct ct_ecs_component_i0 child_c_api = {
         .cdb_type = CT_CHILD_COMPONENT,
         .size = sizeof(ct_child_c),
         .display_name = child_parent_display_name,
         .is_system_state = true,
+        .snapshot = child_snapshot,
+        .restore = child_restore,
+        .release = child_release,
 };
 
 void CE_MODULE_LOAD(parent)(struct ce_api_a0 *api,
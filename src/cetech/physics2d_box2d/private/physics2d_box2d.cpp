@@ -124,10 +124,43 @@ typedef struct box2d_body_component {
     b2Fixture *fix;
 } box2d_component;
 
+// Snapshot body pointers are not valid, body is rebuilt by spawn systems.
+static bool box2d_body_restore(ct_world_t0 world,
+                               const ct_entity_t0 *ent,
+                               void *data,
+                               uint32_t n,
+                               const uint8_t **stream,
+                               uint64_t stream_size) {
+    auto *body = (box2d_component *) data;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        body[i] = {};
+    }
+
+    return true;
+}
+
+static void box2d_body_release(ct_world_t0 world,
+                               const ct_entity_t0 *ent,
+                               void *data,
+                               uint32_t n) {
+    auto *body = (box2d_component *) data;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (body[i].body) {
+            body[i].body->GetWorld()->DestroyBody(body[i].body);
+        }
+
+        body[i] = {};
+    }
+}
+
 static struct ct_ecs_component_i0 box2d_component_i = {
         .cdb_type = BOX2D_COMPONENT,
         .size = sizeof(box2d_component),
         .is_system_state = true,
+        .restore = box2d_body_restore,
+        .release = box2d_body_release,
 };
 
 // system
@@ -381,7 +414,11 @@ static void _destroy_state(struct ct_world_t0 world,
 
     for (uint32_t i = 0; i < n; ++i) {
         box2d_component *b = &box_body[i];
-        w->w->DestroyBody(b->body);
+
+        if (b->body) {
+            w->w->DestroyBody(b->body);
+        }
+
         ct_ecs_a0->buff_remove_component(data->cmd, world, ent[i],
                                          (uint64_t[]) {BOX2D_COMPONENT}, 1);
     }
@@ -399,6 +436,10 @@ void _transform_change(struct ct_world_t0 world,
     for (uint32_t i = 0; i < n; ++i) {
         b2Body *b2body = body[i].body;
 
+        if (!b2body) {
+            continue;
+        }
+
         ce_vec3_t pos3 = position[i].pos;
         ce_vec2_t pos2 = {.x=pos3.x, .y=pos3.y};
 
@@ -436,6 +477,10 @@ void _mass_change(struct ct_world_t0 world,
     for (uint32_t i = 0; i < n; ++i) {
         b2Body *b2body = body[i].body;
 
+        if (!b2body) {
+            continue;
+        }
+
         b2MassData mass_data;
         b2body->GetMassData(&mass_data);
 
@@ -469,6 +514,10 @@ void _velocity_change(struct ct_world_t0 world,
         box2d_component *b = &box_body[i];
         ct_velocity2d_c *v = &velocity[i];
 
+        if (!b->body) {
+            continue;
+        }
+
         ce_vec2_t b2_linear = (ce_vec2_t) {
                 .x=b->body->GetLinearVelocity().x,
                 .y=b->body->GetLinearVelocity().y
@@ -500,6 +549,10 @@ static void _write_back(ct_world_t0 world,
     for (uint32_t i = 0; i < n; ++i) {
         b2Body *b2body = body[i].body;
 
+        if (!b2body) {
+            continue;
+        }
+
         b2Vec2 pos = b2body->GetPosition();
         float angle = b2body->GetAngle();
 
@@ -517,6 +570,26 @@ static void _write_back(ct_world_t0 world,
     }
 }
 
+// Body dropped by restore, spawn systems build it again.
+static void _drop_restored_body(struct ct_world_t0 world,
+                                struct ct_entity_t0 *ent,
+                                ct_ecs_ent_chunk_o0 *item,
+                                uint32_t n,
+                                void *_data) {
+    auto *data = (spawn_box2d_body_data_t *) _data;
+
+    auto *body = (box2d_component *) ct_ecs_c_a0->get_all(world, BOX2D_COMPONENT, item);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (body[i].body) {
+            continue;
+        }
+
+        ct_ecs_a0->buff_remove_component(data->cmd, world, ent[i],
+                                         (uint64_t[]) {BOX2D_COMPONENT}, 1);
+    }
+}
+
 static void physics2d_system(ct_world_t0 world,
                              float dt,
                              uint32_t rq_version,
@@ -537,6 +610,13 @@ static void physics2d_system(ct_world_t0 world,
         return;
     }
 
+    ct_ecs_q_a0->foreach_serial(world,
+                                (ct_ecs_query_t0) {
+                                        .all = CT_ECS_ARCHETYPE(BOX2D_COMPONENT),
+                                        .only_changed = true,
+                                }, rq_version,
+                                _drop_restored_body, &data);
+
     ct_ecs_q_a0->foreach_serial(world,
                                 (ct_ecs_query_t0) {
                                         .all = CT_ECS_ARCHETYPE(POSITION_COMPONENT,
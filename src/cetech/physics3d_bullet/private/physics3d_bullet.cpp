@@ -90,6 +90,7 @@ typedef struct bullet_world_component {
 
 typedef struct body_component {
     btRigidBody *body;
+    btDiscreteDynamicsWorld *world;
 } body_component;
 
 static const char *bullet_world_dispaly_name() {
@@ -107,11 +108,56 @@ static const char *bullet_body_dispaly_name() {
     return "Bullet body";
 }
 
+static void _delete_body(btDiscreteDynamicsWorld *world,
+                         btRigidBody *body) {
+    btCollisionShape *shape = body->getCollisionShape();
+    btMotionState *mstate = body->getMotionState();
+
+    world->removeRigidBody(body);
+
+    CE_DELETE(_G.allocator, shape);
+    CE_DELETE(_G.allocator, mstate);
+    CE_DELETE(_G.allocator, body);
+}
+
+// Snapshot body pointers are not valid, body is rebuilt by spawn systems.
+static bool body_restore(ct_world_t0 world,
+                         const ct_entity_t0 *ent,
+                         void *data,
+                         uint32_t n,
+                         const uint8_t **stream,
+                         uint64_t stream_size) {
+    auto *body = (body_component *) data;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        body[i] = {};
+    }
+
+    return true;
+}
+
+static void body_release(ct_world_t0 world,
+                         const ct_entity_t0 *ent,
+                         void *data,
+                         uint32_t n) {
+    auto *body = (body_component *) data;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (body[i].body) {
+            _delete_body(body[i].world, body[i].body);
+        }
+
+        body[i] = {};
+    }
+}
+
 static struct ct_ecs_component_i0 body_component_i = {
         .cdb_type = BODY_COMPONENT,
         .size = sizeof(body_component),
         .is_system_state = true,
         .display_name = bullet_body_dispaly_name,
+        .restore = body_restore,
+        .release = body_release,
 };
 
 static inline btVector3 _to_bvect(ce_vec3_t v) {
@@ -271,7 +317,7 @@ static void _spawn_dynamic_body(struct ct_world_t0 world,
         body->setAngularVelocity(_to_bvect(velocity[i].angular));
         body->setLinearVelocity(_to_bvect(velocity[i].linear));
 
-        body_component result_body = {.body=body};
+        body_component result_body = {.body=body, .world=w->w};
         w->w->addRigidBody(body);
 
         ct_ecs_a0->buff_add_component(data, world, ent[i],
@@ -310,7 +356,7 @@ static void _spawn_static_body(struct ct_world_t0 world,
         auto *myMotionState = CE_NEW(_G.allocator, btDefaultMotionState)(startTransform);
         auto *body = CE_NEW(_G.allocator, btRigidBody)(0, myMotionState, shape);
 
-        body_component result_body = {.body=body};
+        body_component result_body = {.body=body, .world=w->w};
 
         w->w->addRigidBody(body);
 
@@ -336,6 +382,10 @@ static void _transform_change(struct ct_world_t0 world,
     for (uint32_t i = 0; i < n; ++i) {
         btRigidBody *b2body = body[i].body;
 
+        if (!b2body) {
+            continue;
+        }
+
         ce_vec3_t pos3 = position[i].pos;
 
         btTransform transform = b2body->getCenterOfMassTransform();
@@ -375,6 +425,10 @@ static void _velocity_change(struct ct_world_t0 world,
 
         btRigidBody *body = b->body;
 
+        if (!body) {
+            continue;
+        }
+
         ct_velocity3d_c *v = &velocity[i];
 
         ce_vec3_t b2_linear = _to_ctvect(body->getLinearVelocity());
@@ -413,6 +467,10 @@ static void _collider_change(struct ct_world_t0 world,
         btRigidBody *rbody = body[i].body;
         ct_collider3d_c *col = &collider[i];
 
+        if (!rbody) {
+            continue;
+        }
+
         const btCollisionShape *shape = rbody->getCollisionShape();
 
         btCollisionShape *new_shape = NULL;
@@ -476,6 +534,10 @@ static void _write_back(ct_world_t0 world,
         btRigidBody *b2body = body[i].body;
         ce_vec4_t *rot = &rotation[i].rot;
 
+        if (!b2body) {
+            continue;
+        }
+
         btTransform transform = b2body->getWorldTransform();
 
         position[i].pos = _to_ctvect(transform.getOrigin());
@@ -494,21 +556,12 @@ static void _destroy_all_body(struct ct_world_t0 world,
                               void *_data) {
     auto *data = (ct_ecs_cmd_buffer_t *) _data;
 
-    bullet_world_component *w = _get_bworld(world);
-
     auto *body = (body_component *) ct_ecs_c_a0->get_all(world, BODY_COMPONENT, item);
 
     for (uint32_t i = 0; i < n; ++i) {
-        btRigidBody *b2body = body[i].body;
-
-        btCollisionShape *shape = b2body->getCollisionShape();
-        btMotionState *mstate = b2body->getMotionState();
-
-        w->w->removeRigidBody(b2body);
-
-        CE_DELETE(_G.allocator, shape);
-        CE_DELETE(_G.allocator, mstate);
-        CE_DELETE(_G.allocator, b2body);
+        if (body[i].body) {
+            _delete_body(body[i].world, body[i].body);
+        }
 
         ct_ecs_a0->buff_remove_component(data, world, ent[i],
                                          (uint64_t[]) {BODY_COMPONENT}, 1);
@@ -544,6 +597,26 @@ static void _destroy_world(struct ct_world_t0 world,
     }
 }
 
+// Body dropped by restore, spawn systems build it again.
+static void _drop_restored_body(struct ct_world_t0 world,
+                                struct ct_entity_t0 *ent,
+                                ct_ecs_ent_chunk_o0 *item,
+                                uint32_t n,
+                                void *_data) {
+    auto *data = (ct_ecs_cmd_buffer_t *) _data;
+
+    auto *body = (body_component *) ct_ecs_c_a0->get_all(world, BODY_COMPONENT, item);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        if (body[i].body) {
+            continue;
+        }
+
+        ct_ecs_a0->buff_remove_component(data, world, ent[i],
+                                         (uint64_t[]) {BODY_COMPONENT}, 1);
+    }
+}
+
 static void _spawn_dynamic_body_system(ct_world_t0 world,
                                        float dt,
                                        uint32_t rq_version,
@@ -561,6 +634,13 @@ static void _spawn_dynamic_body_system(ct_world_t0 world,
         return;
     }
 
+    ct_ecs_q_a0->foreach_serial(world,
+                                (ct_ecs_query_t0) {
+                                        .all = CT_ECS_ARCHETYPE(BODY_COMPONENT),
+                                        .only_changed = true,
+                                }, rq_version,
+                                _drop_restored_body, cmd);
+
     ct_ecs_q_a0->foreach_serial(world,
                                 (ct_ecs_query_t0) {
                                         .all = CT_ECS_ARCHETYPE(POSITION_COMPONENT,
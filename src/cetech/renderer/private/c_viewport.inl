@@ -23,6 +23,7 @@ static struct ct_ecs_component_i0 viewport_component_i = {
         .display_name = viewport_display_name,
         .cdb_type = VIEWPORT_COMPONENT,
         .size = sizeof(viewport_component),
+        .no_prefab = true,
         .from_cdb_obj = _viewport_on_spawn,
 };
 
@@ -15,6 +15,7 @@
 #include <celib/log.h>
 #include <celib/task.h>
 #include <celib/os/window.h>
+#include <celib/os/thread.h>
 
 #include <cetech/kernel/kernel.h>
 #include <cetech/resource/resource.h>
@@ -65,6 +66,7 @@ static struct _G {
     ct_machine_ev_queue_o0 *ev_queue;
 
     uint32_t render_worker_id;
+    ce_sem_t0 render_thread_ready;
 } _G = {};
 
 
@@ -78,21 +80,16 @@ static uint32_t _get_reset_flags() {
 // Interface
 //==============================================================================
 
-static void _render_task(void *data) {
+static void _render_thread(void *data) {
     _G.render_worker_id = ce_task_a0->worker_id();
 
-    ce_log_a0->info("renderer", "This is render worker.");
-    while (bgfx_render_frame(-1) != BGFX_RENDER_FRAME_EXITING) {
-    }
-}
-
-static void _render_init_task(void *data) {
+    // Frame before bgfx_init => this is render thread.
     bgfx_render_frame(-1);
+    ce_os_thread_a0->sem_post(_G.render_thread_ready);
 
-    ce_task_a0->add(&(ce_task_item_t0) {
-            .work = _render_task,
-            .name = "Renderer worker",
-    }, 1, NULL);
+    ce_log_a0->info("renderer", "This is render thread.");
+    while (bgfx_render_frame(-1) != BGFX_RENDER_FRAME_EXITING) {
+    }
 }
 
 static void renderer_create() {
@@ -134,13 +131,15 @@ static void renderer_create() {
     pd.ndt = _G.main_window->native_display_ptr(_G.main_window->inst);
     bgfx_set_platform_data(&pd);
 
-    ce_task_counter_t0 *render_init_c = NULL;
-    ce_task_a0->add(&(ce_task_item_t0) {
-            .work = _render_init_task,
-            .name = "Renderer init worker",
-    }, 1, &render_init_c);
+    _G.render_thread_ready = ce_os_thread_a0->sem_create(0);
+
+    ce_task_a0->service_thread(&(ce_task_item_t0) {
+            .work = _render_thread,
+            .name = "cetech_render",
+    }, -1);
 
-    ce_task_a0->wait_for_counter_no_work(render_init_c, 0);
+    ce_os_thread_a0->sem_wait(_G.render_thread_ready, UINT32_MAX);
+    ce_os_thread_a0->sem_destroy(_G.render_thread_ready);
     // TODO: from config
 
     bgfx_init_t init;
@@ -147,6 +147,30 @@ void _save(const char *filename,
 
 }
 
+typedef struct compile_pass_t {
+    ce_cdb_t0 db;
+    ce_ba_graph_t *obj_graph;
+    ce_hash_t *root_cnodes_hash;
+    ce_hash_t *obj_files;
+} compile_pass_t;
+
+static void _compile_pass_task(void *data) {
+    compile_pass_t *pass = data;
+
+    const uint64_t output_n = ce_array_size(pass->obj_graph->output);
+    for (int k = 0; k < output_n; ++k) {
+        uint64_t obj = pass->obj_graph->output[k];
+        cnode_t *cnodes = (cnode_t *) ce_hash_lookup(pass->root_cnodes_hash, obj, 0);
+        ct_resource_compilator_t compilator = _find_compilator(cnodes[0].obj.type);
+        if (compilator) {
+            compilator(pass->db, obj);
+        }
+
+        const char *filename = (const char *) ce_hash_lookup(pass->obj_files, obj, 0);
+        _save(filename, pass->db, obj, true);
+    }
+}
+
 void _compile_files(char **files,
                     uint32_t files_count) {
     ce_ba_graph_t obj_graph = {};
@@ -205,17 +229,22 @@ void _compile_files(char **files,
         ce_array_free(outputs, _G.allocator);
     }
 
-    for (int k = 0; k < output_n; ++k) {
-        uint64_t obj = obj_graph.output[k];
-        cnode_t *cnodes = (cnode_t *) ce_hash_lookup(&root_cnodes_hash, obj, 0);
-        ct_resource_compilator_t compilator = _find_compilator(cnodes[0].obj.type);
-        if (compilator) {
-            compilator(db, obj);
-        }
+    compile_pass_t pass = {
+            .db = db,
+            .obj_graph = &obj_graph,
+            .root_cnodes_hash = &root_cnodes_hash,
+            .obj_files = &obj_files,
+    };
 
-        const char *filename = (const char *) ce_hash_lookup(&obj_files, obj, 0);
-        _save(filename, db, obj, true);
-    }
+    // Compilators (external tools...) run in background lane in graph order.
+    ce_task_counter_t0 *counter = NULL;
+    ce_task_a0->add(&(ce_task_item_t0) {
+            .name = "resource_compile",
+            .work = _compile_pass_task,
+            .data = &pass,
+            .priority = TASK_PRIORITY_BACKGROUND,
+    }, 1, &counter);
+    ce_task_a0->wait_for_counter(counter, 0);
 
     ce_cdb_a0->destroy_db(db);
 }
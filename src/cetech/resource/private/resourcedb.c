@@ -235,7 +235,7 @@ static int resourcedb_init_db() {
 
     ce_buffer_free(build_dir_full, ce_memory_a0->system);
 
-    int worker_n = ce_task_a0->worker_count();
+    int worker_n = ce_task_a0->thread_count();
     for (int j = 0; j < worker_n; ++j) {
         sqlite3_open_v2(_G._logdb_path,
                         &_G.db[j],
@@ -234,8 +234,14 @@ static bool init() {
 
 static void update(float dt) {
     uint32_t n = ce_array_size(_G.instances);
+    if (!n) {
+        return;
+    }
+
+    ct_world_t0 worlds[n];
     for (int i = 0; i < n; ++i) {
         struct preview_instance *pi = &_G.instances[i];
+        worlds[i] = pi->world;
 
         if (ct_ecs_c_a0->has(pi->world, pi->ent, (uint64_t[]) {ROTATION_COMPONENT}, 1)) {
             ct_rotation_c *rot_t = ct_ecs_c_a0->get_one(pi->world,
@@ -244,9 +250,9 @@ static void update(float dt) {
             ce_vec4_t q = ce_quat_from_euler(0, 1 * CE_DEG_TO_RAD, 0);
             rot_t->rot = ce_quat_mul(q, rot_t->rot);
         }
-
-        ct_ecs_a0->step(pi->world, dt);
     }
+
+    ct_ecs_a0->step_worlds(worlds, n, dt);
 }
 
 void set_background_resource(ct_resource_id_t0 resource) {
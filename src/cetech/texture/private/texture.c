@@ -33,16 +33,30 @@
 #include <celib/os/process.h>
 #include <celib/os/vio.h>
 #include <celib/containers/hash.h>
+#include <celib/containers/array.h>
+#include <celib/task.h>
+#include <stdatomic.h>
 
 
 //==============================================================================
 // GLobals
 //==============================================================================
 
+// Texture compiled in background, old texture stay online until done.
+typedef struct compile_job_t {
+    uint64_t obj;
+    ce_task_counter_t0 *counter;
+    atomic_bool done;
+    bool dirty;
+} compile_job_t;
+
 #define _G TextureResourceGlobals
 struct _G {
     ce_alloc_t0 *allocator;
     ct_cdb_ev_queue_o0 *changed_obj_queue;
+
+    compile_job_t **compile_jobs;
+    ce_hash_t compile_job_map;
 } _G;
 
 typedef struct ct_texture_obj_t {
@@ -296,6 +310,65 @@ static struct ct_texture_a0 texture_api = {
 
 struct ct_texture_a0 *ct_texture_a0 = &texture_api;
 
+static void _compile_task(void *data) {
+    compile_job_t *job = data;
+    _compile(ce_cdb_a0->db(), job->obj);
+    atomic_store(&job->done, true);
+}
+
+static void _start_compile(uint64_t obj) {
+    compile_job_t *job = (compile_job_t *) ce_hash_lookup(&_G.compile_job_map,
+                                                          obj, 0);
+
+    // Changed while compiling => compile again when done.
+    if (job) {
+        job->dirty = true;
+        return;
+    }
+
+    job = CE_ALLOC(_G.allocator, compile_job_t, sizeof(compile_job_t));
+    *job = (compile_job_t) {.obj = obj};
+
+    ce_array_push(_G.compile_jobs, job, _G.allocator);
+    ce_hash_add(&_G.compile_job_map, obj, (uint64_t) job, _G.allocator);
+
+    ce_task_a0->add(&(ce_task_item_t0) {
+            .name = "texture_compile",
+            .work = _compile_task,
+            .data = job,
+            .priority = TASK_PRIORITY_BACKGROUND,
+    }, 1, &job->counter);
+}
+
+static void _finish_compile_jobs() {
+    uint32_t n = ce_array_size(_G.compile_jobs);
+    for (uint32_t i = 0; i < n;) {
+        compile_job_t *job = _G.compile_jobs[i];
+
+        if (!atomic_load(&job->done)) {
+            ++i;
+            continue;
+        }
+
+        ce_task_a0->wait_for_counter(job->counter, 0);
+
+        texture_offline(ce_cdb_a0->db(), job->obj);
+        texture_online(ce_cdb_a0->db(), job->obj);
+
+        ce_hash_remove(&_G.compile_job_map, job->obj);
+
+        _G.compile_jobs[i] = _G.compile_jobs[n - 1];
+        ce_array_pop_back(_G.compile_jobs);
+        --n;
+
+        if (job->dirty) {
+            _start_compile(job->obj);
+        }
+
+        CE_FREE(_G.allocator, job);
+    }
+}
+
 static void compile_watch(float dt) {
     ce_cdb_prop_ev_t0 ev = {};
 
@@ -322,12 +395,11 @@ static void compile_watch(float dt) {
         }
     }
 
+    _finish_compile_jobs();
+
     uint32_t n = ce_array_size(to_compile_obj);
     for (int i = 0; i < n; ++i) {
-        uint64_t obj = to_compile_obj[i];
-        texture_offline(ce_cdb_a0->db(), obj);
-        _compile(ce_cdb_a0->db(), obj);
-        texture_online(ce_cdb_a0->db(), obj);
+        _start_compile(to_compile_obj[i]);
     }
 
     ce_hash_free(&obj_set, _G.allocator);
@@ -364,6 +436,7 @@ void CE_MODULE_LOAD(texture)(struct ce_api_a0 *api,
     CE_INIT_API(api, ce_id_a0);
     CE_INIT_API(api, ce_cdb_a0);
     CE_INIT_API(api, ct_renderer_a0);
+    CE_INIT_API(api, ce_task_a0);
 
     api->add_api(CT_TEXTURE_API, &texture_api, sizeof(texture_api));
 
@@ -384,6 +457,15 @@ void CE_MODULE_UNLOAD(texture)(struct ce_api_a0 *api,
     CE_UNUSED(reload);
     CE_UNUSED(api);
 
+    uint32_t n = ce_array_size(_G.compile_jobs);
+    for (uint32_t i = 0; i < n; ++i) {
+        ce_task_a0->wait_for_counter(_G.compile_jobs[i]->counter, 0);
+        CE_FREE(_G.allocator, _G.compile_jobs[i]);
+    }
+
+    ce_array_free(_G.compile_jobs, _G.allocator);
+    ce_hash_free(&_G.compile_job_map, _G.allocator);
+
     _G = (struct _G) {
             .allocator = ce_memory_a0->system,
     };
@@ -419,6 +419,9 @@ static struct ct_system_i0 transform_system_i0 = {
         .group = TRANSFORM_GROUP,
         .process = transform_system,
         .after = CT_ECS_AFTER(CT_PARENT_SYSTEM),
+        .read = CT_ECS_READ(POSITION_COMPONENT, ROTATION_COMPONENT, SCALE_COMPONENT,
+                            CT_PARENT_COMPONENT),
+        .write = CT_ECS_WRITE(LOCAL_TO_WORLD_COMPONENT, LOCAL_TO_PARENT_COMPONENT),
 };
 
 
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include <celib/core.h>
+#include <celib/log.h>
+#include <celib/config.h>
+
+#include <celib/memory/memory.h>
+#include <celib/memory/allocator.h>
+#include <celib/task.h>
+#include <celib/os/time.h>
+
+// Scheduler stress: one huge batch (pool growth + queue backpressure),
+// nested batches waited inside tasks and add_after stage chain.
+// Scaling: same cpu bound batch on 1..N workers.
+// Exit code is number of failed checks.
+
+#define DEFAULT_TASK_COUNT 1000000
+#define NESTED_PARENTS 256
+#define NESTED_CHILDREN 1024
+#define CHAIN_STAGES 64
+#define CHAIN_TASKS 1024
+#define SCALE_TASKS 4096
+#define SCALE_ITERATIONS 20000
+
+static atomic_uint_fast64_t _sum;
+static atomic_uint_fast64_t _stage_done[CHAIN_STAGES];
+static atomic_uint _chain_errors;
+static uint64_t _scale_result[SCALE_TASKS];
+
+static double _ms(uint64_t begin) {
+    uint64_t ticks = ce_os_time_a0->perf_counter() - begin;
+    return (1000.0 * ticks) / ce_os_time_a0->perf_freq();
+}
+
+static void inc_task(void *data) {
+    atomic_fetch_add_explicit(&_sum, 1, memory_order_relaxed);
+}
+
+static void nested_task(void *data) {
+    ce_task_item_t0 items[NESTED_CHILDREN];
+    for (uint32_t i = 0; i < NESTED_CHILDREN; ++i) {
+        items[i] = (ce_task_item_t0) {.name = "nested_child", .work = inc_task};
+    }
+
+    ce_task_counter_t0 *counter = NULL;
+    ce_task_a0->add(items, NESTED_CHILDREN, &counter);
+    ce_task_a0->wait_for_counter(counter, 0);
+}
+
+static void chain_task(void *data) {
+    uint32_t stage = (uint32_t) (uintptr_t) data;
+
+    if (stage && (atomic_load(&_stage_done[stage - 1]) != CHAIN_TASKS)) {
+        atomic_fetch_add(&_chain_errors, 1);
+    }
+
+    atomic_fetch_add(&_stage_done[stage], 1);
+}
+
+static void scale_task(void *data) {
+    uint32_t idx = (uint32_t) (uintptr_t) data;
+
+    uint64_t x = idx + 1;
+    for (uint32_t i = 0; i < SCALE_ITERATIONS; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+
+    _scale_result[idx] = x;
+}
+
+static uint32_t check(const char *name,
+                      uint64_t value,
+                      uint64_t expected,
+                      uint64_t begin) {
+    bool ok = value == expected;
+    printf("%-8s %s %llu/%llu %.1f ms\n", name, ok ? "OK  " : "FAIL",
+           (unsigned long long) value, (unsigned long long) expected, _ms(begin));
+    return ok ? 0 : 1;
+}
+
+static uint32_t run_checks(uint32_t task_n) {
+    ce_alloc_t0 *a = ce_memory_a0->system;
+    uint32_t failed = 0;
+
+    printf("workers %d\n", ce_task_a0->worker_count());
+
+    // One batch
+    atomic_store(&_sum, 0);
+    ce_task_item_t0 *items = CE_ALLOC(a, ce_task_item_t0, sizeof(ce_task_item_t0) * task_n);
+    for (uint32_t i = 0; i < task_n; ++i) {
+        items[i] = (ce_task_item_t0) {.name = "batch", .work = inc_task};
+    }
+
+    uint64_t begin = ce_os_time_a0->perf_counter();
+    ce_task_counter_t0 *counter = NULL;
+    ce_task_a0->add(items, task_n, &counter);
+    ce_task_a0->wait_for_counter(counter, 0);
+    failed += check("batch", atomic_load(&_sum), task_n, begin);
+
+    CE_FREE(a, items);
+
+    // Nested
+    atomic_store(&_sum, 0);
+    ce_task_item_t0 parents[NESTED_PARENTS];
+    for (uint32_t i = 0; i < NESTED_PARENTS; ++i) {
+        parents[i] = (ce_task_item_t0) {.name = "nested", .work = nested_task};
+    }
+
+    begin = ce_os_time_a0->perf_counter();
+    ce_task_a0->add(parents, NESTED_PARENTS, &counter);
+    ce_task_a0->wait_for_counter(counter, 0);
+    failed += check("nested", atomic_load(&_sum), NESTED_PARENTS * NESTED_CHILDREN, begin);
+
+    // Chain, submitted at once and waited only on last stage
+    atomic_store(&_chain_errors, 0);
+    for (uint32_t s = 0; s < CHAIN_STAGES; ++s) {
+        atomic_store(&_stage_done[s], 0);
+    }
+
+    begin = ce_os_time_a0->perf_counter();
+    ce_task_counter_t0 *prev = NULL;
+    for (uint32_t s = 0; s < CHAIN_STAGES; ++s) {
+        ce_task_item_t0 stage[CHAIN_TASKS];
+        for (uint32_t i = 0; i < CHAIN_TASKS; ++i) {
+            stage[i] = (ce_task_item_t0) {
+                    .name = "chain",
+                    .work = chain_task,
+                    .data = (void *) (uintptr_t) s,
+            };
+        }
+
+        ce_task_counter_t0 *next = NULL;
+        ce_task_a0->add_after(&prev, prev ? 1 : 0, stage, CHAIN_TASKS, &next);
+
+        if (prev) {
+            ce_task_a0->release_counter(prev);
+        }
+
+        prev = next;
+    }
+    ce_task_a0->wait_for_counter(prev, 0);
+
+    uint64_t chain_n = 0;
+    for (uint32_t s = 0; s < CHAIN_STAGES; ++s) {
+        chain_n += atomic_load(&_stage_done[s]);
+    }
+
+    failed += check("chain", chain_n, CHAIN_STAGES * CHAIN_TASKS, begin);
+    failed += check("order", atomic_load(&_chain_errors), 0, begin);
+
+    return failed;
+}
+
+// Main thread only wait so k workers = k threads doing work.
+static uint32_t run_scaling() {
+    ce_alloc_t0 *a = ce_memory_a0->system;
+
+    uint64_t workers_cfg = ce_config_a0->read_uint(CONFIG_TASK_WORKERS, 0);
+    uint32_t max_workers = ce_task_a0->worker_count() - 1;
+    if (!max_workers) {
+        max_workers = 1;
+    }
+
+    ce_task_item_t0 *items = CE_ALLOC(a, ce_task_item_t0, sizeof(ce_task_item_t0) * SCALE_TASKS);
+    for (uint32_t i = 0; i < SCALE_TASKS; ++i) {
+        items[i] = (ce_task_item_t0) {
+                .name = "scale",
+                .work = scale_task,
+                .data = (void *) (uintptr_t) i,
+        };
+    }
+
+    uint64_t expected = 0;
+    double base_ms = 0;
+    uint32_t failed = 0;
+
+    for (uint32_t k = 1; k <= max_workers; ++k) {
+        ce_config_a0->set_uint(CONFIG_TASK_WORKERS, k);
+        ce_task_a0->configure();
+
+        uint64_t begin = ce_os_time_a0->perf_counter();
+        ce_task_counter_t0 *counter = NULL;
+        ce_task_a0->add(items, SCALE_TASKS, &counter);
+        ce_task_a0->wait_for_counter_no_work(counter, 0);
+        double ms = _ms(begin);
+
+        uint64_t result = 0;
+        for (uint32_t i = 0; i < SCALE_TASKS; ++i) {
+            result += _scale_result[i];
+        }
+
+        if (k == 1) {
+            expected = result;
+            base_ms = ms;
+        } else if (result != expected) {
+            ++failed;
+        }
+
+        printf("scale    %2u workers %.1f ms speedup %.2fx%s\n",
+               k, ms, base_ms / ms, (result == expected) ? "" : " FAIL");
+    }
+
+    CE_FREE(a, items);
+
+    ce_config_a0->set_uint(CONFIG_TASK_WORKERS, workers_cfg);
+    ce_task_a0->configure();
+
+    return failed;
+}
+
+int main(int argc,
+         const char **argv) {
+    uint32_t task_n = (argc > 1) ? (uint32_t) strtoul(argv[1], NULL, 10) : DEFAULT_TASK_COUNT;
+
+    ce_log_a0->register_handler(ce_log_a0->stdout_handler, NULL);
+    ce_init();
+
+    uint32_t failed = run_checks(task_n);
+    failed += run_scaling();
+
+    // Same checks with waiting tasks suspended on fibers
+    printf("fibers\n");
+    ce_config_a0->set_uint(CONFIG_TASK_FIBERS, 1);
+    ce_task_a0->configure();
+    failed += run_checks(task_n);
+
+    ce_shutdown();
+    return failed;
+}